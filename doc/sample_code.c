@@ -1,6 +1,12 @@
 
 //--------------------------------------------------------------------
 
+// This code uses the registers and SRAM of the emulator and static buffers. A version
+// that keeps everything in a context (several cameras, frames in parallel threads) can
+// be found in gbcam_sensor_emu/.
+
+//--------------------------------------------------------------------
+
 // The actual sensor image is 128x126 or so.
 #define GBCAM_SENSOR_EXTRA_LINES (8)
 #define GBCAM_SENSOR_W (128)
@@ -18,6 +24,18 @@ static int gb_cam_retina_output_buf[GBCAM_SENSOR_W][GBCAM_SENSOR_H];
 
 //--------------------------------------------------------------------
 
+// Example of webcam capture using a video file or pipe as source (see
+// sample_webcam_source.c). The source has to be started by the emulator with
+// GB_CameraSourceStart(). If there is no frame yet the previous image is kept.
+#include "sample_webcam_source.h"
+
+static void GB_CameraWebcamCapture(void)
+{
+    GB_CameraSourceGetFrame(gb_camera_webcam_output);
+}
+
+//--------------------------------------------------------------------
+
 static inline int clamp(int min, int value, int max)
 {
     if(value < min) return min;
@@ -48,6 +66,152 @@ static inline u32 gb_cam_matrix_process(u32 value, u32 x, u32 y)
     return 0xC0;
 }
 
+// Edge processing
+// ---------------
+//
+// The processing is selected by N, VH and E3 (filtering mode = N<<3 | VH<<1 | E3).
+// Every mode has a kernel specialized at compile time (all the arguments of the
+// generic kernels are constants), so there are no branches inside the loops. The
+// kernel is selected once per picture from a table.
+//
+// VH selects the 3x3 kernel (0 = none, 1 = horizontal, 2 = vertical, 3 = 2D) and E3
+// selects extraction ({2P-(MW+ME)} * alpha) or enhancement (P + {2P-(MW+ME)} * alpha).
+// If N is 0 the 1-D filter is applied after the 3x3 kernel. Only the modes of the
+// documentation have been tested on hardware, the rest use the same rules.
+
+#define GB_CAM_KERNEL_H BIT(0)
+#define GB_CAM_KERNEL_V BIT(1)
+
+static int gb_cam_temp_buf[GBCAM_SENSOR_W][GBCAM_SENSOR_H];
+
+typedef void (*gb_cam_edge_fn)(int alpha4);
+typedef void (*gb_cam_1d_fn)(void);
+
+// gb_cam_retina_output_buf -> gb_cam_temp_buf. alpha4 = edge ratio * 4
+static inline __attribute__((always_inline))
+void gb_cam_edge_kernel(int kernel, int extraction, int min_value, int max_value, int alpha4)
+{
+    int i, j;
+    for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
+    {
+        int px = gb_cam_retina_output_buf[i][j];
+
+        int edge = 0;
+        if(kernel & GB_CAM_KERNEL_H)
+        {
+            int mw = gb_cam_retina_output_buf[gb_max_int(0,i-1)][j];
+            int me = gb_cam_retina_output_buf[gb_min_int(i+1,GBCAM_SENSOR_W-1)][j];
+            edge += 2*px - mw - me;
+        }
+        if(kernel & GB_CAM_KERNEL_V)
+        {
+            int mn = gb_cam_retina_output_buf[i][gb_max_int(0,j-1)];
+            int ms = gb_cam_retina_output_buf[i][gb_min_int(j+1,GBCAM_SENSOR_H-1)];
+            edge += 2*px - mn - ms;
+        }
+
+        // Same rounding as px + edge * alpha converted to int
+        int value = extraction ? (edge * alpha4) / 4 : (4 * px + edge * alpha4) / 4;
+
+        gb_cam_temp_buf[i][j] = gb_clamp_int(min_value,value,max_value);
+    }
+}
+
+static void gb_cam_edge_copy(int alpha4)
+{
+    memcpy(gb_cam_temp_buf,gb_cam_retina_output_buf,sizeof(gb_cam_temp_buf));
+}
+
+static void gb_cam_edge_zero(int alpha4)
+{
+    memset(gb_cam_temp_buf,0,sizeof(gb_cam_temp_buf));
+}
+
+// When the 1-D filter is enabled the result of the kernel is clamped to [0, 255] (the
+// original code did that for horizontal enhancement, the only 1-D mode with a kernel
+// used by the Game Boy Camera).
+#define GB_CAM_DEFINE_EDGE_KERNEL(name, kernel, extraction, min_value, max_value) \
+    static void name(int alpha4) \
+    { \
+        gb_cam_edge_kernel(kernel,extraction,min_value,max_value,alpha4); \
+    }
+
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_enh_1d, GB_CAM_KERNEL_H, 0, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_ext_1d, GB_CAM_KERNEL_H, 1, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_enh_1d, GB_CAM_KERNEL_V, 0, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_ext_1d, GB_CAM_KERNEL_V, 1, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_enh_1d, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 0, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_ext_1d, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 1, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_enh, GB_CAM_KERNEL_H, 0, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_ext, GB_CAM_KERNEL_H, 1, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_enh, GB_CAM_KERNEL_V, 0, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_ext, GB_CAM_KERNEL_V, 1, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_enh, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 0, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_ext, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 1, -128, 127)
+
+static const struct {
+    gb_cam_edge_fn edge; // gb_cam_retina_output_buf -> gb_cam_temp_buf
+    int filter_1d; // gb_cam_temp_buf -> gb_cam_retina_output_buf (else, it is copied)
+} gb_cam_filter_modes[16] = {
+    // N = 0
+    { gb_cam_edge_copy,      1 }, // 0x0: 1-D filtering (positive/negative image)
+    { gb_cam_edge_zero,      1 }, // 0x1: Always the same color in hardware
+    { gb_cam_edge_h_enh_1d,  1 }, // 0x2: 1-D filtering + Horiz. enhancement : P + {2P-(MW+ME)} * alpha
+    { gb_cam_edge_h_ext_1d,  1 }, // 0x3: 1-D filtering + Horiz. extraction : {2P-(MW+ME)} * alpha
+    { gb_cam_edge_v_enh_1d,  1 }, // 0x4: Undocumented
+    { gb_cam_edge_v_ext_1d,  1 }, // 0x5: Undocumented
+    { gb_cam_edge_2d_enh_1d, 1 }, // 0x6: Undocumented
+    { gb_cam_edge_2d_ext_1d, 1 }, // 0x7: Undocumented
+    // N = 1
+    { gb_cam_edge_copy,      0 }, // 0x8: Undocumented (no processing)
+    { gb_cam_edge_zero,      0 }, // 0x9: Undocumented
+    { gb_cam_edge_h_enh,     0 }, // 0xA: Undocumented
+    { gb_cam_edge_h_ext,     0 }, // 0xB: Undocumented
+    { gb_cam_edge_v_enh,     0 }, // 0xC: Vert. enhancement : P + {2P-(MN+MS)} * alpha
+    { gb_cam_edge_v_ext,     0 }, // 0xD: Vert. extraction : {2P-(MN+MS)} * alpha
+    { gb_cam_edge_2d_enh,    0 }, // 0xE: 2D enhancement : P + {4P-(MN+MS+ME+MW)} * alpha
+    { gb_cam_edge_2d_ext,    0 }, // 0xF: 2D extraction : {4P-(MN+MS+ME+MW)} * alpha
+};
+
+// 1-D filtering: the lines selected in P are added, the ones in M are subtracted.
+// gb_cam_temp_buf -> gb_cam_retina_output_buf
+static inline __attribute__((always_inline)) void gb_cam_1d_kernel(u32 P_bits, u32 M_bits)
+{
+    int i, j;
+    for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
+    {
+        int ms = gb_cam_temp_buf[i][gb_min_int(j+1,GBCAM_SENSOR_H-1)];
+        int px = gb_cam_temp_buf[i][j];
+
+        int value = 0;
+        if(P_bits&BIT(0)) value += px;
+        if(P_bits&BIT(1)) value += ms;
+        if(M_bits&BIT(0)) value -= px;
+        if(M_bits&BIT(1)) value -= ms;
+        gb_cam_retina_output_buf[i][j] = gb_clamp_int(-128,value,127);
+    }
+}
+
+#define GB_CAM_DEFINE_1D_KERNEL(name, P_bits, M_bits) \
+    static void name(void) \
+    { \
+        gb_cam_1d_kernel(P_bits,M_bits); \
+    }
+
+GB_CAM_DEFINE_1D_KERNEL(gb_cam_1d_p0_m1, 0x00, 0x01)
+GB_CAM_DEFINE_1D_KERNEL(gb_cam_1d_p1_m0, 0x01, 0x00)
+GB_CAM_DEFINE_1D_KERNEL(gb_cam_1d_p1_m2, 0x01, 0x02)
+
+// P and M registers of the sensor depending on bits 1 and 2 of register 0.
+static const gb_cam_1d_fn gb_cam_1d_kernels[4] = {
+    gb_cam_1d_p0_m1, // P = 0x00, M = 0x01
+    gb_cam_1d_p1_m0, // P = 0x01, M = 0x00
+    gb_cam_1d_p1_m2, // P = 0x01, M = 0x02
+    gb_cam_1d_p1_m2  // P = 0x01, M = 0x02
+};
+
+//--------------------------------------------------------------------
+
 static void GB_CameraTakePicture(void)
 {
     int i, j;
@@ -65,16 +229,7 @@ static void GB_CameraTakePicture(void)
     // -----------------
 
     // Register 0
-    u32 P_bits = 0;
-    u32 M_bits = 0;
-
-    switch( (CAM_REG[0]>>1)&3 )
-    {
-        case 0: P_bits = 0x00; M_bits = 0x01; break;
-        case 1: P_bits = 0x01; M_bits = 0x00; break;
-        case 2: case 3: P_bits = 0x01; M_bits = 0x02; break;
-        default: break;
-    }
+    gb_cam_1d_fn filter_1d = gb_cam_1d_kernels[(CAM_REG[0]>>1)&3];
 
     // Register 1
     u32 N_bit = (CAM_REG[1] & BIT(7)) >> 7;
@@ -84,9 +239,9 @@ static void GB_CameraTakePicture(void)
     u32 EXPOSURE_bits = CAM_REG[3] | (CAM_REG[2]<<8);
 
     // Register 4
-    const float edge_ratio_lut[8] = { 0.50, 0.75, 1.00, 1.25, 2.00, 3.00, 4.00, 5.00 };
+    const int edge_ratio_lut[8] = { 2, 3, 4, 5, 8, 12, 16, 20 }; // 0.50, 0.75, ... 5.00 (x4)
 
-    float EDGE_alpha = edge_ratio_lut[(CAM_REG[4] & 0x70)>>4];
+    int EDGE_alpha4 = edge_ratio_lut[(CAM_REG[4] & 0x70)>>4];
 
     u32 E3_bit = (CAM_REG[4] & BIT(7)) >> 7;
     u32 I_bit = (CAM_REG[4] & BIT(3)) >> 3;
@@ -126,95 +281,15 @@ static void GB_CameraTakePicture(void)
         gb_cam_retina_output_buf[i][j] = gb_cam_retina_output_buf[i][j]-128;
     }
 
-    int temp_buf[GBCAM_SENSOR_W][GBCAM_SENSOR_H];
-
     u32 filtering_mode = (N_bit<<3) | (VH_bits<<1) | E3_bit;
-    switch(filtering_mode)
-    {
-        case 0x0: // 1-D filtering
-        {
-            for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
-            {
-                temp_buf[i][j] = gb_cam_retina_output_buf[i][j];
-            }
-            for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
-            {
-                int ms = temp_buf[i][gb_min_int(j+1,GBCAM_SENSOR_H-1)];
-                int px = temp_buf[i][j];
-
-                int value = 0;
-                if(P_bits&BIT(0)) value += px;
-                if(P_bits&BIT(1)) value += ms;
-                if(M_bits&BIT(0)) value -= px;
-                if(M_bits&BIT(1)) value -= ms;
-                gb_cam_retina_output_buf[i][j] = gb_clamp_int(-128,value,127);
-            }
-            break;
-        }
-        case 0x2: //1-D filtering + Horiz. enhancement : P + {2P-(MW+ME)} * alpha
-        {
-            for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
-            {
-                int mw = gb_cam_retina_output_buf[gb_max_int(0,i-1)][j];
-                int me = gb_cam_retina_output_buf[gb_min_int(i+1,GBCAM_SENSOR_W-1)][j];
-                int px = gb_cam_retina_output_buf[i][j];
-
-                temp_buf[i][j] = gb_clamp_int(0,px+((2*px-mw-me)*EDGE_alpha),255);
-            }
-            for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
-            {
-                int ms = temp_buf[i][gb_min_int(j+1,GBCAM_SENSOR_H-1)];
-                int px = temp_buf[i][j];
-
-                int value = 0;
-                if(P_bits&BIT(0)) value += px;
-                if(P_bits&BIT(1)) value += ms;
-                if(M_bits&BIT(0)) value -= px;
-                if(M_bits&BIT(1)) value -= ms;
-                gb_cam_retina_output_buf[i][j] = gb_clamp_int(-128,value,127);
-            }
-            break;
-        }
-        case 0xE: //2D enhancement : P + {4P-(MN+MS+ME+MW)} * alpha
-        {
-            for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
-            {
-                int ms = gb_cam_retina_output_buf[i][gb_min_int(j+1,GBCAM_SENSOR_H-1)];
-                int mn = gb_cam_retina_output_buf[i][gb_max_int(0,j-1)];
-                int mw = gb_cam_retina_output_buf[gb_max_int(0,i-1)][j];
-                int me = gb_cam_retina_output_buf[gb_min_int(i+1,GBCAM_SENSOR_W-1)][j];
-                int px  = gb_cam_retina_output_buf[i][j];
-
-                temp_buf[i][j] = gb_clamp_int(-128,px+((4*px-mw-me-mn-ms)*EDGE_alpha),127);
-            }
-            for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
-            {
-                gb_cam_retina_output_buf[i][j] = temp_buf[i][j];
-            }
-            break;
-        }
-        case 0x1:
-        {
-            // In my GB Camera cartridge this is always the same color. The datasheet of the
-            // sensor doesn't have this configuration documented. Maybe this is a bug?
-            for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
-            {
-                gb_cam_retina_output_buf[i][j] = 0;
-            }
-            break;
-        }
-        default:
-        {
-            // Ignore filtering
-            printf("Unsupported GB Cam mode: 0x%X\n"
-                   "%02X %02X %02X %02X %02X %02X",
-                   filtering_mode,
-                   CAM_REG[0],CAM_REG[1],CAM_REG[2],
-                   CAM_REG[3],CAM_REG[4],CAM_REG[5]);
-            break;
-        }
-    }
-	
+
+    gb_cam_filter_modes[filtering_mode].edge(EDGE_alpha4);
+
+    if(gb_cam_filter_modes[filtering_mode].filter_1d)
+        filter_1d();
+    else
+        memcpy(gb_cam_retina_output_buf,gb_cam_temp_buf,sizeof(gb_cam_retina_output_buf));
+
 	// Make unsigned
     for(i = 0; i < GBCAM_SENSOR_W; i++) for(j = 0; j < GBCAM_SENSOR_H; j++)
     {
@@ -0,0 +1,472 @@
+
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sample_webcam_source.h"
+
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+
+//--------------------------------------------------------------------
+
+// Adds a row of bytes to a row of 16 bit accumulators.
+static void gb_cam_source_accumulate_row(u16 * acc, const u8 * row, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for( ; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&row[i]);
+        __m128i a0 = _mm_loadu_si128((const __m128i *)&acc[i]);
+        __m128i a1 = _mm_loadu_si128((const __m128i *)&acc[i+8]);
+        a0 = _mm_add_epi16(a0,_mm_unpacklo_epi8(v,zero));
+        a1 = _mm_add_epi16(a1,_mm_unpackhi_epi8(v,zero));
+        _mm_storeu_si128((__m128i *)&acc[i],a0);
+        _mm_storeu_si128((__m128i *)&acc[i+8],a1);
+    }
+#endif
+
+    for( ; i < n; i++)
+        acc[i] += row[i];
+}
+
+// First source pixel of output pixel i (the last one is the first of i+1)
+static inline int gb_cam_source_box_start(int i, int crop_start, int crop_size, int out_size)
+{
+    return crop_start + (i * crop_size) / out_size;
+}
+
+// Size of the accumulators needed by gb_cam_source_downscale() (one cropped row).
+static size_t gb_cam_source_acc_size(int width, int height, int channels)
+{
+    int crop_w = width;
+    if(width * GB_CAMERA_SOURCE_H > height * GB_CAMERA_SOURCE_W)
+        crop_w = (height * GB_CAMERA_SOURCE_W) / GB_CAMERA_SOURCE_H;
+    if(crop_w < 1) crop_w = 1;
+
+    return crop_w * channels * sizeof(u16);
+}
+
+// acc must have gb_cam_source_acc_size() bytes. It is allocated once per source, this is
+// called for every frame.
+static int gb_cam_source_downscale(const unsigned char * frame, int width, int height,
+                                   int channels, u16 * acc,
+                                   unsigned char out[GB_CAMERA_SOURCE_H][GB_CAMERA_SOURCE_W])
+{
+    const int W = GB_CAMERA_SOURCE_W;
+    const int H = GB_CAMERA_SOURCE_H;
+
+    // Crop the center to the aspect ratio of the sensor
+    int crop_w = width;
+    int crop_h = height;
+    if(width * H > height * W)
+        crop_w = (height * W) / H;
+    else
+        crop_h = (width * H) / W;
+    if(crop_w < 1) crop_w = 1;
+    if(crop_h < 1) crop_h = 1;
+
+    int crop_x = (width - crop_w) / 2;
+    int crop_y = (height - crop_h) / 2;
+
+    // The accumulators are 16 bit, up to 257 rows of 255 can be added.
+    if( (crop_h + H - 1) / H > 257 )
+        return -1;
+
+    int row_size = crop_w * channels;
+
+    int x, y;
+    for(y = 0; y < H; y++)
+    {
+        int y0 = gb_cam_source_box_start(y,crop_y,crop_h,H);
+        int y1 = gb_cam_source_box_start(y+1,crop_y,crop_h,H);
+        if(y1 == y0) y1 = y0 + 1; // Sources smaller than the sensor
+
+        memset(acc,0,row_size * sizeof(u16));
+
+        int j;
+        for(j = y0; j < y1; j++)
+            gb_cam_source_accumulate_row(acc,&frame[(j * width + crop_x) * channels],row_size);
+
+        for(x = 0; x < W; x++)
+        {
+            int x0 = gb_cam_source_box_start(x,0,crop_w,W);
+            int x1 = gb_cam_source_box_start(x+1,0,crop_w,W);
+            if(x1 == x0) x1 = x0 + 1;
+
+            u32 area = (x1 - x0) * (y1 - y0);
+
+            if(channels == 3)
+            {
+                // The average of the luminance is the luminance of the average color.
+                u32 r = 0, g = 0, b = 0;
+                int i;
+                for(i = x0; i < x1; i++)
+                {
+                    r += acc[i*3+0];
+                    g += acc[i*3+1];
+                    b += acc[i*3+2];
+                }
+                r = (r + area/2) / area;
+                g = (g + area/2) / area;
+                b = (b + area/2) / area;
+                out[y][x] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+            }
+            else
+            {
+                u32 l = 0;
+                int i;
+                for(i = x0; i < x1; i++)
+                    l += acc[i];
+                out[y][x] = (l + area/2) / area;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int GB_CameraSourceDownscale(const unsigned char * frame, int width, int height, int channels,
+                             unsigned char out[GB_CAMERA_SOURCE_H][GB_CAMERA_SOURCE_W])
+{
+    u16 * acc = malloc(gb_cam_source_acc_size(width,height,channels));
+    if(acc == NULL)
+        return -1;
+
+    int ret = gb_cam_source_downscale(frame,width,height,channels,acc,out);
+
+    free(acc);
+
+    return ret;
+}
+
+//--------------------------------------------------------------------
+
+// Raw RGB24 file sequence
+
+typedef struct {
+    char pattern[256];
+    int index;
+} gb_cam_rgb_files;
+
+static int gb_cam_rgb_files_read(gb_camera_source * source, unsigned char * frame)
+{
+    gb_cam_rgb_files * files = source->data;
+
+    char name[300];
+    snprintf(name,sizeof(name),files->pattern,files->index);
+    FILE * f = fopen(name,"rb");
+    if( (f == NULL) && (files->index > 0) ) // Loop
+    {
+        files->index = 0;
+        snprintf(name,sizeof(name),files->pattern,files->index);
+        f = fopen(name,"rb");
+    }
+    if(f == NULL)
+        return -1;
+
+    size_t size = source->width * source->height * 3;
+    size_t read = fread(frame,1,size,f);
+    fclose(f);
+
+    files->index++;
+
+    return (read == size) ? 0 : -1;
+}
+
+static void gb_cam_rgb_files_close(gb_camera_source * source)
+{
+    free(source->data);
+    free(source);
+}
+
+gb_camera_source * GB_CameraSourceOpenRGBFiles(const char * pattern, int width, int height)
+{
+    gb_camera_source * source = calloc(1,sizeof(gb_camera_source));
+    gb_cam_rgb_files * files = calloc(1,sizeof(gb_cam_rgb_files));
+    if( (source == NULL) || (files == NULL) )
+    {
+        free(source);
+        free(files);
+        return NULL;
+    }
+
+    snprintf(files->pattern,sizeof(files->pattern),"%s",pattern);
+    files->index = 0;
+
+    source->width = width;
+    source->height = height;
+    source->channels = 3;
+    source->read_frame = gb_cam_rgb_files_read;
+    source->close = gb_cam_rgb_files_close;
+    source->data = files;
+
+    return source;
+}
+
+//--------------------------------------------------------------------
+
+// YUV4MPEG2 stream
+
+typedef struct {
+    FILE * f;
+    size_t chroma_size; // Size of the U and V planes of a frame
+    u8 * chroma; // The chroma planes are read here and ignored
+} gb_cam_y4m;
+
+// Reads a header line without the '\n'. Returns -1 at the end of the file.
+static int gb_cam_y4m_read_line(FILE * f, char * line, int size)
+{
+    int len = 0;
+    while(1)
+    {
+        int c = fgetc(f);
+        if(c == EOF) return -1;
+        if(c == '\n') break;
+        if(len < size - 1) line[len++] = c;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+static int gb_cam_y4m_read(gb_camera_source * source, unsigned char * frame)
+{
+    gb_cam_y4m * y4m = source->data;
+
+    char line[256];
+    if(gb_cam_y4m_read_line(y4m->f,line,sizeof(line)) != 0)
+        return -1;
+    if(strncmp(line,"FRAME",5) != 0)
+        return -1;
+
+    size_t size = source->width * source->height;
+    if(fread(frame,1,size,y4m->f) != size)
+        return -1;
+
+    if(y4m->chroma_size)
+    {
+        if(fread(y4m->chroma,1,y4m->chroma_size,y4m->f) != y4m->chroma_size)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void gb_cam_y4m_close(gb_camera_source * source)
+{
+    gb_cam_y4m * y4m = source->data;
+    if(y4m->f != stdin)
+        fclose(y4m->f);
+    free(y4m->chroma);
+    free(y4m);
+    free(source);
+}
+
+gb_camera_source * GB_CameraSourceOpenY4M(const char * filename)
+{
+    FILE * f = strcmp(filename,"-") ? fopen(filename,"rb") : stdin;
+    if(f == NULL)
+        return NULL;
+
+    char line[256];
+    if( (gb_cam_y4m_read_line(f,line,sizeof(line)) != 0) || strncmp(line,"YUV4MPEG2 ",10) )
+    {
+        if(f != stdin) fclose(f);
+        return NULL;
+    }
+
+    int width = 0, height = 0;
+    char colorspace[32] = "420jpeg"; // Default
+
+    char * token = strtok(line," ");
+    while(token)
+    {
+        if(token[0] == 'W') width = atoi(&token[1]);
+        else if(token[0] == 'H') height = atoi(&token[1]);
+        else if(token[0] == 'C') snprintf(colorspace,sizeof(colorspace),"%s",&token[1]);
+        token = strtok(NULL," ");
+    }
+
+    // Only 8 bit samples are supported (not "420p10", "444p12"...)
+    size_t chroma_size;
+    if(!strcmp(colorspace,"mono"))
+        chroma_size = 0;
+    else if(!strcmp(colorspace,"444"))
+        chroma_size = 2 * width * height;
+    else if(!strcmp(colorspace,"422"))
+        chroma_size = 2 * ((width + 1) / 2) * height;
+    else if(!strcmp(colorspace,"420") || !strcmp(colorspace,"420jpeg") ||
+            !strcmp(colorspace,"420paldv") || !strcmp(colorspace,"420mpeg2"))
+        chroma_size = 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    else
+        chroma_size = (size_t)-1;
+
+    if( (width <= 0) || (height <= 0) || (chroma_size == (size_t)-1) )
+    {
+        if(f != stdin) fclose(f);
+        return NULL;
+    }
+
+    gb_camera_source * source = calloc(1,sizeof(gb_camera_source));
+    gb_cam_y4m * y4m = calloc(1,sizeof(gb_cam_y4m));
+    u8 * chroma = chroma_size ? malloc(chroma_size) : NULL;
+    if( (source == NULL) || (y4m == NULL) || (chroma_size && (chroma == NULL)) )
+    {
+        free(source);
+        free(y4m);
+        free(chroma);
+        if(f != stdin) fclose(f);
+        return NULL;
+    }
+
+    y4m->f = f;
+    y4m->chroma_size = chroma_size;
+    y4m->chroma = chroma;
+
+    source->width = width;
+    source->height = height;
+    source->channels = 1;
+    source->read_frame = gb_cam_y4m_read;
+    source->close = gb_cam_y4m_close;
+    source->data = y4m;
+
+    return source;
+}
+
+//--------------------------------------------------------------------
+
+// Prefetch thread
+
+static pthread_t prefetch_thread;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static gb_camera_source * prefetch_source = NULL;
+static int prefetch_running = 0;
+static int prefetch_drop_frames = 0;
+
+static u8 prefetch_next[GB_CAMERA_SOURCE_H][GB_CAMERA_SOURCE_W]; // Frame not returned yet
+static int prefetch_next_valid = 0;
+static u8 prefetch_last[GB_CAMERA_SOURCE_H][GB_CAMERA_SOURCE_W]; // Last returned frame
+static int prefetch_last_valid = 0;
+
+static void * gb_cam_prefetch_thread(void * arg)
+{
+    gb_camera_source * source = arg;
+
+    u8 * frame = malloc(source->width * source->height * source->channels);
+    u16 * acc = malloc(gb_cam_source_acc_size(source->width,source->height,source->channels));
+    if( (frame == NULL) || (acc == NULL) )
+    {
+        free(frame);
+        free(acc);
+        return NULL;
+    }
+
+    static u8 scaled[GB_CAMERA_SOURCE_H][GB_CAMERA_SOURCE_W];
+
+    while(1)
+    {
+        if(source->read_frame(source,frame) != 0)
+            break;
+
+        if(gb_cam_source_downscale(frame,source->width,source->height,source->channels,acc,
+                                   scaled) != 0)
+            break;
+
+        pthread_mutex_lock(&prefetch_mutex);
+
+        // Wait until the previous frame has been used
+        while(prefetch_running && prefetch_next_valid && !prefetch_drop_frames)
+            pthread_cond_wait(&prefetch_cond,&prefetch_mutex);
+
+        int running = prefetch_running;
+        if(running)
+        {
+            memcpy(prefetch_next,scaled,sizeof(prefetch_next));
+            prefetch_next_valid = 1;
+        }
+
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        if(!running)
+            break;
+    }
+
+    free(frame);
+    free(acc);
+    return NULL;
+}
+
+int GB_CameraSourceStart(gb_camera_source * source, int drop_frames)
+{
+    if( (source == NULL) || prefetch_running )
+        return -1;
+
+    prefetch_source = source;
+    prefetch_running = 1;
+    prefetch_drop_frames = drop_frames;
+    prefetch_next_valid = 0;
+    prefetch_last_valid = 0;
+
+    if(pthread_create(&prefetch_thread,NULL,gb_cam_prefetch_thread,source) != 0)
+    {
+        prefetch_running = 0;
+        prefetch_source = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void GB_CameraSourceStop(void)
+{
+    if(prefetch_source == NULL)
+        return;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    prefetch_running = 0;
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    pthread_join(prefetch_thread,NULL);
+
+    prefetch_source->close(prefetch_source);
+    prefetch_source = NULL;
+}
+
+int GB_CameraSourceGetFrame(int out[GB_CAMERA_SOURCE_W][GB_CAMERA_SOURCE_H])
+{
+    pthread_mutex_lock(&prefetch_mutex);
+    if(prefetch_next_valid)
+    {
+        memcpy(prefetch_last,prefetch_next,sizeof(prefetch_last));
+        prefetch_next_valid = 0;
+        prefetch_last_valid = 1;
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    if(!prefetch_last_valid)
+        return -1;
+
+    int i, j;
+    for(i = 0; i < GB_CAMERA_SOURCE_W; i++) for(j = 0; j < GB_CAMERA_SOURCE_H; j++)
+        out[i][j] = prefetch_last[j][i];
+
+    return 0;
+}
+
+//--------------------------------------------------------------------
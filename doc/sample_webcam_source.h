@@ -0,0 +1,57 @@
+
+//--------------------------------------------------------------------
+
+#ifndef __SAMPLE_WEBCAM_SOURCE__
+#define __SAMPLE_WEBCAM_SOURCE__
+
+// Frame sources for GB_CameraWebcamCapture(). A source reads full resolution video
+// frames, and a prefetch thread converts them to luminance and downscales them to the
+// size of the sensor while the emulator is running.
+
+// Size of the frames returned by GB_CameraSourceGetFrame() (same as the sensor buffer).
+#define GB_CAMERA_SOURCE_W (128)
+#define GB_CAMERA_SOURCE_H (112+8)
+
+typedef struct gb_camera_source gb_camera_source;
+
+struct gb_camera_source {
+    int width, height;
+    int channels; // 1 = luminance only (Y plane), 3 = RGB24
+
+    // Reads the next frame (width * height * channels bytes). Returns 0 on success, -1 at
+    // the end of the stream or on error.
+    int (*read_frame)(gb_camera_source * source, unsigned char * frame);
+    void (*close)(gb_camera_source * source);
+
+    void * data; // Private data of the source
+};
+
+// Sequence of raw RGB24 files. The pattern is a printf format with the frame number
+// ("frame%05d.rgb"). The sequence loops when the next file doesn't exist.
+gb_camera_source * GB_CameraSourceOpenRGBFiles(const char * pattern, int width, int height);
+
+// YUV4MPEG2 stream (for example, the output of "ffmpeg -f yuv4mpegpipe"). Only the Y
+// plane is used. Use "-" to read from stdin.
+gb_camera_source * GB_CameraSourceOpenY4M(const char * filename);
+
+// Starts the prefetch thread. If drop_frames is 0 every frame of the source is returned
+// once (file sequences). If it is 1 the thread keeps reading frames and only the latest
+// one is returned (live sources). Returns 0 on success.
+int GB_CameraSourceStart(gb_camera_source * source, int drop_frames);
+
+// Stops the prefetch thread and closes the source.
+void GB_CameraSourceStop(void);
+
+// Copies the latest prefetched frame (values 0-255). If there is no new frame the
+// previous one is returned again. Returns -1 if no frame has been read yet.
+int GB_CameraSourceGetFrame(int out[GB_CAMERA_SOURCE_W][GB_CAMERA_SOURCE_H]);
+
+// Converts a frame of the source to luminance and downscales it to the sensor size. The
+// center of the frame is cropped to the aspect ratio of the sensor and every output
+// pixel is the average of the source pixels it covers. Returns -1 if the frame is too big.
+int GB_CameraSourceDownscale(const unsigned char * frame, int width, int height, int channels,
+                             unsigned char out[GB_CAMERA_SOURCE_H][GB_CAMERA_SOURCE_W]);
+
+#endif // __SAMPLE_WEBCAM_SOURCE__
+
+//--------------------------------------------------------------------
@@ -12,6 +12,108 @@ const int read_pin = 2;
 
 //--------------------------------------------------------
 
+// Binary trace format (decoded by gbcam_trace_decoder). Every event is a 7 byte record:
+//
+//   byte 0:   TRACE_SYNC | event
+//   byte 1-3: XCK clocks since the previous event (little endian, saturated to 0xFFFFFF)
+//             The clocks of lost events are added to the next one, so the time is kept.
+//   byte 4-5: arguments. LOAD: register address, value. DROPPED: number of lost events
+//             (little endian). 0 otherwise.
+//   byte 6:   checksum, the sum of the 7 bytes is TRACE_CHECKSUM (modulo 256)
+
+#define TRACE_SYNC (0xA0)
+
+#define EVENT_RESET      (0)
+#define EVENT_START      (1)
+#define EVENT_READ_START (2)
+#define EVENT_READ_END   (3)
+#define EVENT_LOAD       (4)
+#define EVENT_DROPPED    (5)
+
+#define TRACE_RECORD_SIZE (7)
+#define TRACE_CHECKSUM (0xFF)
+
+//--------------------------------------------------------
+
+// Events are queued here and sent when the serial port has room for them, so the pins
+// can be polled while the previous events are being sent.
+
+#define QUEUE_SIZE (512) // records, power of 2
+
+unsigned char queue[QUEUE_SIZE][TRACE_RECORD_SIZE];
+unsigned int queue_head = 0; // next record to send
+unsigned int queue_tail = 0; // next free record
+unsigned int queue_dropped = 0;
+
+// Returns 0 if the queue is full and the event has been dropped.
+static inline void setChecksum(unsigned char * r)
+{
+  unsigned char sum = r[0] + r[1] + r[2] + r[3] + r[4] + r[5];
+  r[6] = TRACE_CHECKSUM - sum;
+}
+
+static inline int queueEvent(unsigned int event, unsigned int clocks,
+                             unsigned int arg0, unsigned int arg1)
+{
+  if(queue_tail - queue_head >= QUEUE_SIZE - 1) // keep one record for the DROPPED event
+  {
+    queue_dropped++;
+    return 0;
+  }
+
+  if(queue_dropped)
+  {
+    unsigned char * r = queue[queue_tail++ & (QUEUE_SIZE - 1)];
+    unsigned int dropped = (queue_dropped > 0xFFFF) ? 0xFFFF : queue_dropped;
+    r[0] = TRACE_SYNC | EVENT_DROPPED;
+    r[1] = 0; r[2] = 0; r[3] = 0;
+    r[4] = dropped & 0xFF;
+    r[5] = dropped >> 8;
+    setChecksum(r);
+    queue_dropped = 0;
+
+    if(queue_tail - queue_head >= QUEUE_SIZE - 1)
+    {
+      queue_dropped++;
+      return 0;
+    }
+  }
+
+  if(clocks > 0xFFFFFF) clocks = 0xFFFFFF;
+
+  unsigned char * r = queue[queue_tail++ & (QUEUE_SIZE - 1)];
+  r[0] = TRACE_SYNC | event;
+  r[1] = clocks & 0xFF;
+  r[2] = (clocks >> 8) & 0xFF;
+  r[3] = (clocks >> 16) & 0xFF;
+  r[4] = arg0;
+  r[5] = arg1;
+  setChecksum(r);
+
+  return 1;
+}
+
+static inline void sendQueuedEvent(void)
+{
+  if(queue_head == queue_tail)
+    return;
+
+  if(Serial.availableForWrite() < TRACE_RECORD_SIZE)
+    return;
+
+  Serial.write(queue[queue_head++ & (QUEUE_SIZE - 1)],TRACE_RECORD_SIZE);
+}
+
+//--------------------------------------------------------
+
+// Faster than digitalRead(), it only reads the input register of the port of the pin.
+static inline int readPin(int pin)
+{
+  return (g_APinDescription[pin].pPort->PIO_PDSR & g_APinDescription[pin].ulPin) != 0;
+}
+
+//--------------------------------------------------------
+
 void setup()
 {
   pinMode(start_pin, INPUT);
@@ -21,7 +123,7 @@ void setup()
   pinMode(xck_pin, INPUT);
   pinMode(read_pin, INPUT);
 
-  Serial.begin(57600);
+  Serial.begin(115200);
 }
 
 //--------------------------------------------------------
@@ -35,49 +137,49 @@ unsigned int register_write_data_address = 0;
 
 void loop()
 {
-  int cur_xck = digitalRead(xck_pin);
+  int cur_xck = readPin(xck_pin);
   if(cur_xck != last_xck)
   {
     last_xck = cur_xck;
-    if(cur_xck == HIGH)
+    if(cur_xck)
     {
       //Check START, SIN, RESET, READ
-      register_write_data_address  = (register_write_data_address << 1) | (digitalRead(sin_pin) == HIGH); // SIN
+      register_write_data_address  = (register_write_data_address << 1) | readPin(sin_pin); // SIN
       
-      if(digitalRead(reset_pin) == LOW) // RESET
+      if(readPin(reset_pin) == 0) // RESET
       {
-        char str[50]; sprintf(str,"RESET %u",clocks_elapsed); clocks_elapsed = 0;
-        Serial.println(str);
+        if(queueEvent(EVENT_RESET,clocks_elapsed,0,0)) clocks_elapsed = 0;
       }
-      if(digitalRead(start_pin) == HIGH) // START
+      if(readPin(start_pin)) // START
       {
-        char str[50]; sprintf(str,"START %u",clocks_elapsed); clocks_elapsed = 0;
-        Serial.println(str);
+        if(queueEvent(EVENT_START,clocks_elapsed,0,0)) clocks_elapsed = 0;
       }
       
-      int cur_read = digitalRead(read_pin); // READ
+      int cur_read = readPin(read_pin); // READ
       if(last_read != cur_read)
       {
         last_read = cur_read;
-        char str[50]; sprintf(str,cur_read ? "READ START %u" : "READ END %u",clocks_elapsed); clocks_elapsed = 0;
-        Serial.println(str);
+        if(queueEvent(cur_read ? EVENT_READ_START : EVENT_READ_END,clocks_elapsed,0,0)) clocks_elapsed = 0;
       }
     }
     else
     {
       //Check LOAD
-      if(digitalRead(load_pin))
+      if(readPin(load_pin))
       {
         unsigned int addr = (register_write_data_address>>8)&7;
         unsigned int value = register_write_data_address&0xFF;
-        char str[50]; sprintf(str,"LOAD REG %u ([%X] = %X)",clocks_elapsed,addr,value); clocks_elapsed = 0;
-        Serial.println(str);
+        if(queueEvent(EVENT_LOAD,clocks_elapsed,addr,value)) clocks_elapsed = 0;
         register_write_data_address = 0;
       }
       clocks_elapsed ++;
     }
   }
+
+  // XCK changes in almost every iteration during a capture, the queue has to be drained
+  // even then or it fills up when the trace matters most. This doesn't block, it only
+  // copies a record to the TX buffer of the UART if there is room for it.
+  sendQueuedEvent();
 }
 
 //--------------------------------------------------------
-
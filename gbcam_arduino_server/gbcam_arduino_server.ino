@@ -35,6 +35,18 @@ const int sensor_vout_pin = 17;
 
 #define BIT(n) (1<<(n))
 
+// Mode flags of the one-shot capture command
+#define CAPTURE_THUMBNAIL BIT(0) // Only read 2 rows of tiles
+#define CAPTURE_ANALOG    BIT(1) // Read the analog output of the sensor instead of SRAM
+#define CAPTURE_10BIT     BIT(2) // Analog: 10 bit values, 4 pixels packed in 5 bytes
+#define CAPTURE_EXTRA     BIT(3) // Analog: Send the 8 lines skipped by the controller too
+#define CAPTURE_NO_READOUT BIT(4) // Don't send the picture, it can be read later with I
+#define CAPTURE_CRC       BIT(5) // Pictures: send a CRC after every row of tiles (see U)
+
+// Sent after a capture with CAPTURE_NO_READOUT. Interrupts are disabled while capturing
+// and the UART would lose the bytes of the next command, so the PC waits for this.
+#define CAPTURE_DONE_ACK ('K')
+
 //--------------------------------------------------------
 
 static inline unsigned int asciihextoint(char c)
@@ -50,6 +62,11 @@ static inline unsigned int asciidectoint(char c)
   return 0;
 }
 
+static inline unsigned int asciihextobyte(const char * s)
+{
+  return (asciihextoint(s[0])<<4)|asciihextoint(s[1]);
+}
+
 static inline char inttoasciihex(int n)
 {
   if(n < 10) return '0' + n;
@@ -59,6 +76,16 @@ static inline char inttoasciihex(int n)
 
 //--------------------------------------------------------
 
+// CRC-16-CCITT (polynomial 0x1021), byte at a time without a table
+static inline unsigned int crc16Update(unsigned int crc, unsigned char data)
+{
+  unsigned char x = (crc >> 8) ^ data;
+  x ^= x >> 4;
+  return ((crc << 8) ^ ((unsigned int)x << 12) ^ ((unsigned int)x << 5) ^ x) & 0xFFFF;
+}
+
+//--------------------------------------------------------
+
 static inline void setAddress(unsigned int addr)
 {
   PORTB &= ~BIT(0); // addr_clk_pin
@@ -214,6 +241,32 @@ void processClocks(void)
   setWaitMode();
 }
 
+void processClocksReadStart(void)
+{
+  asm volatile (
+      ".equ PORTB,0x05    \n"
+      ".equ PINC,0x06     \n"
+
+      "cli                \n" // Disable interrupts
+
+        "L_%=:            \n"
+        "sbi PORTB,5      \n" // 2 Cycles | PORTB.5 = PHI pin = PIN 13
+        "nop              \n" // 1 Cycle
+        "nop              \n"
+        "nop              \n"
+        "nop              \n"
+        "nop              \n"
+        "nop              \n"
+        "cbi PORTB,5      \n" // 2 Cycles
+        "nop              \n"
+        "nop              \n"
+        "sbis PINC,2      \n" // 1 Cycle if clear | Skip next instruction if bit set (sensor started to output analog data).
+        "rjmp L_%=        \n" // 2 Cycles         | PINC.2 = sensor_read_pin
+
+      "sei                \n" // Enable interrupts
+      ::);
+}
+
 __attribute__((naked)) void processClocksExposureTime(void)
 {
   asm volatile (
@@ -283,7 +336,8 @@ void writePrintCart(unsigned int address, unsigned int value)
   writeCartByte(address,value);
 }
 
-void takePicture(unsigned char trigger_arg, char is_thumbnail)
+// Leaves the picture in SRAM without sending anything.
+void capturePicture(unsigned char trigger_arg)
 {
   writeCartByte(0x0000,0x0A); // Enable RAM
   writeCartByte(0x4000,0x10); // Set register mode
@@ -291,6 +345,11 @@ void takePicture(unsigned char trigger_arg, char is_thumbnail)
   writeCartByte(0xA000,trigger_arg); // Trigger
 
   processClocks(); // Process
+}
+
+void takePicture(unsigned char trigger_arg, char is_thumbnail)
+{
+  capturePicture(trigger_arg);
 
   writeCartByte(0x4000,0x00); // Set RAM mode, bank 0
   
@@ -307,25 +366,48 @@ void takePicture(unsigned char trigger_arg, char is_thumbnail)
   setWaitMode();
 }
 
-void takePictureReadAnalog(unsigned char trigger_arg)
+// With CAPTURE_10BIT every group of 4 pixels is sent as 5 bytes: the 8 upper bits of
+// each pixel followed by a byte with the 2 lower bits of the 4 pixels (pixel 0 in bits 0-1).
+void takePictureReadAnalog(unsigned char trigger_arg, unsigned char mode)
 {
   writeCartByte(0x0000,0x0A); // Enable RAM
   writeCartByte(0x4000,0x10); // Set register mode
   
   writeCartByte(0xA000,trigger_arg); // Trigger
 
-  processClocksExposureTime();
-    
-  unsigned int _size = 16*8 * 14*8;
+  if(mode & CAPTURE_EXTRA)
+    processClocksReadStart();
+  else
+    processClocksExposureTime();
+  
+  unsigned char packed[5];
+  int packed_count = 0;
+  packed[4] = 0;
+  
+  unsigned int _size = 16*8 * (14*8 + ((mode & CAPTURE_EXTRA) ? 8 : 0));
   while(_size--)
   {
     asm volatile ( ".equ PORTB,0x05\n" "sbi PORTB,5\n" ::);
       
-    unsigned char v = (analogRead(sensor_vout_pin)>>2); // 10 to 8 resolution bits
+    unsigned int v = analogRead(sensor_vout_pin);
     
     asm volatile ( ".equ PORTB,0x05\n" "cbi PORTB,5\n" ::);
-      
-    Serial.write(v);
+    
+    if(mode & CAPTURE_10BIT)
+    {
+      packed[packed_count] = v >> 2;
+      packed[4] |= (v & 3) << (packed_count * 2);
+      if(++packed_count == 4)
+      {
+        Serial.write(packed,5);
+        packed_count = 0;
+        packed[4] = 0;
+      }
+    }
+    else
+    {
+      Serial.write((unsigned char)(v >> 2)); // 10 to 8 resolution bits
+    }
     
     asm volatile ( ".equ PORTB,0x05\n" "sbi PORTB,5\nnop\nnop\nnop\nnop\nnop\nnop\ncbi PORTB,5\n" ::);
   }
@@ -351,10 +433,183 @@ void readPicture(char is_thumbnail)
   setWaitMode();
 }
 
+// Sends rows of tiles of the picture in SRAM. Every row (256 bytes) is followed by its
+// CRC-16-CCITT (initial value FFFF, high byte first) so that the PC can ask again for the
+// rows that arrive corrupted. If send_tiles is 0 only the CRCs are sent, so that the PC
+// can check the rows that it has already received.
+void readPictureRowsCrc(unsigned int row, unsigned int count, char send_tiles)
+{
+  if(row > 14) row = 14;
+  if(row + count > 14) count = 14 - row;
+  
+  writeCartByte(0x0000,0x0A); // Enable RAM
+  writeCartByte(0x4000,0x00); // Set RAM mode, bank 0
+  
+  setReadMode(0xA100 < 0x8000);
+  
+  unsigned int addr = 0xA100 + row * 16 * 16;
+  while(count--)
+  {
+    unsigned int crc = 0xFFFF;
+    unsigned int i;
+    for(i = 0; i < 16 * 16; i++)
+    {
+      setAddress(addr++);
+      unsigned char value = getData();
+      if(send_tiles) Serial.write(value);
+      crc = crc16Update(crc,value);
+    }
+    Serial.write((unsigned char)(crc >> 8));
+    Serial.write((unsigned char)(crc & 0xFF));
+  }
+  setWaitMode();
+}
+
+// Takes a picture and sends it as specified by the mode flags of the M command
+void takePictureMode(unsigned char trigger_arg, unsigned char mode)
+{
+  if(mode & CAPTURE_ANALOG)
+  {
+    takePictureReadAnalog(trigger_arg,mode);
+  }
+  else if(mode & CAPTURE_NO_READOUT)
+  {
+    capturePicture(trigger_arg);
+    Serial.write((unsigned char)CAPTURE_DONE_ACK);
+  }
+  else if(mode & CAPTURE_CRC)
+  {
+    capturePicture(trigger_arg);
+    readPictureRowsCrc(0,(mode & CAPTURE_THUMBNAIL) ? 2 : 14,1);
+  }
+  else
+  {
+    takePicture(trigger_arg,mode & CAPTURE_THUMBNAIL);
+  }
+}
+
+// Reads a rectangle of tiles (x0, y0, width, height in tiles) of the picture in SRAM.
+// Only one of every line_step lines of each tile is sent (1, 2, 4 or 8). Tiles are sent
+// in order, and the lines of every tile from top to bottom (2 bytes per line).
+void readPictureRegion(unsigned int x0, unsigned int y0, unsigned int w, unsigned int h,
+                       unsigned int line_step)
+{
+  if((line_step != 2) && (line_step != 4) && (line_step != 8)) line_step = 1;
+
+  // The PC only requests valid regions, this only keeps the reads inside the picture
+  if(x0 > 16) x0 = 16;
+  if(y0 > 14) y0 = 14;
+  if(x0 + w > 16) w = 16 - x0;
+  if(y0 + h > 14) h = 14 - y0;
+  
+  writeCartByte(0x0000,0x0A); // Enable RAM
+  writeCartByte(0x4000,0x00); // Set RAM mode, bank 0
+  
+  setReadMode(0xA100 < 0x8000);
+  
+  unsigned int y;
+  for(y = y0; y < y0 + h; y++)
+  {
+    unsigned int addr = 0xA100 + (y * 16 + x0) * 16;
+    if(line_step == 1)
+    {
+      unsigned int _size = w * 16;
+      while(_size--)
+      {
+        setAddress(addr++);
+        unsigned char value = getData();
+        Serial.write(value);
+      }
+    }
+    else
+    {
+      unsigned int line;
+      for(line = 0; line < w * 8; line += line_step)
+      {
+        setAddress(addr + line * 2);
+        Serial.write((unsigned char)getData());
+        setAddress(addr + line * 2 + 1);
+        Serial.write((unsigned char)getData());
+      }
+    }
+  }
+  setWaitMode();
+}
+
+// Reads a block of SRAM from the specified bank. The address must be inside the SRAM
+// window (A000-BFFF), the block is cut at the end of the window.
+void readSramBlock(unsigned int bank, unsigned int addr, unsigned int size)
+{
+  if(addr < 0xA000) addr = 0xA000;
+  if(addr > 0xC000) addr = 0xC000;
+  if(size > 0xC000 - addr) size = 0xC000 - addr;
+  
+  writeCartByte(0x0000,0x0A); // Enable RAM
+  writeCartByte(0x4000,bank & 0x0F); // Set RAM mode, bank
+  
+  setReadMode(0xA000 < 0x8000);
+  
+  while(size--)
+  {
+    setAddress(addr++);
+    unsigned char value = getData();
+    Serial.write(value);
+  }
+  setWaitMode();
+}
+
+// regs = hex string with the values of A000 (trigger), A001-A005 and, optionally,
+// A006-A035 (matrix). If the matrix isn't sent the previous values are kept.
+void takePictureOneShot(unsigned char mode, const char * regs, int num_regs)
+{
+  writeCartByte(0x0000,0x0A); // Enable RAM
+  writeCartByte(0x4000,0x10); // Set register mode
+  
+  writeCartByte(0xA000,0x00);
+  
+  int i;
+  for(i = 1; i < num_regs; i++)
+    writeCartByte(0xA000+i,asciihextobyte(&regs[i*2]));
+  
+  unsigned char trigger_arg = asciihextobyte(&regs[0]);
+  
+  takePictureMode(trigger_arg,mode);
+}
+
+// Exposure bracketing. args = hex string with the values of A000 (trigger), A001, A004 and
+// A005 followed by the exposure times (A002-A003, 4 characters each). One picture is
+// taken for every exposure time, and each one is sent as soon as it is ready, like with
+// the M command. The matrix isn't changed.
+void takePictureBracket(unsigned char mode, const char * args, int num_exposures)
+{
+  writeCartByte(0x0000,0x0A); // Enable RAM
+  writeCartByte(0x4000,0x10); // Set register mode
+  
+  writeCartByte(0xA000,0x00);
+  writeCartByte(0xA001,asciihextobyte(&args[2]));
+  writeCartByte(0xA004,asciihextobyte(&args[4]));
+  writeCartByte(0xA005,asciihextobyte(&args[6]));
+  
+  unsigned char trigger_arg = asciihextobyte(&args[0]);
+  
+  int i;
+  for(i = 0; i < num_exposures; i++)
+  {
+    const char * exposure = &args[8 + i*4];
+    
+    writeCartByte(0x4000,0x10); // Set register mode (reading the picture changes it)
+    writeCartByte(0xA002,asciihextobyte(&exposure[0]));
+    writeCartByte(0xA003,asciihextobyte(&exposure[2]));
+    
+    takePictureMode(trigger_arg,mode & ~CAPTURE_NO_READOUT);
+  }
+}
+
 //--------------------------------------------------------
 
-char command_string[20];
+char command_string[128];
 int command_string_ptr;
+int command_length;
 
 //--------------------------------------------------------
 
@@ -365,13 +620,20 @@ void loop()
   while(Serial.available() > 0)
   {
     char c = Serial.read();
+    if(c == '!') // resync: drop the partial command and acknowledge it
+    {
+      command_string_ptr = 0;
+      Serial.write((const uint8_t*)"SYNC",4);
+      continue;
+    }
     command_string[command_string_ptr++] = c;
-    if(command_string_ptr == 19) // overflow
+    if(command_string_ptr == 127) // overflow
     {
       command_string_ptr = 0;
     }
     if(c == '.')
     {
+      command_length = command_string_ptr - 1;
       command_string_ptr = 0;
       command_ready = 1;
       break;
@@ -402,7 +664,7 @@ void loop()
       case 'A': //take picture and read analog values
       {
         unsigned int value = (asciihextoint(command_string[1])<<4)|asciihextoint(command_string[2]);
-        takePictureReadAnalog(value);
+        takePictureReadAnalog(value,0);
         break;
       }
       
@@ -434,6 +696,53 @@ void loop()
         break;
       }
       
+      case 'M': //one-shot capture: M + mode + A000-A005 [+ A006-A035]
+      {
+        unsigned char mode = asciihextobyte(&command_string[1]);
+        int num_regs = (command_length - 3) / 2;
+        if((num_regs == 6) || (num_regs == 6 + 48))
+          takePictureOneShot(mode,&command_string[3],num_regs);
+        break;
+      }
+      
+      case 'K': //bracketing: K + mode + A000 + A001 + A004 + A005 + exposure times (4 each)
+      {
+        unsigned char mode = asciihextobyte(&command_string[1]);
+        int num_exposures = (command_length - 11) / 4;
+        if(num_exposures > 0)
+          takePictureBracket(mode,&command_string[3],num_exposures);
+        break;
+      }
+      
+      case 'U': //read rows of tiles with CRC: U + first row + number of rows
+      {
+        readPictureRowsCrc(asciihextobyte(&command_string[1]),asciihextobyte(&command_string[3]),1);
+        break;
+      }
+      
+      case 'V': //CRC of rows of tiles: V + first row + number of rows
+      {
+        readPictureRowsCrc(asciihextobyte(&command_string[1]),asciihextobyte(&command_string[3]),0);
+        break;
+      }
+      
+      case 'I': //read region of tiles: I + x0 + y0 + width + height [+ line step]
+      {
+        unsigned int line_step = (command_length >= 11) ? asciihextobyte(&command_string[9]) : 1;
+        readPictureRegion(asciihextobyte(&command_string[1]),asciihextobyte(&command_string[3]),
+                          asciihextobyte(&command_string[5]),asciihextobyte(&command_string[7]),
+                          line_step);
+        break;
+      }
+      
+      case 'B': //read block of SRAM: B + bank + address (4) + size (4)
+      {
+        unsigned int addr = (asciihextobyte(&command_string[3])<<8)|asciihextobyte(&command_string[5]);
+        unsigned int size = (asciihextobyte(&command_string[7])<<8)|asciihextobyte(&command_string[9]);
+        readSramBlock(asciihextobyte(&command_string[1]),addr,size);
+        break;
+      }
+      
       case 'Z': //set register mode
       {
         writeCartByte(0x4000,0x10);
@@ -524,6 +833,7 @@ void loop()
 void setup()
 {
   command_string_ptr = 0;
+  command_length = 0;
   
   pinMode(phi_pin, OUTPUT);
   pinMode(nwr_pin, OUTPUT);
@@ -0,0 +1,283 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "bracket.h"
+#include "capture.h"
+#include "image.h"
+#include "debug.h"
+
+//-------------------------------------------------------------------------------------
+
+#define BRACKET_PIXELS (GBCAM_W*GBCAM_H)
+
+//Analog values closer than this to the limits of the range are considered clipped
+#define BRACKET_CLIP_MARGIN (0.02f)
+
+#define BRACKET_TONEMAP_KEY (0.18f)
+
+//Weighted sum of the radiance estimated by every frame
+static float bracket_sum_w[BRACKET_PIXELS];
+static float bracket_sum_wl[BRACKET_PIXELS];
+
+//Used if a pixel is clipped in every frame: radiance estimated by the shortest exposure
+//in which it is too bright and by the longest one in which it is too dark.
+static float bracket_bright[BRACKET_PIXELS];
+static u16 bracket_bright_exposure[BRACKET_PIXELS]; // 0 = not set
+static float bracket_dark[BRACKET_PIXELS];
+static u16 bracket_dark_exposure[BRACKET_PIXELS];
+
+static int bracket_frames = 0;
+
+int Bracket_MakeLadder(u16 center, int frames, u16 * exposures)
+{
+    if(frames < 1)
+        frames = 1;
+    if(frames > BRACKET_MAX_FRAMES)
+        frames = BRACKET_MAX_FRAMES;
+
+    int i;
+    for(i = 0; i < frames; i++)
+    {
+        double value = ldexp((double)center,i - (frames - 1) / 2);
+        if(value < 1.0) value = 1.0;
+        if(value > 65535.0) value = 65535.0;
+        exposures[i] = (u16)value;
+    }
+
+    return frames;
+}
+
+void Bracket_Reset(void)
+{
+    memset(bracket_sum_w,0,sizeof(bracket_sum_w));
+    memset(bracket_sum_wl,0,sizeof(bracket_sum_wl));
+    memset(bracket_bright_exposure,0,sizeof(bracket_bright_exposure));
+    memset(bracket_dark_exposure,0,sizeof(bracket_dark_exposure));
+    bracket_frames = 0;
+}
+
+//value is normalized to 0.0-1.0. clipped is -1 if the real value may be lower, 1 if it may
+//be higher and 0 if it is valid.
+static void Bracket_AddPixel(int i, float value, int clipped, u16 exposure_time)
+{
+    float radiance = value / (float)exposure_time;
+
+    if(clipped > 0)
+    {
+        if( (bracket_bright_exposure[i] == 0) || (exposure_time < bracket_bright_exposure[i]) )
+        {
+            bracket_bright[i] = radiance;
+            bracket_bright_exposure[i] = exposure_time;
+        }
+    }
+    else if(clipped < 0)
+    {
+        if(exposure_time > bracket_dark_exposure[i])
+        {
+            bracket_dark[i] = radiance;
+            bracket_dark_exposure[i] = exposure_time;
+        }
+    }
+    else
+    {
+        //Hat function: values in the middle of the range are the most reliable
+        float weight = 1.0f - fabsf(2.0f * value - 1.0f);
+        bracket_sum_w[i] += weight;
+        bracket_sum_wl[i] += weight * radiance;
+    }
+}
+
+void Bracket_AddFrame(u16 exposure_time, int analog, int dithering)
+{
+    if(exposure_time == 0)
+        exposure_time = 1;
+
+    int x, y;
+
+    if(analog)
+    {
+        float maxval = (float)((1 << analog_bits) - 1);
+        int first_line = analog_lines - GBCAM_H; // Lines skipped by the controller
+
+        for(y = 0; y < GBCAM_H; y++) for(x = 0; x < GBCAM_W; x++)
+        {
+            float value = analogdata[(y+first_line)*GBCAM_SENSOR_W + x] / maxval;
+
+            int clipped = 0;
+            if(value < BRACKET_CLIP_MARGIN) clipped = -1;
+            else if(value > 1.0f - BRACKET_CLIP_MARGIN) clipped = 1;
+
+            Bracket_AddPixel(y*GBCAM_W+x,value,clipped,exposure_time);
+        }
+    }
+    else
+    {
+        u8 matrix[48];
+        GetMatrixRegisters(matrix,dithering);
+
+        for(y = 0; y < GBCAM_H; y++) for(x = 0; x < GBCAM_W; x++)
+        {
+            const u8 * line = &picturedata[((y>>3)*16 + (x>>3))*16 + (y&7)*2];
+            int color = ((line[0] >> (7-(x&7))) & 1) | (((line[1] >> (7-(x&7))) & 1) << 1);
+            int level = 3 - color; // 0 = darkest
+
+            //The value was between two thresholds of the matrix (see QuantizeAnalogToTiles())
+            const u8 * r = &matrix[((y&3)*4 + (x&3)) * 3];
+            int low = (level == 0) ? 0 : r[level-1];
+            int high = (level == 3) ? 256 : r[level];
+
+            int clipped = 0;
+            if( (level == 0) || (high <= low) ) clipped = -1;
+            else if(level == 3) clipped = 1;
+
+            float value = (float)(low + high) / (2.0f * 256.0f);
+
+            Bracket_AddPixel(y*GBCAM_W+x,value,clipped,exposure_time);
+        }
+    }
+
+    bracket_frames++;
+}
+
+static float Bracket_GetRadiance(int i)
+{
+    if(bracket_sum_w[i] > 0.0f)
+        return bracket_sum_wl[i] / bracket_sum_w[i];
+    if(bracket_bright_exposure[i])
+        return bracket_bright[i];
+    if(bracket_dark_exposure[i])
+        return bracket_dark[i];
+    return 0.0f;
+}
+
+void Bracket_GetHDR(unsigned short * out)
+{
+    float max = 0.0f;
+    int i;
+    for(i = 0; i < BRACKET_PIXELS; i++)
+    {
+        float l = Bracket_GetRadiance(i);
+        if(l > max)
+            max = l;
+    }
+
+    float scale = (max > 0.0f) ? (65535.0f / max) : 0.0f;
+    for(i = 0; i < BRACKET_PIXELS; i++)
+        out[i] = (unsigned short)(Bracket_GetRadiance(i) * scale + 0.5f);
+}
+
+void Bracket_ToneMap(unsigned char * out)
+{
+    static float radiance[BRACKET_PIXELS];
+
+    //Log-average of the radiance, mapped to the middle gray
+    double log_sum = 0.0;
+    float max = 0.0f;
+    int i;
+    for(i = 0; i < BRACKET_PIXELS; i++)
+    {
+        radiance[i] = Bracket_GetRadiance(i);
+        log_sum += log(1e-6 + radiance[i]);
+        if(radiance[i] > max)
+            max = radiance[i];
+    }
+
+    float average = (float)exp(log_sum / BRACKET_PIXELS);
+    if(average <= 0.0f)
+    {
+        memset(out,0,BRACKET_PIXELS);
+        return;
+    }
+
+    //The brightest pixel is mapped to white
+    float scale = BRACKET_TONEMAP_KEY / average;
+    float white = max * scale;
+    float white_sq = (white > 0.0f) ? (white * white) : 1.0f;
+
+    for(i = 0; i < BRACKET_PIXELS; i++)
+    {
+        float l = radiance[i] * scale;
+        float d = l * (1.0f + l / white_sq) / (1.0f + l);
+        int value = (int)(d * 255.0f + 0.5f);
+        out[i] = (value > 255) ? 255 : value;
+    }
+}
+
+//-------------------------------------------------------------------------------------
+
+int Bracket_Capture(const u16 * exposures, int frames, BracketFrameCallback callback,
+                    u8 trigger, u8 unk1, u8 unk2, u8 unk3, int dithering, int mode)
+{
+    if( (frames < 1) || (frames > BRACKET_MAX_FRAMES) )
+        return -1;
+
+    mode &= CAPTURE_ANALOG | CAPTURE_10BIT | CAPTURE_EXTRA;
+    int analog = (mode & CAPTURE_ANALOG) != 0;
+
+    Capture_SetStatus("Bracketing...");
+
+    if(SendBracketCommand(mode,trigger,unk1,unk2,unk3,dithering,exposures,frames) == 0)
+    {
+        Debug_Error("SerialWriteData() error in Bracket_Capture()");
+        return -1;
+    }
+
+    Bracket_Reset();
+
+    //The server sends every frame as soon as it has been taken and starts the next one
+    //right after it, the frames are merged while it is busy.
+    int i;
+    for(i = 0; i < frames; i++)
+    {
+        int ret = analog ? ReceivePictureAnalog(mode) : ReceivePicture(0);
+        if(ret != 0)
+            return -1;
+
+        Bracket_AddFrame(exposures[i],analog,dithering);
+
+        if(callback)
+            callback(i,frames);
+    }
+
+    ramDisable();
+
+    Debug_Info("Bracketed %d frames (%s)",frames,analog ? "analog" : "pictures");
+
+    return 0;
+}
+
+int Bracket_Save(const char * prefix)
+{
+    static unsigned short hdr[BRACKET_PIXELS];
+    static unsigned char tonemapped[BRACKET_PIXELS];
+
+    Bracket_GetHDR(hdr);
+    Bracket_ToneMap(tonemapped);
+
+    char filename[1024];
+    int ret = 0;
+
+    snprintf(filename,sizeof(filename),"%s_hdr.pgm",prefix);
+    FILE * f = fopen(filename,"wb");
+    if( (f == NULL) || Image_WritePGM16(f,hdr,GBCAM_W,GBCAM_H,65535) )
+    {
+        Debug_Error("Bracket_Save(): Can't write %s",filename);
+        ret = -1;
+    }
+    if(f) fclose(f);
+
+    snprintf(filename,sizeof(filename),"%s_tonemapped.pgm",prefix);
+    f = fopen(filename,"wb");
+    if( (f == NULL) || Image_WritePGM8(f,tonemapped,GBCAM_W,GBCAM_H) )
+    {
+        Debug_Error("Bracket_Save(): Can't write %s",filename);
+        ret = -1;
+    }
+    if(f) fclose(f);
+
+    return ret;
+}
+
+//-------------------------------------------------------------------------------------
@@ -0,0 +1,42 @@
+
+#ifndef __BRACKET__
+#define __BRACKET__
+
+#include "capture.h"
+
+//Exposure bracketing and HDR merge. The whole exposure ladder is sent to the server in one
+//command and every frame is merged as soon as it is received, while the server is taking
+//the next one. Frames can be pictures (2 bits per pixel) or analog captures.
+
+#define BRACKET_MAX_FRAMES (CAPTURE_BRACKET_MAX)
+
+//Fills exposures with a ladder of exposure times 1 stop apart centered on the specified
+//one (limited to 0001-FFFF). Returns the number of exposure times.
+int Bracket_MakeLadder(u16 center, int frames, u16 * exposures);
+
+//Clears the merged image
+void Bracket_Reset(void);
+
+//Adds the last capture to the merged image (analogdata if analog is 1, picturedata if 0).
+//Every pixel is weighted by how far it is from the limits of the output range. For
+//pictures the value of a pixel is estimated from the thresholds of the matrix.
+void Bracket_AddFrame(u16 exposure_time, int analog, int dithering);
+
+//Relative radiance of every pixel (GBCAM_W x GBCAM_H) scaled to 0-65535
+void Bracket_GetHDR(unsigned short * out);
+
+//Global tone mapping (Reinhard) of the merged image to 8 bit values
+void Bracket_ToneMap(unsigned char * out);
+
+//Takes a picture for every exposure time and merges them. mode is 0 for pictures or
+//CAPTURE_ANALOG with CAPTURE_10BIT and/or CAPTURE_EXTRA. The callback, if it isn't NULL,
+//is called after every frame is merged. Returns 0 on success.
+typedef void (*BracketFrameCallback)(int frame, int frames);
+int Bracket_Capture(const u16 * exposures, int frames, BracketFrameCallback callback,
+                    u8 trigger, u8 unk1, u8 unk2, u8 unk3, int dithering, int mode);
+
+//Writes the merged image as prefix_hdr.pgm (16 bit) and prefix_tonemapped.pgm. Returns 0
+//on success.
+int Bracket_Save(const char * prefix);
+
+#endif // __BRACKET__
@@ -0,0 +1,315 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "calib.h"
+#include "capture.h"
+#include "stack.h"
+#include "debug.h"
+
+//-------------------------------------------------------------------------------------
+
+#define CALIB_MAX_PIXELS (GBCAM_SENSOR_W*GBCAM_SENSOR_H)
+
+#define CALIB_FILE_MAGIC "GBCAMCAL"
+
+int calib_enabled = 0;
+
+//Mode of the maps
+static int calib_bits = 0;
+static int calib_lines = 0;
+static int calib_has_dark = 0;
+static int calib_has_flat = 0;
+
+static u16 calib_dark[CALIB_MAX_PIXELS];
+static short calib_gain[CALIB_MAX_PIXELS];
+static int calib_dark_mean = 0;
+
+void Calib_Reset(void)
+{
+    calib_has_dark = 0;
+    calib_has_flat = 0;
+}
+
+int Calib_IsValid(void)
+{
+    return calib_has_dark && calib_has_flat;
+}
+
+int Calib_SetDark(void)
+{
+    int pixels = GBCAM_SENSOR_W * analog_lines;
+
+    memcpy(calib_dark,analogdata,pixels*sizeof(u16));
+
+    long long sum = 0;
+    int i;
+    for(i = 0; i < pixels; i++)
+        sum += calib_dark[i];
+    calib_dark_mean = (int)((sum + pixels / 2) / pixels);
+
+    calib_bits = analog_bits;
+    calib_lines = analog_lines;
+    calib_has_dark = 1;
+    calib_has_flat = 0;
+
+    Debug_Info("Dark map: %d bits, %d lines, mean %d",calib_bits,calib_lines,calib_dark_mean);
+
+    return 0;
+}
+
+int Calib_SetFlat(void)
+{
+    if( !calib_has_dark || (analog_bits != calib_bits) || (analog_lines != calib_lines) )
+    {
+        Debug_Error("Calib_SetFlat(): The flat capture doesn't match the dark map");
+        return -1;
+    }
+
+    int pixels = GBCAM_SENSOR_W * calib_lines;
+
+    //Mean of the pixels that are brighter than their dark value
+    long long sum = 0;
+    int lit = 0;
+    int i;
+    for(i = 0; i < pixels; i++)
+    {
+        int value = (int)analogdata[i] - calib_dark[i];
+        if(value > 0)
+        {
+            sum += value;
+            lit++;
+        }
+    }
+
+    if(lit < pixels / 2)
+    {
+        Debug_Error("Calib_SetFlat(): The flat capture is too dark");
+        return -1;
+    }
+
+    double mean = (double)sum / lit;
+    if(mean < (1 << calib_bits) / 16)
+        Debug_Warn("Calib_SetFlat(): The flat capture is very dark, the gain will be noisy");
+
+    //Dead pixels and pixels that would need too much gain aren't corrected
+    int clipped = 0;
+    for(i = 0; i < pixels; i++)
+    {
+        int value = (int)analogdata[i] - calib_dark[i];
+        double gain = (value > 0) ? (mean / value) : 0.0;
+
+        if( (gain <= 0.0) || (gain * CALIB_GAIN_ONE > CALIB_GAIN_MAX) )
+        {
+            calib_gain[i] = CALIB_GAIN_ONE;
+            clipped++;
+        }
+        else
+        {
+            calib_gain[i] = (short)(gain * CALIB_GAIN_ONE + 0.5);
+        }
+    }
+
+    calib_has_flat = 1;
+
+    Debug_Info("Flat map: mean %.1f, %d pixels not corrected",mean,clipped);
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+int Calib_Apply(unsigned short * data)
+{
+    if( !Calib_IsValid() || (analog_bits != calib_bits) || (analog_lines != calib_lines) )
+        return -1;
+
+    int pixels = GBCAM_SENSOR_W * calib_lines;
+    int maxval = (1 << calib_bits) - 1;
+
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(maxval);
+    const __m128i offset = _mm_set1_epi16(calib_dark_mean);
+    for( ; i + 8 <= pixels; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+        __m128i d = _mm_loadu_si128((const __m128i *)&calib_dark[i]);
+        __m128i g = _mm_loadu_si128((const __m128i *)&calib_gain[i]);
+
+        //The difference is 11 bits with sign at most, so it can be shifted 3 bits. The high
+        //half of the product by the gain is the corrected difference.
+        __m128i diff = _mm_slli_epi16(_mm_sub_epi16(v,d),16 - CALIB_GAIN_SHIFT);
+        __m128i c = _mm_add_epi16(_mm_mulhi_epi16(diff,g),offset);
+
+        c = _mm_min_epi16(_mm_max_epi16(c,zero),max);
+        _mm_storeu_si128((__m128i *)&data[i],c);
+    }
+#endif
+
+    //Same operations as the SIMD version, the results are identical
+    for( ; i < pixels; i++)
+    {
+        int diff = ((int)data[i] - calib_dark[i]) * (1 << (16 - CALIB_GAIN_SHIFT));
+        int c = ((diff * calib_gain[i]) >> 16) + calib_dark_mean;
+
+        if(c < 0) c = 0;
+        if(c > maxval) c = maxval;
+        data[i] = c;
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+int Calib_Capture(int frames, u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                  int dithering, int mode)
+{
+    if(frames < 1)
+        frames = 1;
+    if(frames > STACK_MAX_FRAMES)
+        frames = STACK_MAX_FRAMES;
+
+    //The maps are built from the values of the sensor
+    int enabled = calib_enabled;
+    calib_enabled = 0;
+
+    int ret = -1;
+
+    Capture_SetStatus("Calibration: dark frame...");
+    if(Stack_Capture(frames,STACK_MODE_MEAN,NULL,trigger,unk1,CALIB_DARK_EXPOSURE,
+                     unk2,unk3,dithering,mode) == 0)
+    {
+        Calib_SetDark();
+
+        Capture_SetStatus("Calibration: flat frame...");
+        if(Stack_Capture(frames,STACK_MODE_MEAN,NULL,trigger,unk1,exposure_time,
+                         unk2,unk3,dithering,mode) == 0)
+            ret = Calib_SetFlat();
+    }
+
+    calib_enabled = enabled;
+
+    return ret;
+}
+
+//-------------------------------------------------------------------------------------
+
+//Format: magic, bits, lines, mean of the dark map (16 bit) and both maps. All values are
+//little endian.
+
+static int Calib_Write16(FILE * f, int value)
+{
+    return (fputc(value & 0xFF,f) == EOF) || (fputc((value >> 8) & 0xFF,f) == EOF);
+}
+
+static int Calib_Read16(FILE * f, int * value)
+{
+    int lo = fgetc(f);
+    int hi = fgetc(f);
+    if( (lo == EOF) || (hi == EOF) )
+        return -1;
+
+    *value = lo | (hi << 8);
+    return 0;
+}
+
+int Calib_Save(const char * filename)
+{
+    if(!Calib_IsValid())
+    {
+        Debug_Error("Calib_Save(): There are no maps to save");
+        return -1;
+    }
+
+    FILE * f = fopen(filename,"wb");
+    if(f == NULL)
+    {
+        Debug_Error("Calib_Save(): Can't open %s",filename);
+        return -1;
+    }
+
+    int error = fwrite(CALIB_FILE_MAGIC,1,8,f) != 8;
+    error |= fputc(calib_bits,f) == EOF;
+    error |= fputc(calib_lines,f) == EOF;
+    error |= Calib_Write16(f,calib_dark_mean);
+
+    int pixels = GBCAM_SENSOR_W * calib_lines;
+    int i;
+    for(i = 0; (i < pixels) && !error; i++)
+        error |= Calib_Write16(f,calib_dark[i]);
+    for(i = 0; (i < pixels) && !error; i++)
+        error |= Calib_Write16(f,(u16)calib_gain[i]);
+
+    if(fclose(f) != 0)
+        error = 1;
+
+    if(error)
+    {
+        Debug_Error("Calib_Save(): Can't write %s",filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+int Calib_Load(const char * filename)
+{
+    FILE * f = fopen(filename,"rb");
+    if(f == NULL)
+        return -1;
+
+    Calib_Reset();
+
+    char magic[8];
+    int bits = 0, lines = 0, mean = 0;
+    int error = (fread(magic,1,8,f) != 8) || memcmp(magic,CALIB_FILE_MAGIC,8);
+    if(!error)
+    {
+        bits = fgetc(f);
+        lines = fgetc(f);
+        error = ((bits != 8) && (bits != 10)) ||
+                ((lines != GBCAM_H) && (lines != GBCAM_SENSOR_H)) ||
+                Calib_Read16(f,&mean);
+    }
+
+    int pixels = GBCAM_SENSOR_W * lines;
+    int i, value = 0;
+    for(i = 0; (i < pixels) && !error; i++)
+    {
+        error = Calib_Read16(f,&value);
+        calib_dark[i] = value;
+    }
+    for(i = 0; (i < pixels) && !error; i++)
+    {
+        error = Calib_Read16(f,&value);
+        calib_gain[i] = (short)(u16)value;
+    }
+
+    fclose(f);
+
+    if(error)
+    {
+        Debug_Error("Calib_Load(): %s isn't a valid calibration file",filename);
+        return -1;
+    }
+
+    calib_bits = bits;
+    calib_lines = lines;
+    calib_dark_mean = mean;
+    calib_has_dark = 1;
+    calib_has_flat = 1;
+
+    Debug_Info("Calibration loaded from %s: %d bits, %d lines",filename,bits,lines);
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
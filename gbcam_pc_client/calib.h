@@ -0,0 +1,51 @@
+
+#ifndef __CALIB__
+#define __CALIB__
+
+#include "capture.h"
+
+//Dark frame and flat field correction of analog captures. The fixed pattern of the sensor
+//(offset of every pixel and column) is measured with the minimum exposure time, and the
+//gain of every pixel with a uniformly lit scene:
+//
+//    corrected = (value - dark) * gain + mean(dark),   gain = mean(flat - dark) / (flat - dark)
+//
+//The corrected values have the same range as the captured ones. The maps are only valid
+//for the registers A001, A004, A005 and the analog mode they were taken with.
+
+#define CALIB_DARK_EXPOSURE (0x0000)
+
+//The gain is stored in 3.13 fixed point, so that it can be multiplied by the difference
+//(shifted 3 bits to the left) with 16 bit operations.
+#define CALIB_GAIN_SHIFT (13)
+#define CALIB_GAIN_ONE (1<<CALIB_GAIN_SHIFT)
+#define CALIB_GAIN_MAX (0x7FFF)
+
+#define CALIB_DEFAULT_FRAMES (16) // Captures stacked to get every map
+
+//If set, every analog capture is corrected when it is received
+extern int calib_enabled;
+
+void Calib_Reset(void); //Clears the maps
+int Calib_IsValid(void); //Returns 1 if there are dark and flat maps
+
+//Build the maps from the capture in analogdata (usually the result of stacking several
+//captures). The dark map has to be set first, the flat map must have the same mode.
+//Return 0 on success.
+int Calib_SetDark(void);
+int Calib_SetFlat(void);
+
+//Corrects an analog capture with the mode of analogdata (analog_bits and analog_lines).
+//Returns -1 if there are no maps for that mode.
+int Calib_Apply(unsigned short * data);
+
+//Takes stacked dark and flat captures (the flat one with the specified exposure time, of a
+//uniformly lit scene) and builds the maps. mode is CAPTURE_10BIT and/or CAPTURE_EXTRA. The
+//captures aren't corrected. Returns 0 on success.
+int Calib_Capture(int frames, u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                  int dithering, int mode);
+
+int Calib_Save(const char * filename); //Returns 0 on success
+int Calib_Load(const char * filename); //Returns 0 on success
+
+#endif // __CALIB__
@@ -0,0 +1,1093 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "serial.h"
+#include "debug.h"
+#include "timing.h"
+#include "timer.h"
+#include "image.h"
+#include "calib.h"
+
+//-------------------------------------------------------------------------------------
+
+unsigned char picturedata[16*14*16]; // tile bytes
+
+unsigned short analogdata[GBCAM_SENSOR_W*GBCAM_SENSOR_H];
+int analog_bits = 8; // 8 or 10
+int analog_lines = GBCAM_H; // GBCAM_H or GBCAM_SENSOR_H
+
+unsigned char c1 = 0x40, c2 = 0x80, c3 = 0xC0;
+
+int capture_crc = 0;
+
+//-------------------------------------------------------------------------------------
+
+//Time that the server may need to start answering the last capture command
+static double capture_delay_ms = 0.0;
+
+//Time that the clock loop of the F command may need to finish the capture
+static double ready_delay_ms = 0.0;
+
+int Capture_WaitInQueueTimeout(int bytes, int timeout_ms)
+{
+    //The timeout is restarted every time something is received
+    int last_size = SerialGetInQueue();
+    unsigned long long last_data = Timer_GetMicroseconds();
+
+    while(1)
+    {
+        int size = SerialGetInQueue();
+        if(size >= bytes)
+            return 0;
+
+        unsigned long long now = Timer_GetMicroseconds();
+        if(size != last_size)
+        {
+            last_size = size;
+            last_data = now;
+        }
+        else if(now - last_data >= timeout_ms * 1000ULL)
+        {
+            return -1;
+        }
+
+        if(Capture_Idle()) exit(0);
+    }
+}
+
+int Capture_WaitInQueue(int bytes)
+{
+    return Capture_WaitInQueueTimeout(bytes,CAPTURE_TIMEOUT_MS);
+}
+
+void Capture_ExpectDelay(double ms)
+{
+    capture_delay_ms = ms;
+}
+
+static int CaptureTimeoutMs(void)
+{
+    //The model can be off by a lot if it hasn't been calibrated
+    return CAPTURE_TIMEOUT_MS + (int)(2.0 * capture_delay_ms);
+}
+
+//Sets the delay of a capture with the specified registers
+static void ExpectCapture(u8 unk1, u16 exposure_time)
+{
+    Capture_ExpectDelay(Timing_PredictCaptureMs(unk1,exposure_time,0));
+}
+
+int Capture_WaitCapture(int bytes)
+{
+    return Capture_WaitInQueueTimeout(bytes,CaptureTimeoutMs());
+}
+
+int Capture_Resync(void)
+{
+    const char * marker = "SYNC";
+
+    int retry;
+    for(retry = 0; retry < CAPTURE_RESYNC_RETRIES; retry++)
+    {
+        //Wait until the server has finished sending whatever it was sending
+        while(Capture_WaitInQueue(1) == 0)
+        {
+            char buffer[256];
+            int size = SerialGetInQueue();
+            if(size > (int)sizeof(buffer))
+                size = sizeof(buffer);
+            if(SerialReadData(buffer,size) != size)
+                return -1;
+        }
+
+        if(SerialWriteData("!",1) == 0)
+        {
+            Debug_Error("SerialWriteData <!> error.");
+            return -1;
+        }
+
+        //The server may still be busy with a capture, everything before the marker is
+        //the end of the previous answer
+        int matched = 0;
+        while( (matched < 4) && (Capture_WaitCapture(1) == 0) )
+        {
+            char c;
+            if(SerialReadData(&c,1) != 1)
+                return -1;
+
+            if(c == marker[matched])
+                matched++;
+            else
+                matched = (c == marker[0]) ? 1 : 0;
+        }
+
+        if(matched == 4)
+        {
+            Debug_Info("Resynchronized with the server");
+            return 0;
+        }
+    }
+
+    Debug_Error("The server doesn't answer to resync requests");
+    return -1;
+}
+
+//A byte hasn't arrived in time. Returns -1 so that it can be returned by the caller.
+static int Capture_Timeout(const char * function)
+{
+    Debug_Error("Timeout in %s()",function);
+    Capture_Resync();
+    return -1;
+}
+
+//-------------------------------------------------------------------------------------
+
+static inline unsigned int asciihextoint(char c)
+{
+  if((c >= '0') && (c <= '9')) return c - '0';
+  if((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  return 0;
+}
+
+int readByte(unsigned int addr)
+{
+    char str[50];
+
+    char data[2];
+
+    sprintf(str,"R%04X.",addr&0xFFFF);
+    if(SerialWriteData(str,6) == 0)
+    {
+        Debug_Error("SerialWriteData() error in readByte()");
+        return -1;
+    }
+
+    if(Capture_WaitInQueue(2) != 0)
+        return Capture_Timeout("readByte");
+
+    if(SerialReadData(data,2) != 2)
+    {
+        Debug_Error("SerialReadData() error in readByte()");
+        return -1;
+    }
+
+    return (asciihextoint(data[0])<<4)|asciihextoint(data[1]);
+}
+
+void writeByte(unsigned int addr, unsigned int value)
+{
+    char str[50];
+    sprintf(str,"W%04X%02X.",addr&0xFFFF,value&0xFF);
+    SerialWriteData(str,8);
+    return;
+}
+
+void setRegisterMode(void)
+{
+    SerialWriteData("Z.",2);
+    return;
+}
+
+void setRamModeBank0(void)
+{
+    SerialWriteData("X.",2);
+    return;
+}
+
+//-------------------------------------------------------------------------------------
+
+u16 Capture_Crc16(u16 crc, const u8 * data, int size)
+{
+    //Same as crc16Update() in the server
+    int i;
+    for(i = 0; i < size; i++)
+    {
+        u8 x = (crc >> 8) ^ data[i];
+        x ^= x >> 4;
+        crc = (crc << 8) ^ ((u16)x << 12) ^ ((u16)x << 5) ^ x;
+    }
+    return crc;
+}
+
+//Reads up to size bytes. It fails if no data is received for timeout_ms (first_timeout_ms
+//for the first byte). Returns the number of bytes read.
+static int ReadDataTimeout(u8 * buffer, int size, int first_timeout_ms, int timeout_ms)
+{
+    int done = 0;
+    int timeout = first_timeout_ms;
+    unsigned long long last_data = Timer_GetMicroseconds();
+
+    while(done < size)
+    {
+        int available = SerialGetInQueue();
+        if(available > size - done)
+            available = size - done;
+
+        if(available > 0)
+        {
+            if(SerialReadData((char*)&buffer[done],available) != available)
+                break;
+            done += available;
+            timeout = timeout_ms;
+            last_data = Timer_GetMicroseconds();
+            continue;
+        }
+
+        if(Timer_GetMicroseconds() - last_data >= timeout * 1000ULL)
+            break;
+
+        if(Capture_Idle()) exit(0);
+    }
+
+    return done;
+}
+
+//Receives rows of tiles followed by their CRC. Rows that are corrupted or missing are
+//marked in bad_rows. Returns the number of bad rows.
+static int ReceiveRowsCrc(int first_row, int rows, u8 * bad_rows, int first_timeout_ms)
+{
+    int bad = 0;
+    int row;
+    for(row = first_row; row < first_row + rows; row++)
+    {
+        u8 buffer[16*16+2];
+        int timeout = (row == first_row) ? first_timeout_ms : CAPTURE_TIMEOUT_MS;
+        int size = ReadDataTimeout(buffer,sizeof(buffer),timeout,CAPTURE_TIMEOUT_MS);
+
+        if(size != (int)sizeof(buffer))
+        {
+            //The server has stopped sending data, the rest of the rows are lost
+            for( ; row < first_row + rows; row++)
+            {
+                bad_rows[row] = 1;
+                bad++;
+            }
+            break;
+        }
+
+        u16 crc = (buffer[16*16] << 8) | buffer[16*16+1];
+        if(Capture_Crc16(0xFFFF,buffer,16*16) != crc)
+        {
+            bad_rows[row] = 1;
+            bad++;
+            continue;
+        }
+
+        memcpy(&picturedata[row*16*16],buffer,16*16);
+        bad_rows[row] = 0;
+    }
+
+    return bad;
+}
+
+//Reads again with U the rows marked in bad_rows. resync is 0 if the last answer of the
+//server has been received completely.
+static int ReadRowsCrcAgain(int rows, u8 * bad_rows, int bad, int resync)
+{
+    int retry;
+    for(retry = 0; (retry < CAPTURE_CRC_RETRIES) && (bad > 0); retry++)
+    {
+        Debug_Warn("%d rows of tiles corrupted, reading them again",bad);
+
+        //If a byte has been inserted the end of the transfer is still being received, and
+        //if one has been lost the server may be waiting for the end of a command
+        if( (resync || (retry > 0)) && (Capture_Resync() != 0) )
+            return -1;
+
+        int row = 0;
+        while(row < rows)
+        {
+            if(!bad_rows[row])
+            {
+                row++;
+                continue;
+            }
+
+            int count = 1;
+            while( (row + count < rows) && bad_rows[row + count] )
+                count++;
+
+            char str[10];
+            sprintf(str,"U%02X%02X.",row,count);
+            if(SerialWriteData(str,6) == 0)
+            {
+                Debug_Error("SerialWriteData <U> error.");
+                return -1;
+            }
+
+            bad -= count;
+            bad += ReceiveRowsCrc(row,count,bad_rows,CAPTURE_TIMEOUT_MS*4);
+
+            row += count;
+        }
+    }
+
+    if(bad > 0)
+    {
+        Debug_Error("%d rows of tiles couldn't be read",bad);
+        return -1;
+    }
+
+    return 0;
+}
+
+//Receives a picture sent with CAPTURE_CRC (or after sending U) and asks again for the
+//rows that are wrong. The first byte can take as long as the capture.
+static int ReceiveRowsCrcRetry(int rows, int first_timeout_ms)
+{
+    u8 bad_rows[14];
+    int bad = ReceiveRowsCrc(0,rows,bad_rows,first_timeout_ms);
+
+    return ReadRowsCrcAgain(rows,bad_rows,bad,1);
+}
+
+//A transfer of tiles without CRC has stopped after receiving the specified number of
+//bytes. A byte has been lost, but it isn't known where, so the count can't be trusted. The
+//server sends the CRC of every row in SRAM (V), the rows received that match it are kept
+//and the rest are read again with U.
+static int ResumeTiles(int rows, int received, const char * function)
+{
+    if(Capture_Resync() != 0)
+        return -1;
+
+    char str[10];
+    sprintf(str,"V%02X%02X.",0,rows);
+    if(SerialWriteData(str,6) == 0)
+    {
+        Debug_Error("SerialWriteData <V> error.");
+        return -1;
+    }
+
+    u8 crcs[14*2];
+    if(ReadDataTimeout(crcs,rows*2,CAPTURE_TIMEOUT_MS*4,CAPTURE_TIMEOUT_MS) != rows*2)
+        return Capture_Timeout(function);
+
+    u8 bad_rows[14];
+    int bad = 0;
+    int row;
+    for(row = 0; row < rows; row++)
+    {
+        u16 crc = (crcs[row*2] << 8) | crcs[row*2+1];
+        int complete = (row + 1) * 16*16 <= received;
+        bad_rows[row] = !complete || (Capture_Crc16(0xFFFF,&picturedata[row*16*16],16*16) != crc);
+        bad += bad_rows[row];
+    }
+
+    Debug_Warn("%s(): Transfer stopped, %d of %d rows confirmed by their CRC",function,
+               rows-bad,rows);
+
+    return ReadRowsCrcAgain(rows,bad_rows,bad,0);
+}
+
+//Receives size bytes of the tiles at A100 to picturedata. If resume is set and the server
+//stops sending them, the rows that haven't been received correctly are read again from
+//SRAM. That can't be done if another capture may have been requested after this one.
+static int ReceiveTiles(int size, int resume, const char * function)
+{
+    int done = 0;
+
+    while(done < size)
+    {
+        if(Capture_WaitInQueue(1) != 0)
+        {
+            if(!resume)
+                return Capture_Timeout(function);
+
+            return ResumeTiles(size/(16*16),done,function);
+        }
+
+        int available = SerialGetInQueue();
+        if(available > size - done)
+            available = size - done;
+
+        if(SerialReadData((char*)&picturedata[done],available) != available)
+        {
+            Debug_Error("SerialReadData() error in %s()",function);
+            return -1;
+        }
+
+        done += available;
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+int readPicture(void)
+{
+    Capture_SetStatus("Reading picture...");
+
+    if(capture_crc)
+    {
+        if(SerialWriteData("U000E.",6)==0)
+        {
+            Debug_Error("SerialWriteData <U> error.");
+            return -1;
+        }
+        return ReceiveRowsCrcRetry(14,CAPTURE_TIMEOUT_MS*4);
+    }
+
+    if(SerialWriteData("P.",2)==0)
+    {
+        Debug_Error("SerialWriteData <P.> error.");
+        return -1;
+    }
+
+    return ReceiveTiles(16*14*16,1,"readPicture");
+}
+
+int readThumbnail(void) // 2 rows of tiles
+{
+    Capture_SetStatus("Reading thumbnail...");
+
+    if(SerialWriteData("T.",2)==0)
+    {
+        Debug_Error("SerialWriteData <P.> error.");
+        return -1;
+    }
+
+    return ReceiveTiles(16*2*16,1,"readThumbnail");
+}
+
+//Reads a rectangle of tiles of the picture in SRAM. The tiles are stored in the same place
+//of picturedata as in a full picture, the rest of the buffer isn't modified.
+static int IsValidRegion(int tx, int ty, int tw, int th)
+{
+    return (tx >= 0) && (ty >= 0) && (tw >= 1) && (th >= 1) && (tx + tw <= 16) && (ty + th <= 14);
+}
+
+int readPictureRegion(int tx, int ty, int tw, int th)
+{
+    if(!IsValidRegion(tx,ty,tw,th))
+    {
+        Debug_Error("readPictureRegion(): Invalid region (%d, %d, %d, %d)",tx,ty,tw,th);
+        return -1;
+    }
+
+    Capture_SetStatus("Reading region...");
+
+    char str[50];
+    sprintf(str,"I%02X%02X%02X%02X.",tx&0xFF,ty&0xFF,tw&0xFF,th&0xFF);
+    if(SerialWriteData(str,10)==0)
+    {
+        Debug_Error("SerialWriteData <I> error.");
+        return -1;
+    }
+
+    int y;
+    for(y = ty; y < ty+th; y++)
+    {
+        int i;
+        for(i = 0; i < tw*16; i++)
+        {
+            if(Capture_WaitInQueue(1) != 0)
+                return Capture_Timeout("readPictureRegion");
+
+            unsigned char data;
+            if(SerialReadData((char*)&data,1) != 1)
+            {
+                Debug_Error("SerialReadData() error in readPictureRegion()");
+                return -1;
+            }
+
+            picturedata[(y*16+tx)*16+i] = data;
+        }
+    }
+
+    return 0;
+}
+
+int readPictureRegionLines(int tx, int ty, int tw, int th, int line_step)
+{
+    if(line_step == 1)
+        return readPictureRegion(tx,ty,tw,th);
+
+    //The server reads every line with any other step
+    if( !IsValidRegion(tx,ty,tw,th) || ((line_step != 2) && (line_step != 4) && (line_step != 8)) )
+    {
+        Debug_Error("readPictureRegionLines(): Invalid region (%d, %d, %d, %d) or step %d",
+                    tx,ty,tw,th,line_step);
+        return -1;
+    }
+
+    Capture_SetStatus("Reading region...");
+
+    char str[50];
+    sprintf(str,"I%02X%02X%02X%02X%02X.",tx&0xFF,ty&0xFF,tw&0xFF,th&0xFF,line_step&0xFF);
+    if(SerialWriteData(str,12)==0)
+    {
+        Debug_Error("SerialWriteData <I> error.");
+        return -1;
+    }
+
+    int y;
+    for(y = ty; y < ty+th; y++)
+    {
+        int line;
+        for(line = 0; line < tw*8; line += line_step)
+        {
+            if(Capture_WaitInQueue(2) != 0)
+                return Capture_Timeout("readPictureRegionLines");
+
+            unsigned char data[2];
+            if(SerialReadData((char*)data,2) != 2)
+            {
+                Debug_Error("SerialReadData() error in readPictureRegionLines()");
+                return -1;
+            }
+
+            //Lines of the tiles of a row are consecutive in memory
+            picturedata[(y*16+tx)*16 + line*2 + 0] = data[0];
+            picturedata[(y*16+tx)*16 + line*2 + 1] = data[1];
+        }
+    }
+
+    return 0;
+}
+
+unsigned int waitPictureReady(void)
+{
+    setRegisterMode();
+
+    SerialWriteData("F.",2);
+
+    //The server answers when the capture has finished
+    if(Capture_WaitInQueueTimeout(8,CAPTURE_TIMEOUT_MS + (int)(2.0 * ready_delay_ms)) != 0)
+    {
+        Capture_Timeout("waitPictureReady");
+        return 0;
+    }
+
+    char str[9];
+    if(SerialReadData(str,8) != 8)
+    {
+        Debug_Error("SerialReadData() error in waitPictureReady()");
+        return 0;
+    }
+    str[8] = '\0';
+
+    unsigned int value;
+    sscanf(str,"%u",&value);
+
+    return value;
+}
+
+//-------------------------------------------------------------------------------------
+
+void GetMatrixRegisters(u8 * matrix, int dithering)
+{
+    //const unsigned char matrix_high_light[] = // high light
+    //{
+    //    0x89, 0x92, 0xA2, 0x8F, 0x9E, 0xC6, 0x8A, 0x95, 0xAB, 0x91, 0xA1, 0xCF,
+    //    0x8D, 0x9A, 0xBA, 0x8B, 0x96, 0xAE, 0x8F, 0x9D, 0xC3, 0x8C, 0x99, 0xB7,
+    //    0x8A, 0x94, 0xA8, 0x90, 0xA0, 0xCC, 0x89, 0x93, 0xA5, 0x90, 0x9F, 0xC9,
+    //    0x8E, 0x9C, 0xC0, 0x8C, 0x98, 0xB4, 0x8E, 0x9B, 0xBD, 0x8B, 0x97, 0xB1
+    //};
+
+    const unsigned char matrix_low_light[48] = // low light
+    {
+        0x8C, 0x98, 0xAC, 0x95, 0xA7, 0xDB, 0x8E, 0x9B, 0xB7, 0x97, 0xAA, 0xE7,
+        0x92, 0xA2, 0xCB, 0x8F, 0x9D, 0xBB, 0x94, 0xA5, 0xD7, 0x91, 0xA0, 0xC7,
+        0x8D, 0x9A, 0xB3, 0x96, 0xA9, 0xE3, 0x8C, 0x99, 0xAF, 0x95, 0xA8, 0xDF,
+        0x93, 0xA4, 0xD3, 0x90, 0x9F, 0xC3, 0x92, 0xA3, 0xCF, 0x8F, 0x9E, 0xBF
+    };
+
+    int i;
+    for(i = 0; i < 48; i++)
+    {
+        if(dithering)
+        {
+            matrix[i] = matrix_low_light[i];
+        }
+        else
+        {
+            switch(i%3)
+            {
+                case 0: matrix[i] = c1; break;
+                case 1: matrix[i] = c2; break;
+                case 2: matrix[i] = c3; break;
+            }
+            //matrix[i] = matrix_low_light[i%3];
+        }
+    }
+}
+
+//Quantizes the last analog capture like the controller does with the matrix registers and
+//stores the result in picturedata, so that the thresholds can be tested without taking a
+//new picture. The values read by the server are used as if they were the output of the
+//ADC of the controller (10 bit values are reduced to 8 bits).
+void QuantizeAnalogToTiles(int dithering)
+{
+    u8 matrix[48];
+    GetMatrixRegisters(matrix,dithering);
+
+    memset(picturedata,0,sizeof(picturedata));
+
+    int shift = analog_bits - 8;
+    int first_line = analog_lines - GBCAM_H; // Lines skipped by the controller
+
+    int y, x;
+    for(y = 0; y < GBCAM_H; y++) for(x = 0; x < GBCAM_W; x++)
+    {
+        u32 value = analogdata[(y+first_line)*GBCAM_SENSOR_W + x] >> shift;
+
+        //Same as gb_cam_matrix_process() in doc/sample_code.c
+        const u8 * r = &matrix[((y&3)*4 + (x&3)) * 3];
+        u32 level;
+        if(value < r[0]) level = 0x00;
+        else if(value < r[1]) level = 0x40;
+        else if(value < r[2]) level = 0x80;
+        else level = 0xC0;
+
+        u8 color = 3 - (level >> 6);
+
+        u8 * line = &picturedata[((y>>3)*16 + (x>>3))*16 + (y&7)*2];
+        if(color & 1) line[0] |= 1<<(7-(x&7));
+        if(color & 2) line[1] |= 1<<(7-(x&7));
+    }
+}
+
+//Last matrix sent with a capture command, to avoid sending it again if it hasn't changed
+static u8 server_matrix[48];
+static int server_matrix_valid = 0;
+
+void UpdateMatrixRegisters(int dithering)
+{
+    u8 matrix[48];
+    GetMatrixRegisters(matrix,dithering);
+
+    int i;
+    for(i = 0; i < 48; i++)
+        writeByte(0xA006+i,matrix[i]);
+
+    memcpy(server_matrix,matrix,sizeof(server_matrix));
+    server_matrix_valid = 1;
+}
+
+//Sends all registers and the trigger in one command. The server does the whole
+//capture sequence by itself and starts sending the picture right after it.
+int SendCaptureCommand(u8 mode, u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                       int dithering)
+{
+    u8 matrix[48];
+    GetMatrixRegisters(matrix,dithering);
+
+    return SendCaptureCommandMatrix(mode,trigger,unk1,exposure_time,unk2,unk3,matrix);
+}
+
+int SendCaptureCommandMatrix(u8 mode, u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                             const u8 * matrix)
+{
+    char str[150];
+    int len = sprintf(str,"M%02X%02X%02X%02X%02X%02X%02X",mode&0xFF,trigger&0xFF,unk1&0xFF,
+                      (exposure_time>>8)&0xFF,exposure_time&0xFF,unk2&0xFF,unk3&0xFF);
+    if(matrix)
+    {
+        int i;
+        for(i = 0; i < 48; i++)
+            len += sprintf(&str[len],"%02X",matrix[i]);
+
+        memcpy(server_matrix,matrix,sizeof(server_matrix));
+        server_matrix_valid = 1;
+    }
+    str[len++] = '.';
+
+    ExpectCapture(unk1,exposure_time);
+
+    return SerialWriteData(str,len);
+}
+
+int SendBracketCommand(u8 mode, u8 trigger, u8 unk1, u8 unk2, u8 unk3, int dithering,
+                       const u16 * exposures, int count)
+{
+    if( (count < 1) || (count > CAPTURE_BRACKET_MAX) )
+        return 0;
+
+    //The command doesn't have space for the matrix, it has to be written before
+    if(!(mode & CAPTURE_ANALOG))
+    {
+        u8 matrix[48];
+        GetMatrixRegisters(matrix,dithering);
+        if(!server_matrix_valid || memcmp(matrix,server_matrix,sizeof(matrix)))
+        {
+            ramEnable();
+            setRegisterMode();
+            UpdateMatrixRegisters(dithering);
+        }
+    }
+
+    char str[150];
+    int len = sprintf(str,"K%02X%02X%02X%02X%02X",mode&0xFF,trigger&0xFF,unk1&0xFF,
+                      unk2&0xFF,unk3&0xFF);
+    //Every frame is sent right after it is taken, the next one is taken after that
+    u16 longest = 0;
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        len += sprintf(&str[len],"%04X",exposures[i]&0xFFFF);
+        if(exposures[i] > longest)
+            longest = exposures[i];
+    }
+    str[len++] = '.';
+
+    ExpectCapture(unk1,longest);
+
+    return SerialWriteData(str,len);
+}
+
+static int ReceivePictureTiles(int thumbnail, int resume)
+{
+    //If nothing arrives the command may have been lost, SRAM may have an old picture
+    if(Capture_WaitCapture(1) != 0)
+        return Capture_Timeout("ReceivePicture");
+
+    Capture_SetStatus("Reading picture...");
+
+    return ReceiveTiles(16 * (thumbnail ? 2 : 14) * 16,resume,"ReceivePicture");
+}
+
+int TakePictureAndTransfer(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                           int dithering, int thumbnail)
+{
+    Capture_SetStatus("Taking picture...");
+
+    u8 mode = thumbnail ? CAPTURE_THUMBNAIL : 0;
+    if(capture_crc)
+        mode |= CAPTURE_CRC;
+
+    if(SendCaptureCommand(mode,trigger,unk1,exposure_time,unk2,unk3,dithering) == 0)
+    {
+        Debug_Error("SerialWriteData() error in TakePictureAndTransfer()");
+        return -1;
+    }
+
+    //Nothing else has been requested, so the transfer can be resumed from SRAM
+    int ret = (mode & CAPTURE_CRC) ? ReceivePictureCrc(thumbnail) : ReceivePictureTiles(thumbnail,1);
+    if(ret != 0)
+        return -1;
+
+    ramDisable();
+
+    return 0;
+}
+
+int ReceivePicture(int thumbnail)
+{
+    return ReceivePictureTiles(thumbnail,0);
+}
+
+int ReceivePictureCrc(int thumbnail)
+{
+    Capture_SetStatus("Reading picture...");
+
+    return ReceiveRowsCrcRetry(thumbnail ? 2 : 14,CaptureTimeoutMs());
+}
+
+//mode = CAPTURE_10BIT and/or CAPTURE_EXTRA
+int SendPictureAnalog(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                      int dithering, int mode)
+{
+    Capture_SetStatus("Taking picture...");
+
+    mode &= CAPTURE_10BIT | CAPTURE_EXTRA;
+
+    if(SendCaptureCommand(CAPTURE_ANALOG|mode,trigger,unk1,exposure_time,unk2,unk3,dithering) == 0)
+    {
+        Debug_Error("SerialWriteData() error in SendPictureAnalog()");
+        return -1;
+    }
+
+    return 0;
+}
+
+int ReceivePictureAnalog(int mode)
+{
+    if(Capture_WaitCapture(1) != 0)
+        return Capture_Timeout("ReceivePictureAnalog");
+
+    Capture_SetStatus("Reading picture...");
+
+    analog_bits = (mode & CAPTURE_10BIT) ? 10 : 8;
+    analog_lines = (mode & CAPTURE_EXTRA) ? GBCAM_SENSOR_H : GBCAM_H;
+
+    //Pixels are received in groups of 4 when they are packed (5 bytes per group)
+    int group_pixels = (analog_bits == 10) ? 4 : 1;
+    int group_bytes = (analog_bits == 10) ? 5 : 1;
+
+    int size = GBCAM_SENSOR_W * analog_lines;
+    int i;
+    for(i = 0; i < size; i += group_pixels)
+    {
+        //The values aren't stored anywhere, they can't be read again
+        if(Capture_WaitInQueue(group_bytes) != 0)
+            return Capture_Timeout("ReceivePictureAnalog");
+
+        unsigned char data[5];
+        if(SerialReadData((char*)data,group_bytes) != group_bytes)
+        {
+            Debug_Error("SerialReadData() error in ReceivePictureAnalog()");
+            return -1;
+        }
+
+        if(analog_bits == 10)
+        {
+            int j;
+            for(j = 0; j < 4; j++)
+                analogdata[i+j] = (data[j] << 2) | ((data[4] >> (j*2)) & 3);
+        }
+        else
+        {
+            analogdata[i] = data[0];
+        }
+    }
+
+    if(calib_enabled && (Calib_Apply(analogdata) != 0))
+    {
+        static int warned = 0;
+        if(!warned)
+            Debug_Warn("No calibration maps for this analog mode, captures aren't corrected");
+        warned = 1;
+    }
+
+    return 0;
+}
+
+int TakePictureAnalogAndTransfer(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                            int dithering, int mode)
+{
+    if(SendPictureAnalog(trigger,unk1,exposure_time,unk2,unk3,dithering,mode) != 0)
+        return -1;
+
+    return ReceivePictureAnalog(mode);
+}
+
+//Returns the number of clocks needed to finish the capture
+unsigned int TakePicture(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                         int dithering)
+{
+    Capture_SetStatus("Taking picture...");
+
+    ramEnable();
+    setRegisterMode();
+
+    writeByte(0xA000,0x00);
+
+    writeByte(0xA001,unk1);
+
+    writeByte(0xA002,(exposure_time>>8)&0xFF);
+    writeByte(0xA003,exposure_time&0xFF);
+
+    writeByte(0xA004,unk2);
+
+    writeByte(0xA005,unk3);
+
+    UpdateMatrixRegisters(dithering);
+
+    ready_delay_ms = (Timing_PredictClocks(unk1,exposure_time) * 1000.0) / CAPTURE_READY_LOOP_HZ;
+
+    writeByte(0xA000,trigger);
+
+    unsigned int clks = 0;
+    while(1)
+    {
+        clks += waitPictureReady();
+        int a = readByte(0xA000);
+        if((a < 0) || ((a & 1) == 0)) break;
+        //sprintf(text,"%d - %u",a,clks);
+        //Capture_SetStatus(text);
+    }
+
+    ramDisable();
+
+    return clks;
+}
+
+void TakePictureDebug(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3)
+{
+    Capture_SetStatus("Taking picture...");
+
+    ramEnable();
+    setRegisterMode();
+
+    writeByte(0xA000,0x00);
+
+    writeByte(0xA001,unk1);
+
+    writeByte(0xA002,(exposure_time>>8)&0xFF);
+    writeByte(0xA003,exposure_time&0xFF);
+
+    writeByte(0xA004,unk2);
+
+    writeByte(0xA005,unk3);
+
+    writeByte(0xA000,trigger);
+
+    if(SerialWriteData("C.",2) == 0)
+    {
+        Debug_Error("SerialWriteData() error in TakePictureDebug()");
+        return;
+    }
+
+    ramDisable();
+}
+
+int TakePicturePreview(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                       int dithering, int line_step)
+{
+    Capture_SetStatus("Preview...");
+
+    u8 matrix[48];
+    GetMatrixRegisters(matrix,dithering);
+    int send_matrix = !server_matrix_valid || memcmp(matrix,server_matrix,sizeof(matrix));
+
+    if(SendCaptureCommandMatrix(CAPTURE_NO_READOUT,trigger,unk1,exposure_time,unk2,unk3,
+                                send_matrix ? matrix : NULL) == 0)
+    {
+        Debug_Error("SerialWriteData() error in TakePicturePreview()");
+        return -1;
+    }
+
+    //The server has interrupts disabled while it captures, so anything sent before the
+    //acknowledge would be lost
+    if(Capture_WaitCapture(1) != 0)
+        return Capture_Timeout("TakePicturePreview");
+
+    char ack;
+    if( (SerialReadData(&ack,1) != 1) || (ack != CAPTURE_DONE_ACK) )
+    {
+        Debug_Error("TakePicturePreview(): Wrong acknowledge");
+        Capture_Resync();
+        return -1;
+    }
+
+    return readPictureRegionLines(0,0,16,14,line_step);
+}
+
+int TransferPicture(void)
+{
+    ramEnable();
+    setRamModeBank0();
+    int ret = readPicture();
+    ramDisable();
+
+    return ret;
+}
+
+int TransferThumbnail(void)
+{
+    ramEnable();
+    setRamModeBank0();
+    int ret = readThumbnail();
+    ramDisable();
+
+    return ret;
+}
+
+int TransferPictureRegion(int tx, int ty, int tw, int th)
+{
+    int ret = readPictureRegion(tx,ty,tw,th);
+    ramDisable();
+
+    return ret;
+}
+
+//Sweeps the exposure time and the N bit measuring the number of clocks needed by each
+//capture, and measures the time needed to read full pictures and thumbnails. The fitted
+//model is saved to be used in later runs.
+void CalibrateTiming(u8 trigger, u8 unk1, u8 unk2, u8 unk3, int dithering)
+{
+    const u16 exposures[] = { 0x0000, 0x0010, 0x0040, 0x0100, 0x0400, 0x0800, 0x1000, 0x2000 };
+    const int num_exposures = sizeof(exposures) / sizeof(exposures[0]);
+
+    Timing_ClearSamples();
+
+    int n, i;
+    for(n = 0; n < 2; n++) for(i = 0; i < num_exposures; i++)
+    {
+        char str[100];
+        sprintf(str,"Calibrating timing: N=%d exposure=0x%04X",n,exposures[i]);
+        Capture_SetStatus(str);
+
+        u8 reg1 = n ? (unk1 | BIT(7)) : (unk1 & ~BIT(7));
+        unsigned int clocks = TakePicture(trigger,reg1,exposures[i],unk2,unk3,dithering);
+        Timing_AddClockSample(reg1,exposures[i],clocks);
+
+        if(Capture_Idle()) exit(0);
+    }
+
+    for(i = 0; i < 2; i++)
+    {
+        Capture_SetStatus("Calibrating timing: readout");
+
+        unsigned long long start = Timer_GetMicroseconds();
+        TransferPicture();
+        Timing_AddReadoutSample(16*14*16,(Timer_GetMicroseconds()-start)/1000.0);
+
+        start = Timer_GetMicroseconds();
+        TransferThumbnail();
+        Timing_AddReadoutSample(16*2*16,(Timer_GetMicroseconds()-start)/1000.0);
+    }
+
+    if(Timing_FitClocks() != 0)
+        Debug_Warn("CalibrateTiming(): Can't fit clock model");
+    if(Timing_FitReadout() != 0)
+        Debug_Warn("CalibrateTiming(): Can't fit readout model");
+
+    Timing_Report();
+    Timing_Save("timing.txt");
+}
+
+//-------------------------------------------------------------------------------------
+
+//Copies the result of the last capture to the next slot of the ring
+void Capture_PublishFrame(FrameRing * ring, int kind, u8 trigger, u8 unk1, u16 exposure_time,
+                          u8 unk2, u8 unk3)
+{
+    if(ring == NULL)
+        return;
+
+    FrameRingSlot * slot = FrameRing_BeginWrite(ring);
+
+    slot->timestamp_us = Timer_GetMicroseconds();
+    slot->kind = kind;
+    slot->regs[0] = trigger;
+    slot->regs[1] = unk1;
+    slot->regs[2] = exposure_time >> 8;
+    slot->regs[3] = exposure_time & 0xFF;
+    slot->regs[4] = unk2;
+    slot->regs[5] = unk3;
+
+    if(kind == FRAMERING_KIND_ANALOG)
+    {
+        int size = GBCAM_SENSOR_W * analog_lines;
+        int shift = analog_bits - 8;
+        int i;
+        for(i = 0; i < size; i++)
+            slot->pixels[i] = analogdata[i] >> shift;
+
+        slot->width = GBCAM_SENSOR_W;
+        slot->height = analog_lines;
+        slot->tiles_size = 0;
+        slot->analog_bits = analog_bits;
+    }
+    else
+    {
+        int rows = (kind == FRAMERING_KIND_THUMBNAIL) ? 2 : 14;
+
+        memcpy(slot->tiles,picturedata,16*rows*16);
+        Image_TilesToGray(picturedata,16,16,rows,slot->pixels,GBCAM_W);
+
+        slot->width = GBCAM_W;
+        slot->height = rows*8;
+        slot->tiles_size = 16*rows*16;
+        slot->analog_bits = 0;
+    }
+
+    FrameRing_EndWrite(ring);
+}
+
+//-------------------------------------------------------------------------------------
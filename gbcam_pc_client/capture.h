@@ -0,0 +1,170 @@
+
+#ifndef __CAPTURE__
+#define __CAPTURE__
+
+#include "framering.h"
+
+//Protocol of the Arduino server and capture sequences. Nothing in here depends on SDL,
+//the frontend (window or command line) is notified through the Capture_* hooks.
+
+//-------------------------------------------------------------------------------------
+
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+
+#define BIT(n) (1<<(n))
+
+#define GBCAM_W (128)
+#define GBCAM_H (112)
+
+#define GBCAM_SENSOR_EXTRA_LINES (8) // Lines skipped by the controller
+#define GBCAM_SENSOR_W (GBCAM_W)
+#define GBCAM_SENSOR_H (GBCAM_H+GBCAM_SENSOR_EXTRA_LINES)
+
+//Mode flags of the one-shot capture command
+#define CAPTURE_THUMBNAIL BIT(0) // Only read 2 rows of tiles
+#define CAPTURE_ANALOG    BIT(1) // Read the analog output of the sensor instead of SRAM
+#define CAPTURE_10BIT     BIT(2) // Analog: 10 bit values, 4 pixels packed in 5 bytes
+#define CAPTURE_EXTRA     BIT(3) // Analog: Send the 8 lines skipped by the controller too
+#define CAPTURE_NO_READOUT BIT(4) // Don't send the picture, it can be read later with I
+#define CAPTURE_CRC       BIT(5) // Pictures: send a CRC after every row of tiles
+
+//Sent by the server after a capture with CAPTURE_NO_READOUT. It doesn't receive anything
+//while it captures, so nothing can be sent before this byte arrives.
+#define CAPTURE_DONE_ACK ('K')
+
+//-------------------------------------------------------------------------------------
+
+extern unsigned char picturedata[16*14*16]; // tile bytes
+
+//Analog values read from the sensor. The lines skipped by the controller are at the top
+//of the buffer if they have been read.
+extern unsigned short analogdata[GBCAM_SENSOR_W*GBCAM_SENSOR_H];
+extern int analog_bits; // 8 or 10
+extern int analog_lines; // GBCAM_H or GBCAM_SENSOR_H
+
+//Thresholds used for the matrix registers when dithering is disabled
+extern unsigned char c1, c2, c3;
+
+//If set, TakePictureAndTransfer() and TransferPicture() get the picture with a CRC after
+//every row of tiles. The rows that arrive corrupted (or don't arrive) are read again from
+//SRAM without taking the picture again.
+extern int capture_crc;
+
+#define CAPTURE_CRC_RETRIES (3)
+
+u16 Capture_Crc16(u16 crc, const u8 * data, int size); // CRC-16-CCITT, initial value FFFF
+
+//-------------------------------------------------------------------------------------
+
+//Implemented by the frontend
+
+void Capture_SetStatus(const char * text); //Shows what is being done right now
+int Capture_Idle(void); //Called while waiting for the server. Returns 1 to exit the program
+
+//-------------------------------------------------------------------------------------
+
+//Waits until the specified number of bytes can be read from the serial port. It fails if
+//nothing is received for timeout_ms (CAPTURE_TIMEOUT_MS by default), that means that data
+//has been lost. Returns 0 on success and -1 on timeout.
+#define CAPTURE_TIMEOUT_MS (50)
+int Capture_WaitInQueueTimeout(int bytes, int timeout_ms);
+int Capture_WaitInQueue(int bytes);
+
+//The first byte of the answer to a capture command can take as long as the capture. The
+//capture commands set the delay predicted by the timing model, Capture_WaitCapture() is
+//used for the first byte of the answer.
+void Capture_ExpectDelay(double ms);
+int Capture_WaitCapture(int bytes);
+
+//The F command clocks the sensor with digitalWrite(), much slower than a capture command
+//(about 10 times). This is a lower bound of its rate, used for the timeout of
+//waitPictureReady() in TakePicture().
+#define CAPTURE_READY_LOOP_HZ (50000.0)
+
+//Discards everything that is being received and sends '!', the server drops any partial
+//command and answers "SYNC". Returns 0 when both sides are synchronized again.
+#define CAPTURE_RESYNC_RETRIES (3)
+int Capture_Resync(void);
+
+//Number of times that a block of SRAM is read again after a timeout
+#define CAPTURE_RESUME_RETRIES (3)
+
+//-------------------------------------------------------------------------------------
+
+int readByte(unsigned int addr);
+void writeByte(unsigned int addr, unsigned int value);
+
+#define ramEnable() writeByte(0x0000,0x0A)
+
+#define ramDisable() writeByte(0x0000,0x00)
+
+void setRegisterMode(void);
+void setRamModeBank0(void);
+
+//The functions that read data return 0 on success and -1 on error. After a timeout the
+//connection is resynchronized before returning. Pictures read from SRAM are resumed by
+//reading again the rows of tiles that don't match their CRC.
+
+int readPicture(void);
+int readThumbnail(void);
+//The region (in tiles) must be inside the picture (16x14 tiles), -1 is returned if it isn't.
+int readPictureRegion(int tx, int ty, int tw, int th);
+//Only reads one of every line_step lines (1, 2, 4 or 8) of each tile. The other lines of
+//picturedata are left as they were.
+int readPictureRegionLines(int tx, int ty, int tw, int th, int line_step);
+unsigned int waitPictureReady(void);
+
+void GetMatrixRegisters(u8 * matrix, int dithering);
+void UpdateMatrixRegisters(int dithering);
+void QuantizeAnalogToTiles(int dithering); //analogdata -> picturedata
+int SendCaptureCommand(u8 mode, u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                       int dithering);
+//If matrix is NULL it isn't sent and the server keeps the values of the previous capture
+int SendCaptureCommandMatrix(u8 mode, u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                             const u8 * matrix);
+
+//Takes one picture for every exposure time with the same registers. The pictures are sent
+//one after the other as soon as they are ready, each one has to be received with
+//ReceivePicture() or ReceivePictureAnalog(). The matrix is written before if needed.
+#define CAPTURE_BRACKET_MAX (16)
+int SendBracketCommand(u8 mode, u8 trigger, u8 unk1, u8 unk2, u8 unk3, int dithering,
+                       const u16 * exposures, int count);
+
+int TakePictureAndTransfer(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                           int dithering, int thumbnail);
+int ReceivePicture(int thumbnail); //Receives the tiles after a capture command
+//Same after a capture command with CAPTURE_CRC. The rows that arrive corrupted are read
+//again, so no other capture can have been requested.
+int ReceivePictureCrc(int thumbnail);
+//Analog captures can be split to do something else while the server is busy. The next
+//capture can be sent as soon as the previous one has been received.
+int SendPictureAnalog(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                      int dithering, int mode);
+int ReceivePictureAnalog(int mode);
+int TakePictureAnalogAndTransfer(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                                 int dithering, int mode);
+unsigned int TakePicture(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                         int dithering);
+void TakePictureDebug(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3);
+
+//Live preview: the picture is left in SRAM and only one of every line_step lines is read,
+//so it can be repeated several times faster than a full capture. The matrix is only sent
+//if it has changed. The whole picture can be read later with TransferPicture() without
+//taking it again.
+int TakePicturePreview(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                       int dithering, int line_step);
+
+int TransferPicture(void);
+int TransferThumbnail(void);
+int TransferPictureRegion(int tx, int ty, int tw, int th);
+
+void CalibrateTiming(u8 trigger, u8 unk1, u8 unk2, u8 unk3, int dithering);
+
+//Publishes the last capture (picturedata or analogdata) in a frame ring. kind is one of
+//the FRAMERING_KIND_* values. Nothing is done if the ring is NULL.
+void Capture_PublishFrame(FrameRing * ring, int kind, u8 trigger, u8 unk1, u16 exposure_time,
+                          u8 unk2, u8 unk3);
+
+#endif // __CAPTURE__
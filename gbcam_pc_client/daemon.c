@@ -0,0 +1,846 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "serial.h"
+#include "serial_replay.h"
+#include "debug.h"
+#include "timing.h"
+#include "timer.h"
+#include "capture.h"
+#include "calib.h"
+
+//-------------------------------------------------------------------------------------
+
+//Capture daemon. It owns the serial port and takes pictures for any number of clients
+//connected to a Unix domain socket. The protocol is line based:
+//
+//    capture KIND TRIGGER REG1 EXPOSURE REG4 REG5 [DITHER [PRIORITY]]
+//        KIND is picture, thumbnail, analog or analog10. Registers are hexadecimal,
+//        DITHER is 0 or 1 (default 1) and PRIORITY is a decimal number (default 0,
+//        higher values are captured first). Answer: "queued ID" or "coalesced ID" if an
+//        identical request was already waiting, then the result of that request.
+//    subscribe / unsubscribe
+//        Receive the result of every capture, requested by any client. Answer: "ok"
+//    status
+//        Answer: "status QUEUED CLIENTS FRAMES COALESCED"
+//
+//Results are sent as "frame ID KIND WIDTH HEIGHT BITS SIZE" followed by SIZE bytes of
+//data (tiles for pictures, 1 or 2 bytes per pixel, little endian, for analog captures),
+//or as "failed ID". Errors are answered with "error TEXT".
+//
+//Requests are only coalesced with requests that haven't started yet, so every client
+//gets a picture exposed after its request. The sockets are serviced while a capture is
+//running, and the next request starts as soon as the previous one ends.
+
+#define DAEMON_MAX_CLIENTS  (32) // One bit per client in the requests
+#define DAEMON_MAX_REQUESTS (128)
+#define DAEMON_LINE_SIZE    (256)
+#define DAEMON_MAX_OUTPUT   (4*1024*1024) // Clients that don't read are disconnected
+
+#define DAEMON_SERVICE_US   (5000) // Max time between socket checks during a capture
+
+#ifdef _WIN32
+typedef SOCKET socket_t;
+#define DAEMON_DEFAULT_SOCKET "gbcam.sock"
+#else
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#define DAEMON_DEFAULT_SOCKET "/tmp/gbcam.sock"
+#endif
+
+enum {
+    KIND_PICTURE,
+    KIND_THUMBNAIL,
+    KIND_ANALOG
+};
+
+static const char * kind_names[3] = { "picture", "thumbnail", "analog" };
+
+typedef struct {
+    int kind;
+    int analog_mode;
+    u8 trigger, reg1, reg4, reg5;
+    u16 exposure;
+    int dithering;
+} capture_params;
+
+typedef struct {
+    capture_params params;
+    int priority;
+    unsigned int id;      // Also the order of arrival
+    unsigned int waiting; // Bit mask of the clients that want the result
+} capture_request;
+
+typedef struct {
+    socket_t fd; // INVALID_SOCKET if not used
+    char in[DAEMON_LINE_SIZE];
+    int in_len;
+    char * out; // Data that couldn't be sent yet
+    int out_len, out_size;
+    int subscribed;
+} daemon_client;
+
+static daemon_client clients[DAEMON_MAX_CLIENTS];
+static socket_t listen_fd = INVALID_SOCKET;
+static const char * socket_path = DAEMON_DEFAULT_SOCKET;
+
+//Priority queue (binary heap)
+static capture_request queue[DAEMON_MAX_REQUESTS];
+static int queue_len = 0;
+static unsigned int next_request_id = 1;
+
+static capture_request current; // Request being captured
+static int current_active = 0;
+
+static unsigned int frames_taken = 0, requests_coalesced = 0;
+
+static unsigned long long last_service = 0;
+
+static int verbose = 0;
+static volatile sig_atomic_t quit_requested = 0;
+
+//-------------------------------------------------------------------------------------
+
+static int Queue_Before(const capture_request * a, const capture_request * b)
+{
+    if(a->priority != b->priority)
+        return a->priority > b->priority;
+    return (int)(a->id - b->id) < 0;
+}
+
+static void Queue_Swap(int a, int b)
+{
+    capture_request temp = queue[a];
+    queue[a] = queue[b];
+    queue[b] = temp;
+}
+
+static void Queue_SiftUp(int i)
+{
+    while(i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if(!Queue_Before(&queue[i],&queue[parent]))
+            break;
+        Queue_Swap(i,parent);
+        i = parent;
+    }
+}
+
+static void Queue_SiftDown(int i)
+{
+    while(1)
+    {
+        int first = i;
+        int l = i*2 + 1, r = i*2 + 2;
+        if( (l < queue_len) && Queue_Before(&queue[l],&queue[first]) ) first = l;
+        if( (r < queue_len) && Queue_Before(&queue[r],&queue[first]) ) first = r;
+        if(first == i)
+            break;
+        Queue_Swap(i,first);
+        i = first;
+    }
+}
+
+static void Queue_Remove(int i, capture_request * out)
+{
+    if(out)
+        *out = queue[i];
+
+    queue_len--;
+    if(i == queue_len)
+        return;
+
+    queue[i] = queue[queue_len];
+    Queue_SiftDown(i);
+    Queue_SiftUp(i);
+}
+
+static int Params_Equal(const capture_params * a, const capture_params * b)
+{
+    return (a->kind == b->kind) && (a->analog_mode == b->analog_mode) &&
+           (a->trigger == b->trigger) && (a->reg1 == b->reg1) && (a->reg4 == b->reg4) &&
+           (a->reg5 == b->reg5) && (a->exposure == b->exposure) &&
+           (a->dithering == b->dithering);
+}
+
+//Returns the ID of the request, 0 if the queue is full. *coalesced is set to 1 if the
+//client has been added to a request that was already in the queue.
+static unsigned int Queue_Add(const capture_params * params, int priority, int client,
+                              int * coalesced)
+{
+    int i;
+    for(i = 0; i < queue_len; i++)
+    {
+        if(Params_Equal(&queue[i].params,params))
+        {
+            queue[i].waiting |= 1u << client;
+            if(priority > queue[i].priority)
+            {
+                queue[i].priority = priority;
+                Queue_SiftUp(i);
+            }
+            *coalesced = 1;
+            requests_coalesced++;
+            return queue[i].id;
+        }
+    }
+
+    if(queue_len == DAEMON_MAX_REQUESTS)
+        return 0;
+
+    capture_request * r = &queue[queue_len];
+    r->params = *params;
+    r->priority = priority;
+    r->id = next_request_id++;
+    if(next_request_id == 0)
+        next_request_id = 1;
+    r->waiting = 1u << client;
+
+    unsigned int id = r->id; // r may be moved by the heap
+
+    queue_len++;
+    Queue_SiftUp(queue_len - 1);
+
+    *coalesced = 0;
+    return id;
+}
+
+//-------------------------------------------------------------------------------------
+
+static int Socket_SetNonBlocking(socket_t s)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(s,FIONBIO,&mode);
+#else
+    return fcntl(s,F_SETFL,fcntl(s,F_GETFL,0) | O_NONBLOCK);
+#endif
+}
+
+static int Socket_WouldBlock(void)
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+#endif
+}
+
+static void Client_Close(int i)
+{
+    daemon_client * c = &clients[i];
+
+    closesocket(c->fd);
+    c->fd = INVALID_SOCKET;
+    free(c->out);
+    c->out = NULL;
+
+    //Requests that nobody wants anymore are removed
+    unsigned int mask = ~(1u << i);
+    current.waiting &= mask;
+    int j;
+    for(j = 0; j < queue_len; j++)
+        queue[j].waiting &= mask;
+
+    //Removing an element can move others to lower positions, start again after that
+    j = 0;
+    while(j < queue_len)
+    {
+        if(queue[j].waiting == 0)
+        {
+            Queue_Remove(j,NULL);
+            j = 0;
+        }
+        else
+        {
+            j++;
+        }
+    }
+
+    Debug_Info("Client %d disconnected",i);
+}
+
+//Sends as much data as possible without blocking. Returns -1 if the client is closed.
+static int Client_Flush(int i)
+{
+    daemon_client * c = &clients[i];
+
+    int sent = 0;
+    while(sent < c->out_len)
+    {
+        int n = send(c->fd,c->out + sent,c->out_len - sent,0);
+        if(n <= 0)
+        {
+            if( (n < 0) && Socket_WouldBlock() )
+                break;
+            Client_Close(i);
+            return -1;
+        }
+        sent += n;
+    }
+
+    memmove(c->out,c->out + sent,c->out_len - sent);
+    c->out_len -= sent;
+    return 0;
+}
+
+//Queues data for a client. Returns -1 if the client is closed.
+static int Client_Send(int i, const void * data, int size)
+{
+    daemon_client * c = &clients[i];
+
+    if(c->out_len + size > c->out_size)
+    {
+        int new_size = c->out_size ? c->out_size : 16*1024;
+        while(new_size < c->out_len + size)
+            new_size *= 2;
+
+        char * out = NULL;
+        if(new_size <= DAEMON_MAX_OUTPUT)
+            out = realloc(c->out,new_size);
+        if(out == NULL)
+        {
+            Debug_Warn("Client %d isn't reading its data, disconnecting it",i);
+            Client_Close(i);
+            return -1;
+        }
+        c->out = out;
+        c->out_size = new_size;
+    }
+
+    memcpy(c->out + c->out_len,data,size);
+    c->out_len += size;
+
+    return Client_Flush(i);
+}
+
+static int Client_Printf(int i, const char * text, unsigned int value)
+{
+    char str[100];
+    int len = snprintf(str,sizeof(str),text,value);
+    return Client_Send(i,str,len);
+}
+
+static int Client_ParseCapture(int i, const char * line)
+{
+    char kind[16];
+    unsigned int trigger, reg1, exposure, reg4, reg5;
+    int dithering = 1, priority = 0;
+
+    int n = sscanf(line,"capture %15s %x %x %x %x %x %d %d",kind,&trigger,&reg1,&exposure,
+                   &reg4,&reg5,&dithering,&priority);
+    if(n < 6)
+        return Client_Printf(i,"error invalid capture request\n",0);
+
+    capture_params params;
+    memset(&params,0,sizeof(params));
+
+    if(!strcmp(kind,"picture")) params.kind = KIND_PICTURE;
+    else if(!strcmp(kind,"thumbnail")) params.kind = KIND_THUMBNAIL;
+    else if(!strcmp(kind,"analog")) params.kind = KIND_ANALOG;
+    else if(!strcmp(kind,"analog10")) { params.kind = KIND_ANALOG; params.analog_mode = CAPTURE_10BIT; }
+    else return Client_Printf(i,"error invalid kind\n",0);
+
+    params.trigger = trigger;
+    params.reg1 = reg1;
+    params.exposure = exposure;
+    params.reg4 = reg4;
+    params.reg5 = reg5;
+    params.dithering = dithering ? 1 : 0;
+
+    int coalesced;
+    unsigned int id = Queue_Add(&params,priority,i,&coalesced);
+    if(id == 0)
+        return Client_Printf(i,"error queue full\n",0);
+
+    return Client_Printf(i,coalesced ? "coalesced %u\n" : "queued %u\n",id);
+}
+
+static int Client_HandleLine(int i, const char * line)
+{
+    daemon_client * c = &clients[i];
+
+    if(!strncmp(line,"capture ",8))
+        return Client_ParseCapture(i,line);
+
+    if(!strcmp(line,"subscribe"))
+    {
+        c->subscribed = 1;
+        return Client_Printf(i,"ok\n",0);
+    }
+
+    if(!strcmp(line,"unsubscribe"))
+    {
+        c->subscribed = 0;
+        return Client_Printf(i,"ok\n",0);
+    }
+
+    if(!strcmp(line,"status"))
+    {
+        int connected = 0;
+        int j;
+        for(j = 0; j < DAEMON_MAX_CLIENTS; j++)
+            if(clients[j].fd != INVALID_SOCKET)
+                connected++;
+
+        char str[100];
+        int len = snprintf(str,sizeof(str),"status %d %d %u %u\n",queue_len + current_active,
+                           connected,frames_taken,requests_coalesced);
+        return Client_Send(i,str,len);
+    }
+
+    if(line[0] == '\0')
+        return 0;
+
+    return Client_Printf(i,"error unknown command\n",0);
+}
+
+static void Client_Receive(int i)
+{
+    daemon_client * c = &clients[i];
+
+    int n = recv(c->fd,c->in + c->in_len,DAEMON_LINE_SIZE - c->in_len,0);
+    if(n <= 0)
+    {
+        if( (n < 0) && Socket_WouldBlock() )
+            return;
+        Client_Close(i);
+        return;
+    }
+    c->in_len += n;
+
+    //Handle all complete lines
+    while(1)
+    {
+        char * end = memchr(c->in,'\n',c->in_len);
+        if(end == NULL)
+            break;
+
+        *end = '\0';
+        if( (end > c->in) && (end[-1] == '\r') )
+            end[-1] = '\0';
+
+        if(Client_HandleLine(i,c->in) != 0)
+            return; // Closed
+
+        int used = end + 1 - c->in;
+        memmove(c->in,end + 1,c->in_len - used);
+        c->in_len -= used;
+    }
+
+    if(c->in_len == DAEMON_LINE_SIZE)
+    {
+        Debug_Warn("Client %d sent a line that is too long",i);
+        Client_Close(i);
+    }
+}
+
+static void Daemon_Accept(void)
+{
+    socket_t fd = accept(listen_fd,NULL,NULL);
+    if(fd == INVALID_SOCKET)
+        return;
+
+    int i;
+    for(i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    {
+        if(clients[i].fd == INVALID_SOCKET)
+        {
+            Socket_SetNonBlocking(fd);
+
+            memset(&clients[i],0,sizeof(daemon_client));
+            clients[i].fd = fd;
+
+            Debug_Info("Client %d connected",i);
+            return;
+        }
+    }
+
+    const char * busy = "error too many clients\n";
+    send(fd,busy,strlen(busy),0);
+    closesocket(fd);
+}
+
+//Accepts clients, reads requests and sends pending data. Waits for activity in the
+//sockets for up to timeout_ms milliseconds.
+static void Daemon_Service(int timeout_ms)
+{
+    last_service = Timer_GetMicroseconds();
+
+    fd_set read_set, write_set;
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+
+    FD_SET(listen_fd,&read_set);
+    socket_t max_fd = listen_fd;
+
+    int i;
+    for(i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    {
+        socket_t fd = clients[i].fd;
+        if(fd == INVALID_SOCKET)
+            continue;
+
+        FD_SET(fd,&read_set);
+        if(clients[i].out_len > 0)
+            FD_SET(fd,&write_set);
+        if(fd > max_fd)
+            max_fd = fd;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    if(select(max_fd + 1,&read_set,&write_set,NULL,&tv) <= 0)
+        return;
+
+    for(i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    {
+        socket_t fd = clients[i].fd;
+        if(fd == INVALID_SOCKET)
+            continue;
+
+        if(FD_ISSET(fd,&write_set))
+        {
+            if(Client_Flush(i) != 0)
+                continue;
+        }
+
+        if(FD_ISSET(fd,&read_set))
+            Client_Receive(i);
+    }
+
+    if(FD_ISSET(listen_fd,&read_set))
+        Daemon_Accept();
+}
+
+//-------------------------------------------------------------------------------------
+
+void Capture_SetStatus(const char * text)
+{
+    if(verbose)
+        fprintf(stderr,"%s\n",text);
+}
+
+int Capture_Idle(void)
+{
+    //Serial data is checked more often than sockets
+    if(Timer_GetMicroseconds() - last_service >= DAEMON_SERVICE_US)
+        Daemon_Service(0);
+
+    SerialWaitData(DAEMON_SERVICE_US / 1000);
+
+    return quit_requested;
+}
+
+static void SignalHandler(int sig)
+{
+    (void)sig;
+    quit_requested = 1;
+}
+
+static void Daemon_End(void)
+{
+    if(listen_fd != INVALID_SOCKET)
+    {
+        closesocket(listen_fd);
+        listen_fd = INVALID_SOCKET;
+        remove(socket_path);
+    }
+}
+
+static int Daemon_Listen(void)
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    if(WSAStartup(MAKEWORD(2,2),&wsa) != 0)
+        return -1;
+#else
+    signal(SIGPIPE,SIG_IGN);
+#endif
+
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path,socket_path);
+
+    remove(socket_path); // Left by a previous instance
+
+    listen_fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(listen_fd == INVALID_SOCKET)
+        return -1;
+
+    if( (bind(listen_fd,(struct sockaddr *)&addr,sizeof(addr)) != 0) ||
+        (listen(listen_fd,8) != 0) )
+    {
+        closesocket(listen_fd);
+        listen_fd = INVALID_SOCKET;
+        return -1;
+    }
+
+    Socket_SetNonBlocking(listen_fd);
+
+    atexit(Daemon_End);
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+static int Daemon_Capture(const capture_params * p)
+{
+    if(p->kind == KIND_ANALOG)
+        return TakePictureAnalogAndTransfer(p->trigger,p->reg1,p->exposure,p->reg4,p->reg5,
+                                            p->dithering,p->analog_mode);
+
+    return TakePictureAndTransfer(p->trigger,p->reg1,p->exposure,p->reg4,p->reg5,
+                                  p->dithering,p->kind == KIND_THUMBNAIL);
+}
+
+//Sends the result of the current request to the clients that asked for it and to all
+//subscribers.
+static void Daemon_Deliver(int result)
+{
+    static unsigned char data[GBCAM_SENSOR_W*GBCAM_SENSOR_H*2];
+    int size, width, height, bits;
+
+    const capture_params * p = &current.params;
+
+    if(p->kind == KIND_ANALOG)
+    {
+        width = GBCAM_SENSOR_W;
+        height = analog_lines;
+        bits = analog_bits;
+
+        int pixels = width * height;
+        int i;
+        if(bits > 8)
+        {
+            for(i = 0; i < pixels; i++)
+            {
+                data[i*2] = analogdata[i] & 0xFF;
+                data[i*2+1] = analogdata[i] >> 8;
+            }
+            size = pixels * 2;
+        }
+        else
+        {
+            for(i = 0; i < pixels; i++)
+                data[i] = analogdata[i];
+            size = pixels;
+        }
+    }
+    else
+    {
+        int rows = (p->kind == KIND_THUMBNAIL) ? 2 : 14;
+        width = GBCAM_W;
+        height = rows * 8;
+        bits = 2;
+        size = 16 * rows * 16;
+        memcpy(data,picturedata,size);
+    }
+
+    char header[100];
+    int header_len;
+    if(result == 0)
+        header_len = snprintf(header,sizeof(header),"frame %u %s %d %d %d %d\n",current.id,
+                              kind_names[p->kind],width,height,bits,size);
+    else
+        header_len = snprintf(header,sizeof(header),"failed %u\n",current.id);
+
+    int i;
+    for(i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    {
+        daemon_client * c = &clients[i];
+        if(c->fd == INVALID_SOCKET)
+            continue;
+
+        if( !c->subscribed && !(current.waiting & (1u << i)) )
+            continue;
+
+        if(Client_Send(i,header,header_len) != 0)
+            continue;
+        if(result == 0)
+            Client_Send(i,data,size);
+    }
+}
+
+//-------------------------------------------------------------------------------------
+
+static void PrintUsage(void)
+{
+    fprintf(stderr,
+        "Usage: GBCam_Daemon [options] [port]\n"
+        "\n"
+        "  --socket PATH     Unix domain socket (default " DAEMON_DEFAULT_SOCKET ")\n"
+        "  --publish NAME    Publish every capture in a shared memory frame ring\n"
+        "  --calib FILE      Correct analog captures with the dark and flat maps of FILE\n"
+        "  --record FILE     Record the serial session\n"
+        "  --replay FILE     Replay a recorded session instead of opening the port\n"
+        "  --fast            Don't wait for the recorded delays when replaying\n"
+        "  --crc             Get pictures with a CRC per row of tiles and read the\n"
+        "                    corrupted rows again\n"
+        "  --verbose         Print what is being done to stderr\n");
+}
+
+int main(int argc, char * argv[])
+{
+    char * port = "COM4";
+    const char * record_file = NULL;
+    const char * replay_file = NULL;
+    const char * publish_name = NULL;
+    const char * calib_file = NULL;
+    int replay_realtime = 1;
+
+    int i;
+    for(i = 1; i < argc; i++)
+    {
+        const char * arg = argv[i];
+
+        if(!strcmp(arg,"--fast")) replay_realtime = 0;
+        else if(!strcmp(arg,"--verbose")) verbose = 1;
+        else if(!strcmp(arg,"--crc")) capture_crc = 1;
+        else if(!strcmp(arg,"--help")) { PrintUsage(); return 0; }
+        else if(!strncmp(arg,"--",2))
+        {
+            if(i+1 >= argc)
+            {
+                PrintUsage();
+                return 1;
+            }
+            const char * value = argv[++i];
+
+            if(!strcmp(arg,"--socket")) socket_path = value;
+            else if(!strcmp(arg,"--publish")) publish_name = value;
+            else if(!strcmp(arg,"--calib")) calib_file = value;
+            else if(!strcmp(arg,"--record")) record_file = value;
+            else if(!strcmp(arg,"--replay")) replay_file = value;
+            else
+            {
+                PrintUsage();
+                return 1;
+            }
+        }
+        else port = argv[i];
+    }
+
+    for(i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        clients[i].fd = INVALID_SOCKET;
+
+    Debug_Init();
+
+    Timing_Init();
+    Timing_Load("timing.txt");
+
+    if(calib_file)
+    {
+        if(Calib_Load(calib_file) != 0)
+        {
+            fprintf(stderr,"Can't read the calibration file %s\n",calib_file);
+            return 1;
+        }
+        calib_enabled = 1;
+    }
+
+    signal(SIGINT,SignalHandler);
+    signal(SIGTERM,SignalHandler);
+
+    if(replay_file)
+    {
+        if(SerialReplayCreate(replay_file,replay_realtime) != 0)
+            return 2;
+    }
+    else
+    {
+        SerialCreate(port);
+
+        if(record_file)
+            SerialRecordStart(record_file);
+    }
+
+    if(!SerialIsConnected())
+    {
+        fprintf(stderr,"Can't connect to %s\n",replay_file ? replay_file : port);
+        return 2;
+    }
+
+    if(Daemon_Listen() != 0)
+    {
+        fprintf(stderr,"Can't listen in %s\n",socket_path);
+        SerialDestroy();
+        return 2;
+    }
+
+    FrameRing * ring = NULL;
+    if(publish_name)
+    {
+        ring = FrameRing_Create(publish_name);
+        if(ring == NULL)
+            Debug_Warn("Can't create the frame ring %s",publish_name);
+    }
+
+    const int ring_kind[3] = { FRAMERING_KIND_PICTURE, FRAMERING_KIND_THUMBNAIL,
+                               FRAMERING_KIND_ANALOG };
+
+    Debug_Info("Listening in %s",socket_path);
+
+    while(!quit_requested)
+    {
+        if(queue_len == 0)
+        {
+            Daemon_Service(500);
+            continue;
+        }
+
+        Queue_Remove(0,&current);
+        current_active = 1;
+
+        const capture_params * p = &current.params;
+
+        if(verbose)
+            fprintf(stderr,"Request %u: %s %02X %02X %04X %02X %02X\n",current.id,
+                    kind_names[p->kind],p->trigger,p->reg1,p->exposure,p->reg4,p->reg5);
+
+        int result = Daemon_Capture(p);
+        if(result == 0)
+        {
+            frames_taken++;
+            Capture_PublishFrame(ring,ring_kind[p->kind],p->trigger,p->reg1,p->exposure,
+                                 p->reg4,p->reg5);
+        }
+
+        Daemon_Deliver(result);
+        current_active = 0;
+
+        //Get the requests that have arrived at the end of the capture
+        Daemon_Service(0);
+    }
+
+    FrameRing_Close(ring);
+
+    SerialDestroy();
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
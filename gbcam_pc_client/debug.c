@@ -1,33 +1,241 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+#include "debug.h"
+#include "timer.h"
+
+//-------------------------------------------------------------------------
+
+//Bounded queue with multiple producers and one consumer. Every slot has a sequence
+//number: a producer can only use a slot when its sequence number is the position it has
+//claimed, and the consumer can only read it when it is that position plus one.
+
+#define DEBUG_NUM_SLOTS (256) // Power of 2
+#define DEBUG_MSG_SIZE (240)
+
+typedef struct {
+    unsigned int sequence;
+    int level;
+    unsigned long long time;
+    char text[DEBUG_MSG_SIZE];
+} debug_slot;
+
+static debug_slot slots[DEBUG_NUM_SLOTS];
+static unsigned int enqueue_pos;
+static unsigned int dequeue_pos; // Only modified by the writer thread
+static unsigned int dropped;
+
 static FILE * f_log;
 static int log_file_opened = 0;
+static unsigned long long log_start;
+static volatile int writer_exit;
+
+//Time between writes when the buffer isn't getting full
+#define DEBUG_WRITE_PERIOD_MS (250)
+
+//-------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+static HANDLE writer_thread;
+static HANDLE writer_event;
+
+static void WriterWakeUp(void)
+{
+    SetEvent(writer_event);
+}
+
+static void WriterSleep(void)
+{
+    WaitForSingleObject(writer_event,DEBUG_WRITE_PERIOD_MS);
+}
+
+#else
+
+static pthread_t writer_thread;
+static sem_t writer_event;
+
+static void WriterWakeUp(void)
+{
+    sem_post(&writer_event);
+}
+
+static void WriterSleep(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME,&t);
+    t.tv_nsec += DEBUG_WRITE_PERIOD_MS * 1000000L;
+    t.tv_sec += t.tv_nsec / 1000000000L;
+    t.tv_nsec %= 1000000000L;
+    sem_timedwait(&writer_event,&t);
+}
+
+#endif
+
+//-------------------------------------------------------------------------
+
+//Writes all the messages in the buffer and flushes the file once
+static void WriterFlush(void)
+{
+    const char level_char[5] = { 'T', 'D', 'I', 'W', 'E' };
+
+    unsigned int lost = __atomic_exchange_n(&dropped,0,__ATOMIC_RELAXED);
+    if(lost)
+        fprintf(f_log,"*** %u messages dropped ***\n",lost);
+
+    while(1)
+    {
+        debug_slot * slot = &slots[dequeue_pos & (DEBUG_NUM_SLOTS-1)];
+
+        unsigned int sequence = __atomic_load_n(&slot->sequence,__ATOMIC_ACQUIRE);
+        if(sequence != dequeue_pos + 1)
+            break;
+
+        unsigned long long t = slot->time - log_start;
+        fprintf(f_log,"[%5llu.%06llu] %c %s\n",t / 1000000,t % 1000000,
+                level_char[slot->level],slot->text);
+
+        //The slot can be used again in the next lap of the buffer
+        __atomic_store_n(&slot->sequence,dequeue_pos + DEBUG_NUM_SLOTS,__ATOMIC_RELEASE);
+        dequeue_pos++;
+    }
+
+    fflush(f_log);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI WriterThread(LPVOID arg)
+#else
+static void * WriterThread(void * arg)
+#endif
+{
+    (void)arg;
+
+    while(!writer_exit)
+    {
+        WriterSleep();
+        WriterFlush();
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------
 
 void Debug_End(void)
 {
-    fclose(f_log);
+    if(!log_file_opened)
+        return;
+
+    writer_exit = 1;
+    WriterWakeUp();
+#ifdef _WIN32
+    WaitForSingleObject(writer_thread,INFINITE);
+    CloseHandle(writer_thread);
+    CloseHandle(writer_event);
+#else
+    pthread_join(writer_thread,NULL);
+    sem_destroy(&writer_event);
+#endif
+
     log_file_opened = 0;
+
+    WriterFlush();
+    fclose(f_log);
 }
 
 void Debug_Init(void)
 {
     f_log = fopen("log.txt","w");
-    if(f_log)
-        log_file_opened = 1;
+    if(f_log == NULL)
+        return;
+
+    int i;
+    for(i = 0; i < DEBUG_NUM_SLOTS; i++)
+        slots[i].sequence = i;
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    dropped = 0;
+    writer_exit = 0;
+    log_start = Timer_GetMicroseconds();
+
+#ifdef _WIN32
+    writer_event = CreateEvent(NULL,FALSE,FALSE,NULL);
+    writer_thread = CreateThread(NULL,0,WriterThread,NULL,0,NULL);
+#else
+    sem_init(&writer_event,0,0);
+    pthread_create(&writer_thread,NULL,WriterThread,NULL);
+#endif
+
+    log_file_opened = 1;
     atexit(Debug_End);
 }
 
-void Debug_Log(const char * msg, ...)
+void Debug_Write(int level, const char * msg, ...)
 {
-    if(log_file_opened)
+    if(!log_file_opened)
+        return;
+
+    //Claim a slot
+    unsigned int pos = __atomic_load_n(&enqueue_pos,__ATOMIC_RELAXED);
+    debug_slot * slot;
+    while(1)
     {
-        va_list args;
-        va_start(args,msg);
-        vfprintf(f_log, msg, args);
-        va_end(args);
-        fputc('\n',f_log);
-        fflush(f_log);
+        slot = &slots[pos & (DEBUG_NUM_SLOTS-1)];
+        unsigned int sequence = __atomic_load_n(&slot->sequence,__ATOMIC_ACQUIRE);
+        int diff = (int)(sequence - pos);
+
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&enqueue_pos,&pos,pos+1,1,
+                                           __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        }
+        else if(diff < 0)
+        {
+            //The buffer is full
+            __atomic_fetch_add(&dropped,1,__ATOMIC_RELAXED);
+            WriterWakeUp();
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&enqueue_pos,__ATOMIC_RELAXED);
+        }
     }
+
+    slot->time = Timer_GetMicroseconds();
+    slot->level = level;
+
+    va_list args;
+    va_start(args,msg);
+    int len = vsnprintf(slot->text,DEBUG_MSG_SIZE,msg,args);
+    va_end(args);
+
+    //Some messages end with a new line
+    if(len < 0) len = 0;
+    if(len > DEBUG_MSG_SIZE-1) len = DEBUG_MSG_SIZE-1;
+    while( (len > 0) && (slot->text[len-1] == '\n') )
+        slot->text[--len] = '\0';
+
+    //Publish the message
+    __atomic_store_n(&slot->sequence,pos+1,__ATOMIC_RELEASE);
+
+    //Errors are written right away, the rest when the writer wakes up or the buffer is
+    //getting full.
+    if( (level >= DEBUG_LEVEL_ERROR) ||
+        (pos - __atomic_load_n(&dequeue_pos,__ATOMIC_RELAXED) >= DEBUG_NUM_SLOTS/2) )
+        WriterWakeUp();
 }
+
+//-------------------------------------------------------------------------
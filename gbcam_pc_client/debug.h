@@ -1,8 +1,34 @@
 #ifndef __DEBUG__
 #define __DEBUG__
 
+//Log levels
+#define DEBUG_LEVEL_TRACE (0)
+#define DEBUG_LEVEL_DEBUG (1)
+#define DEBUG_LEVEL_INFO  (2)
+#define DEBUG_LEVEL_WARN  (3)
+#define DEBUG_LEVEL_ERROR (4)
+
+//Messages below this level are removed at compile time
+#ifndef DEBUG_MIN_LEVEL
+#define DEBUG_MIN_LEVEL DEBUG_LEVEL_DEBUG
+#endif
+
+//The messages are stored in a buffer and written to log.txt by a thread. Logging never
+//blocks: if the buffer is full the message is dropped, and the number of dropped messages
+//is written to the log later.
 void Debug_Init(void);
-void Debug_Log(const char * msg, ...);
+void Debug_Write(int level, const char * msg, ...);
+
+#define Debug_LogLevel(level, ...) \
+    do { if((level) >= DEBUG_MIN_LEVEL) Debug_Write((level), __VA_ARGS__); } while(0)
+
+#define Debug_Trace(...) Debug_LogLevel(DEBUG_LEVEL_TRACE, __VA_ARGS__)
+#define Debug_Debug(...) Debug_LogLevel(DEBUG_LEVEL_DEBUG, __VA_ARGS__)
+#define Debug_Info(...)  Debug_LogLevel(DEBUG_LEVEL_INFO, __VA_ARGS__)
+#define Debug_Warn(...)  Debug_LogLevel(DEBUG_LEVEL_WARN, __VA_ARGS__)
+#define Debug_Error(...) Debug_LogLevel(DEBUG_LEVEL_ERROR, __VA_ARGS__)
+
+#define Debug_Log(...)   Debug_Info(__VA_ARGS__)
 
 #endif // __DEBUG__
 
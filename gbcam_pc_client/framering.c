@@ -0,0 +1,255 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "framering.h"
+
+//-------------------------------------------------------------------------------------
+
+struct framering_info {
+    FrameRingHeader * header;
+    int writer;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+};
+
+static int FrameRing_LayoutIsValid(const FrameRingHeader * header)
+{
+    return (header->magic == FRAMERING_MAGIC) && (header->version == FRAMERING_VERSION) &&
+           (header->slots == FRAMERING_SLOTS) && (header->slot_size == sizeof(FrameRingSlot));
+}
+
+//Maps the shared memory. Returns NULL on error.
+static FrameRing * FrameRing_Map(const char * name, int writer)
+{
+    FrameRing * ring = calloc(1,sizeof(FrameRing));
+    if(ring == NULL)
+        return NULL;
+
+    ring->writer = writer;
+
+    char path[256];
+
+#ifdef _WIN32
+    snprintf(path,sizeof(path),"Local\\%s",name);
+
+    if(writer)
+        ring->mapping = CreateFileMapping(INVALID_HANDLE_VALUE,NULL,PAGE_READWRITE,0,
+                                          sizeof(FrameRingHeader),path);
+    else
+        ring->mapping = OpenFileMapping(FILE_MAP_READ,FALSE,path);
+
+    if(ring->mapping == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->header = MapViewOfFile(ring->mapping,writer ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ,
+                                 0,0,sizeof(FrameRingHeader));
+    if(ring->header == NULL)
+    {
+        CloseHandle(ring->mapping);
+        free(ring);
+        return NULL;
+    }
+#else
+    snprintf(path,sizeof(path),"/%s",name);
+
+    int fd = shm_open(path,writer ? (O_RDWR | O_CREAT) : O_RDONLY,0644);
+    if(fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    struct stat st;
+    if( (fstat(fd,&st) != 0) ||
+        ( (st.st_size != sizeof(FrameRingHeader)) &&
+          (!writer || (ftruncate(fd,sizeof(FrameRingHeader)) != 0)) ) )
+    {
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    void * ptr = mmap(NULL,sizeof(FrameRingHeader),writer ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                      MAP_SHARED,fd,0);
+    close(fd);
+    if(ptr == MAP_FAILED)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->header = ptr;
+#endif
+
+    return ring;
+}
+
+void FrameRing_Close(FrameRing * ring)
+{
+    if(ring == NULL)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(ring->header);
+    CloseHandle(ring->mapping);
+#else
+    //The name isn't removed, readers can keep using the ring if the writer is restarted
+    munmap(ring->header,sizeof(FrameRingHeader));
+#endif
+
+    free(ring);
+}
+
+//-------------------------------------------------------------------------------------
+
+FrameRing * FrameRing_Create(const char * name)
+{
+    FrameRing * ring = FrameRing_Map(name,1);
+    if(ring == NULL)
+        return NULL;
+
+    FrameRingHeader * header = ring->header;
+
+    if(!FrameRing_LayoutIsValid(header))
+    {
+        //New ring (or one of an old version). The magic is written last so that readers
+        //don't accept a half initialized header.
+        header->magic = 0;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        memset(header,0,sizeof(FrameRingHeader));
+        header->version = FRAMERING_VERSION;
+        header->slots = FRAMERING_SLOTS;
+        header->slot_size = sizeof(FrameRingSlot);
+
+        __atomic_store_n(&header->magic,FRAMERING_MAGIC,__ATOMIC_RELEASE);
+    }
+
+    return ring;
+}
+
+FrameRingSlot * FrameRing_BeginWrite(FrameRing * ring)
+{
+    FrameRingHeader * header = ring->header;
+    unsigned int count = __atomic_load_n(&header->write_count,__ATOMIC_RELAXED);
+
+    FrameRingSlot * slot = &header->slot[count % FRAMERING_SLOTS];
+
+    //Mark the slot as being written before changing anything in it
+    unsigned int sequence = __atomic_load_n(&slot->sequence,__ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence,sequence | 1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->frame = count;
+
+    return slot;
+}
+
+void FrameRing_EndWrite(FrameRing * ring)
+{
+    FrameRingHeader * header = ring->header;
+    unsigned int count = __atomic_load_n(&header->write_count,__ATOMIC_RELAXED);
+
+    FrameRingSlot * slot = &header->slot[count % FRAMERING_SLOTS];
+
+    unsigned int sequence = __atomic_load_n(&slot->sequence,__ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence,sequence + 1,__ATOMIC_RELEASE);
+
+    __atomic_store_n(&header->write_count,count + 1,__ATOMIC_RELEASE);
+}
+
+//-------------------------------------------------------------------------------------
+
+FrameRing * FrameRing_Open(const char * name)
+{
+    FrameRing * ring = FrameRing_Map(name,0);
+    if(ring == NULL)
+        return NULL;
+
+    if( (__atomic_load_n(&ring->header->magic,__ATOMIC_ACQUIRE) != FRAMERING_MAGIC) ||
+        !FrameRing_LayoutIsValid(ring->header) )
+    {
+        FrameRing_Close(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+unsigned int FrameRing_GetWriteCount(const FrameRing * ring)
+{
+    return __atomic_load_n(&ring->header->write_count,__ATOMIC_ACQUIRE);
+}
+
+const FrameRingSlot * FrameRing_PeekLatest(FrameRing * ring, unsigned int * sequence)
+{
+    unsigned int count = FrameRing_GetWriteCount(ring);
+    if(count == 0)
+        return NULL;
+
+    const FrameRingSlot * slot = &ring->header->slot[(count - 1) % FRAMERING_SLOTS];
+
+    *sequence = __atomic_load_n(&slot->sequence,__ATOMIC_ACQUIRE);
+    if(*sequence & 1)
+        return NULL;
+
+    return slot;
+}
+
+int FrameRing_PeekValid(const FrameRingSlot * slot, unsigned int sequence)
+{
+    //The data must be read before checking the sequence again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence,__ATOMIC_RELAXED) == sequence;
+}
+
+int FrameRing_ReadLatest(FrameRing * ring, FrameRingSlot * out, unsigned int * last_frame)
+{
+    if(FrameRing_GetWriteCount(ring) == 0)
+        return 0;
+
+    //The slot of the newest frame is only written again after FRAMERING_SLOTS-1 more
+    //frames. If the reader is that slow there is a newer frame, so try again with it.
+    int tries;
+    for(tries = 0; tries < 4; tries++)
+    {
+        unsigned int sequence;
+        const FrameRingSlot * slot = FrameRing_PeekLatest(ring,&sequence);
+        if(slot == NULL)
+            continue;
+
+        if(slot->frame == *last_frame)
+        {
+            if(FrameRing_PeekValid(slot,sequence))
+                return 0;
+            continue;
+        }
+
+        memcpy(out,slot,sizeof(FrameRingSlot));
+
+        if(FrameRing_PeekValid(slot,sequence))
+        {
+            out->sequence = sequence;
+            *last_frame = out->frame;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
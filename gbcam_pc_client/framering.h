@@ -0,0 +1,89 @@
+
+#ifndef __FRAMERING__
+#define __FRAMERING__
+
+//Ring of frames in shared memory, so that other processes can use the captures while
+//they are being taken (recorders, image processing, previews...).
+//
+//There is one writer and any number of readers. The writer never waits for the readers:
+//every slot has a sequence counter that is odd while the slot is being written, readers
+//read the counter before and after using the slot and discard it if it has changed. The
+//header has the number of frames published, so readers can see if there is a new frame
+//and how many frames they have missed.
+//
+//This file and framering.c don't depend on the rest of the client, readers only need
+//them (see framering_reader.c).
+
+#define FRAMERING_DEFAULT_NAME "gbcam_frames"
+
+#define FRAMERING_MAGIC   (0x52464247) // "GBFR"
+#define FRAMERING_VERSION (1)
+#define FRAMERING_SLOTS   (8)
+
+#define FRAMERING_MAX_W (128)
+#define FRAMERING_MAX_H (112+8)
+
+#define FRAMERING_KIND_PICTURE   (0) // Tiles read from SRAM
+#define FRAMERING_KIND_THUMBNAIL (1) // Only the 2 first rows of tiles
+#define FRAMERING_KIND_ANALOG    (2) // Analog values of the sensor, no tiles
+
+typedef struct {
+    unsigned int sequence;      // Odd while the slot is being written
+    unsigned int frame;         // Number of the frame (0 = first frame published)
+    unsigned long long timestamp_us; // Timer_GetMicroseconds() of the writer
+    unsigned int kind;
+    unsigned int width, height; // Size of pixels
+    unsigned int tiles_size;    // Bytes of tiles used, 0 if there are no tiles
+    unsigned char regs[6];      // A000-A005 of the capture
+    unsigned char analog_bits;  // Analog captures: bits of the original values
+    unsigned char reserved;
+    unsigned char tiles[16*14*16];
+    unsigned char pixels[FRAMERING_MAX_W*FRAMERING_MAX_H]; // 8 bit, width bytes per row
+} FrameRingSlot;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int slots;
+    unsigned int slot_size;
+    unsigned int write_count;   // Frames published. The newest one is in write_count-1.
+    unsigned int reserved[11];
+    FrameRingSlot slot[FRAMERING_SLOTS];
+} FrameRingHeader;
+
+typedef struct framering_info FrameRing;
+
+//-------------------------------------------------------------------------------------
+
+//Writer. If the ring already exists and has the same layout it is reused, and the frame
+//count continues from the previous value so that readers don't need to reopen it.
+FrameRing * FrameRing_Create(const char * name); //Returns NULL on error
+
+//Returns the slot of the next frame. The frame is visible when FrameRing_EndWrite() is
+//called, the slot must be written completely between both calls.
+FrameRingSlot * FrameRing_BeginWrite(FrameRing * ring);
+void FrameRing_EndWrite(FrameRing * ring);
+
+//-------------------------------------------------------------------------------------
+
+//Reader. Returns NULL if the ring doesn't exist or its layout is different.
+FrameRing * FrameRing_Open(const char * name);
+
+unsigned int FrameRing_GetWriteCount(const FrameRing * ring);
+
+//Copies the newest frame if its number is different from *last_frame, and updates
+//*last_frame. Use 0xFFFFFFFF as last_frame to get the current frame. Returns 1 if a frame
+//has been copied, 0 if there is no new frame.
+int FrameRing_ReadLatest(FrameRing * ring, FrameRingSlot * out, unsigned int * last_frame);
+
+//Zero copy access to the newest frame. The data must be considered invalid unless
+//FrameRing_PeekValid() returns 1 after using it. Returns NULL if there are no frames or
+//if the slot is being written.
+const FrameRingSlot * FrameRing_PeekLatest(FrameRing * ring, unsigned int * sequence);
+int FrameRing_PeekValid(const FrameRingSlot * slot, unsigned int sequence);
+
+//-------------------------------------------------------------------------------------
+
+void FrameRing_Close(FrameRing * ring); //Readers and writers
+
+#endif // __FRAMERING__
@@ -0,0 +1,91 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framering.h"
+#include "image.h"
+#include "timer.h"
+
+//-------------------------------------------------------------------------------------
+
+//Example of a program that uses the frames published by the client. It prints the
+//information of every new frame and, optionally, saves them as PGM files.
+//
+//Usage: GBCam_FrameReader [--name NAME] [--count N] [--output PATTERN]
+
+static const char * kind_names[3] = { "picture", "thumbnail", "analog" };
+
+int main(int argc, char * argv[])
+{
+    const char * name = FRAMERING_DEFAULT_NAME;
+    const char * output = NULL;
+    int count = 0;
+
+    int i;
+    for(i = 1; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i],"--name")) name = argv[i+1];
+        else if(!strcmp(argv[i],"--count")) count = atoi(argv[i+1]);
+        else if(!strcmp(argv[i],"--output")) output = argv[i+1];
+        else break;
+    }
+    if(i < argc)
+    {
+        fprintf(stderr,"Usage: GBCam_FrameReader [--name NAME] [--count N] [--output PATTERN]\n");
+        return 1;
+    }
+
+    //Wait until the client creates the ring
+    FrameRing * ring;
+    while((ring = FrameRing_Open(name)) == NULL)
+        Timer_SleepMs(500);
+
+    //Only frames published from now on
+    unsigned int last_frame = FrameRing_GetWriteCount(ring) - 1;
+
+    static FrameRingSlot frame;
+    int received = 0;
+    while( (count == 0) || (received < count) )
+    {
+        unsigned int previous = last_frame;
+
+        if(FrameRing_ReadLatest(ring,&frame,&last_frame) == 0)
+        {
+            Timer_SleepMs(5);
+            continue;
+        }
+
+        received++;
+
+        unsigned long long age = Timer_GetMicroseconds() - frame.timestamp_us;
+        printf("Frame %u: %s %ux%u, regs %02X %02X %02X%02X %02X %02X, %llu us old",
+               frame.frame,(frame.kind < 3) ? kind_names[frame.kind] : "?",
+               frame.width,frame.height,frame.regs[0],frame.regs[1],frame.regs[2],
+               frame.regs[3],frame.regs[4],frame.regs[5],age);
+        if(frame.frame - previous > 1)
+            printf(", %u missed",frame.frame - previous - 1);
+        printf("\n");
+        fflush(stdout);
+
+        if(output)
+        {
+            char filename[1024];
+            snprintf(filename,sizeof(filename),output,frame.frame);
+            FILE * f = fopen(filename,"wb");
+            if(f == NULL)
+            {
+                fprintf(stderr,"Can't open %s\n",filename);
+                break;
+            }
+            Image_WritePGM8(f,frame.pixels,frame.width,frame.height);
+            fclose(f);
+        }
+    }
+
+    FrameRing_Close(ring);
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
@@ -0,0 +1,564 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "serial.h"
+#include "serial_replay.h"
+#include "debug.h"
+#include "timing.h"
+#include "timer.h"
+#include "capture.h"
+#include "image.h"
+#include "stack.h"
+#include "sram.h"
+#include "sweep.h"
+#include "bracket.h"
+#include "calib.h"
+
+//-------------------------------------------------------------------------------------
+
+//Command line frontend. It doesn't open any window, the program sleeps until the serial
+//port receives data, so the capture rate is limited by the link.
+
+static int verbose = 0;
+static volatile sig_atomic_t quit_requested = 0;
+
+void Capture_SetStatus(const char * text)
+{
+    if(verbose)
+        fprintf(stderr,"%s\n",text);
+}
+
+int Capture_Idle(void)
+{
+    SerialWaitData(100);
+    return quit_requested;
+}
+
+static void SignalHandler(int sig)
+{
+    (void)sig;
+    quit_requested = 1;
+}
+
+//-------------------------------------------------------------------------------------
+
+enum {
+    KIND_PICTURE,
+    KIND_THUMBNAIL,
+    KIND_ANALOG
+};
+
+static void PrintUsage(void)
+{
+    fprintf(stderr,
+        "Usage: GBCam_Headless [options] [port]\n"
+        "\n"
+        "  --trigger XX      Value written to A000 to start the capture (default 03)\n"
+        "  --reg1 XX         Registers A001, A004 and A005 (default E8, 24, BF)\n"
+        "  --reg4 XX\n"
+        "  --reg5 XX\n"
+        "  --exposure XXXX   Exposure time, registers A002-A003 (default 1500)\n"
+        "  --no-dither       Use the thresholds 40, 80, C0 instead of the dithering matrix\n"
+        "  --kind K          picture, thumbnail or analog (default picture)\n"
+        "  --10bit           Analog: 10 bit values\n"
+        "  --extra           Analog: Also read the 8 lines skipped by the controller\n"
+        "  --stack N         Analog: Stack N captures for every output frame (decimal)\n"
+        "  --stack-mode M    mean, median or clip (sigma-clipped mean) (default mean)\n"
+        "  --count N         Number of captures, 0 = until interrupted (default 1)\n"
+        "  --interval MS     Minimum time between the start of two captures (default 0)\n"
+        "  --output PATTERN  printf pattern with the frame number, or - for stdout (default -)\n"
+        "  --raw             Write the data as received instead of PGM files\n"
+        "  --record FILE     Record the serial session\n"
+        "  --replay FILE     Replay a recorded session instead of opening the port\n"
+        "  --fast            Don't wait for the recorded delays when replaying\n"
+        "  --crc             Get pictures with a CRC per row of tiles and read the\n"
+        "                    corrupted rows again\n"
+        "  --dump FILE       Read the whole SRAM of the cartridge into a .sav file\n"
+        "  --sav FILE        Use a .sav file instead of the cartridge for --gallery\n"
+        "  --gallery PREFIX  Write all photos of the SRAM (or of --sav) as PGM files\n"
+        "  --sweep PREFIX    Capture all combinations of the values of --sweep-* and write\n"
+        "                    PREFIX_grid.pgm, PREFIX.csv and PREFIX_NNNN.pgm\n"
+        "  --sweep-reg1 V    Values of A001, A004, A005 and exposure of the sweep: a list\n"
+        "  --sweep-reg4 V    (E4,E8), a range with an optional step (0100-2000:100) or\n"
+        "  --sweep-reg5 V    \"game\" for the values used by the game (registers only).\n"
+        "  --sweep-exposure V  The value of --regN or --exposure is used if not specified.\n"
+        "  --bracket PREFIX  Take a picture (or analog capture with --kind analog) for\n"
+        "                    every exposure time and write PREFIX_hdr.pgm (16 bit) and\n"
+        "                    PREFIX_tonemapped.pgm\n"
+        "  --bracket-frames N  Exposure times 1 stop apart around --exposure (default 5)\n"
+        "  --bracket-exposure V  Exposure times of the bracket (list or range, like\n"
+        "                    --sweep-exposure). Up to 16 values.\n"
+        "  --calib FILE      Correct analog captures with the dark and flat maps of FILE\n"
+        "  --calibrate FILE  Build the maps from stacked dark captures (exposure 0000) and\n"
+        "                    captures of a uniformly lit scene (--exposure), and write\n"
+        "                    them to FILE. --stack sets the frames (default 16).\n"
+        "  --publish NAME    Publish every capture in a shared memory frame ring\n"
+        "  --verbose         Print what is being done to stderr\n"
+        "\n"
+        "All values are hexadecimal. Pictures are written as 8 bit PGM files. Analog\n"
+        "captures are written as 8 or 16 bit PGM files with the values of the sensor.\n"
+        "No pictures are taken if --dump, --gallery, --sweep, --bracket or --calibrate\n"
+        "are used.\n");
+}
+
+static int WriteFrame(FILE * f, int kind, int raw)
+{
+    if(kind == KIND_ANALOG)
+    {
+        int size = GBCAM_SENSOR_W * analog_lines;
+
+        if(!raw)
+            return Image_WritePGM16(f,analogdata,GBCAM_SENSOR_W,analog_lines,(1<<analog_bits)-1);
+
+        //Raw: 1 byte per pixel for 8 bit captures, 2 bytes (little endian) for 10 bit ones
+        int i;
+        for(i = 0; i < size; i++)
+        {
+            fputc(analogdata[i] & 0xFF,f);
+            if(analog_bits > 8)
+                fputc(analogdata[i] >> 8,f);
+        }
+        return (ferror(f) || fflush(f)) ? -1 : 0;
+    }
+    else
+    {
+        int rows = (kind == KIND_THUMBNAIL) ? 2 : 14;
+
+        if(raw)
+        {
+            if(fwrite(picturedata,1,16*rows*16,f) != (size_t)(16*rows*16))
+                return -1;
+            return fflush(f) ? -1 : 0;
+        }
+
+        unsigned char gray[GBCAM_W*GBCAM_H];
+        Image_TilesToGray(picturedata,16,16,rows,gray,GBCAM_W);
+        return Image_WritePGM8(f,gray,GBCAM_W,rows*8);
+    }
+}
+
+//Reads the SRAM from the cartridge if no .sav file is specified. Returns the exit code.
+static int DecodeSram(const char * sav_file, const char * dump_file, const char * gallery_prefix)
+{
+    unsigned char * sav = malloc(SRAM_SIZE);
+    if(sav == NULL)
+        return 5;
+
+    int ret = 0;
+
+    if(sav_file)
+    {
+        if(Sram_Load(sav_file,sav) != 0)
+        {
+            fprintf(stderr,"Can't read %s\n",sav_file);
+            ret = 4;
+        }
+    }
+    else
+    {
+        unsigned long long start = Timer_GetMicroseconds();
+
+        if(Sram_Dump(sav) != 0)
+        {
+            fprintf(stderr,"Can't read the SRAM\n");
+            ret = 3;
+        }
+        else if(verbose)
+        {
+            fprintf(stderr,"SRAM read in %llu ms\n",(Timer_GetMicroseconds()-start)/1000);
+        }
+    }
+
+    if( (ret == 0) && dump_file && (Sram_Save(dump_file,sav) != 0) )
+    {
+        fprintf(stderr,"Can't write %s\n",dump_file);
+        ret = 4;
+    }
+
+    if( (ret == 0) && gallery_prefix )
+    {
+        int photos = Sram_SaveGallery(sav,gallery_prefix);
+        if(photos < 0)
+        {
+            fprintf(stderr,"Can't write the gallery\n");
+            ret = 4;
+        }
+        else if(verbose)
+        {
+            fprintf(stderr,"%d photos, %d deleted\n",photos,SRAM_NUM_PHOTOS-photos);
+        }
+    }
+
+    free(sav);
+    return ret;
+}
+
+int main(int argc, char * argv[])
+{
+    char * port = "COM4";
+    const char * record_file = NULL;
+    const char * replay_file = NULL;
+    int replay_realtime = 1;
+
+    u8 trigger = 0x03;
+    u8 reg1 = 0xE8, reg4 = 0x24, reg5 = 0xBF;
+    u16 exposure = 0x1500;
+    int dithering = 1;
+    int kind = KIND_PICTURE;
+    int analog_mode = 0;
+    int stack_frames = 1;
+    int stack_mode = STACK_MODE_MEAN;
+    int count = 1;
+    unsigned int interval = 0;
+    const char * output = "-";
+    int raw = 0;
+    const char * dump_file = NULL;
+    const char * sav_file = NULL;
+    const char * gallery_prefix = NULL;
+    const char * sweep_prefix = NULL;
+    const char * bracket_prefix = NULL;
+    const char * bracket_values = NULL;
+    int bracket_frames = 5;
+    const char * publish_name = NULL;
+    const char * calib_file = NULL;
+    const char * calibrate_file = NULL;
+    const char * sweep_values[SWEEP_NUM_AXES] = { NULL, NULL, NULL, NULL };
+
+    int i;
+    for(i = 1; i < argc; i++)
+    {
+        const char * arg = argv[i];
+        const char * value = (i+1 < argc) ? argv[i+1] : NULL;
+
+        if(!strcmp(arg,"--no-dither")) dithering = 0;
+        else if(!strcmp(arg,"--10bit")) analog_mode |= CAPTURE_10BIT;
+        else if(!strcmp(arg,"--extra")) analog_mode |= CAPTURE_EXTRA;
+        else if(!strcmp(arg,"--raw")) raw = 1;
+        else if(!strcmp(arg,"--fast")) replay_realtime = 0;
+        else if(!strcmp(arg,"--verbose")) verbose = 1;
+        else if(!strcmp(arg,"--crc")) capture_crc = 1;
+        else if(!strcmp(arg,"--help")) { PrintUsage(); return 0; }
+        else if(!strncmp(arg,"--",2))
+        {
+            if(value == NULL)
+            {
+                PrintUsage();
+                return 1;
+            }
+            i++;
+
+            if(!strcmp(arg,"--trigger")) trigger = strtoul(value,NULL,16);
+            else if(!strcmp(arg,"--reg1")) reg1 = strtoul(value,NULL,16);
+            else if(!strcmp(arg,"--reg4")) reg4 = strtoul(value,NULL,16);
+            else if(!strcmp(arg,"--reg5")) reg5 = strtoul(value,NULL,16);
+            else if(!strcmp(arg,"--exposure")) exposure = strtoul(value,NULL,16);
+            else if(!strcmp(arg,"--count")) count = atoi(value);
+            else if(!strcmp(arg,"--stack")) stack_frames = atoi(value);
+            else if(!strcmp(arg,"--interval")) interval = atoi(value);
+            else if(!strcmp(arg,"--output")) output = value;
+            else if(!strcmp(arg,"--record")) record_file = value;
+            else if(!strcmp(arg,"--replay")) replay_file = value;
+            else if(!strcmp(arg,"--dump")) dump_file = value;
+            else if(!strcmp(arg,"--sav")) sav_file = value;
+            else if(!strcmp(arg,"--gallery")) gallery_prefix = value;
+            else if(!strcmp(arg,"--sweep")) sweep_prefix = value;
+            else if(!strcmp(arg,"--publish")) publish_name = value;
+            else if(!strcmp(arg,"--calib")) calib_file = value;
+            else if(!strcmp(arg,"--calibrate")) calibrate_file = value;
+            else if(!strcmp(arg,"--bracket")) bracket_prefix = value;
+            else if(!strcmp(arg,"--bracket-frames")) bracket_frames = atoi(value);
+            else if(!strcmp(arg,"--bracket-exposure")) bracket_values = value;
+            else if(!strcmp(arg,"--sweep-reg1")) sweep_values[SWEEP_AXIS_REG1] = value;
+            else if(!strcmp(arg,"--sweep-reg4")) sweep_values[SWEEP_AXIS_REG4] = value;
+            else if(!strcmp(arg,"--sweep-reg5")) sweep_values[SWEEP_AXIS_REG5] = value;
+            else if(!strcmp(arg,"--sweep-exposure")) sweep_values[SWEEP_AXIS_EXPOSURE] = value;
+            else if(!strcmp(arg,"--stack-mode"))
+            {
+                for(stack_mode = 0; stack_mode < STACK_NUM_MODES; stack_mode++)
+                    if(!strcmp(value,Stack_GetModeName(stack_mode)))
+                        break;
+                if(stack_mode == STACK_NUM_MODES)
+                {
+                    PrintUsage();
+                    return 1;
+                }
+            }
+            else if(!strcmp(arg,"--kind"))
+            {
+                if(!strcmp(value,"picture")) kind = KIND_PICTURE;
+                else if(!strcmp(value,"thumbnail")) kind = KIND_THUMBNAIL;
+                else if(!strcmp(value,"analog")) kind = KIND_ANALOG;
+                else
+                {
+                    PrintUsage();
+                    return 1;
+                }
+            }
+            else
+            {
+                PrintUsage();
+                return 1;
+            }
+        }
+        else port = argv[i];
+    }
+
+    static SweepAxis sweep_axes[SWEEP_NUM_AXES];
+    if(sweep_prefix)
+    {
+        const u16 defaults[SWEEP_NUM_AXES] = { exposure, reg5, reg4, reg1 };
+        for(i = 0; i < SWEEP_NUM_AXES; i++)
+        {
+            if(sweep_values[i] == NULL)
+                Sweep_SetAxisValue(&sweep_axes[i],defaults[i]);
+            else if(Sweep_ParseAxis(&sweep_axes[i],i,sweep_values[i]) != 0)
+            {
+                fprintf(stderr,"Invalid sweep values: %s\n",sweep_values[i]);
+                return 1;
+            }
+        }
+        if(Sweep_GetPoints(sweep_axes) < 0)
+        {
+            fprintf(stderr,"The sweep has more than %d captures\n",SWEEP_MAX_POINTS);
+            return 1;
+        }
+    }
+
+    static u16 bracket_exposures[BRACKET_MAX_FRAMES];
+    if(bracket_prefix)
+    {
+        if(bracket_values)
+        {
+            static SweepAxis axis;
+            if( (Sweep_ParseAxis(&axis,SWEEP_AXIS_EXPOSURE,bracket_values) != 0) ||
+                (axis.count > BRACKET_MAX_FRAMES) )
+            {
+                fprintf(stderr,"Invalid bracket exposure times: %s\n",bracket_values);
+                return 1;
+            }
+            bracket_frames = axis.count;
+            memcpy(bracket_exposures,axis.values,axis.count*sizeof(u16));
+        }
+        else
+        {
+            bracket_frames = Bracket_MakeLadder(exposure,bracket_frames,bracket_exposures);
+        }
+    }
+
+    Debug_Init();
+
+    Timing_Init();
+    Timing_Load("timing.txt");
+
+    if(calib_file)
+    {
+        if(Calib_Load(calib_file) != 0)
+        {
+            fprintf(stderr,"Can't read the calibration file %s\n",calib_file);
+            return 1;
+        }
+        calib_enabled = 1;
+    }
+
+    signal(SIGINT,SignalHandler);
+
+    if(sav_file)
+    {
+        if(gallery_prefix == NULL)
+        {
+            PrintUsage();
+            return 1;
+        }
+        return DecodeSram(sav_file,NULL,gallery_prefix);
+    }
+
+    FILE * out_stdout = NULL;
+    if(!strcmp(output,"-"))
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout),_O_BINARY);
+#endif
+        out_stdout = stdout;
+    }
+
+    if(replay_file)
+    {
+        if(SerialReplayCreate(replay_file,replay_realtime) != 0)
+            return 2;
+    }
+    else
+    {
+        SerialCreate(port);
+
+        if(record_file)
+            SerialRecordStart(record_file);
+    }
+
+    if(!SerialIsConnected())
+    {
+        fprintf(stderr,"Can't connect to %s\n",replay_file ? replay_file : port);
+        return 2;
+    }
+
+    if(sweep_prefix)
+    {
+        unsigned long long start = Timer_GetMicroseconds();
+        int points = Sweep_Run(sweep_axes,trigger,dithering,sweep_prefix);
+        if(points < 0)
+            fprintf(stderr,"Sweep failed\n");
+        else if(verbose)
+            fprintf(stderr,"Sweep: %d captures in %llu ms\n",points,
+                    (Timer_GetMicroseconds()-start)/1000);
+        SerialDestroy();
+        return (points < 0) ? 3 : 0;
+    }
+
+    if(bracket_prefix)
+    {
+        int mode = (kind == KIND_ANALOG) ? (CAPTURE_ANALOG | analog_mode) : 0;
+        unsigned long long start = Timer_GetMicroseconds();
+        int ret = 0;
+        if(Bracket_Capture(bracket_exposures,bracket_frames,NULL,
+                           trigger,reg1,reg4,reg5,dithering,mode) != 0)
+        {
+            fprintf(stderr,"Bracket failed\n");
+            ret = 3;
+        }
+        else if(Bracket_Save(bracket_prefix) != 0)
+        {
+            fprintf(stderr,"Can't write the bracket\n");
+            ret = 4;
+        }
+        else if(verbose)
+        {
+            fprintf(stderr,"Bracket: %d captures in %llu ms\n",bracket_frames,
+                    (Timer_GetMicroseconds()-start)/1000);
+        }
+        SerialDestroy();
+        return ret;
+    }
+
+    if(calibrate_file)
+    {
+        int frames = (stack_frames > 1) ? stack_frames : CALIB_DEFAULT_FRAMES;
+        int ret = 0;
+        if(Calib_Capture(frames,trigger,reg1,exposure,reg4,reg5,dithering,analog_mode) != 0)
+        {
+            fprintf(stderr,"Calibration failed\n");
+            ret = 3;
+        }
+        else if(Calib_Save(calibrate_file) != 0)
+        {
+            fprintf(stderr,"Can't write %s\n",calibrate_file);
+            ret = 4;
+        }
+        SerialDestroy();
+        return ret;
+    }
+
+    if(dump_file || gallery_prefix)
+    {
+        int ret = DecodeSram(NULL,dump_file,gallery_prefix);
+        SerialDestroy();
+        return ret;
+    }
+
+    if(verbose)
+    {
+        unsigned int bytes = (kind == KIND_THUMBNAIL) ? 16*2*16 : 16*14*16;
+        fprintf(stderr,"Predicted capture time: %.0f ms\n",
+                Timing_PredictCaptureMs(reg1,exposure,bytes));
+    }
+
+    FrameRing * ring = NULL;
+    if(publish_name)
+    {
+        ring = FrameRing_Create(publish_name);
+        if(ring == NULL)
+        {
+            fprintf(stderr,"Can't create the frame ring %s\n",publish_name);
+            SerialDestroy();
+            return 2;
+        }
+    }
+
+    const int ring_kind[3] = { FRAMERING_KIND_PICTURE, FRAMERING_KIND_THUMBNAIL,
+                               FRAMERING_KIND_ANALOG };
+
+    int ret = 0;
+    int frame;
+    for(frame = 0; (count == 0) || (frame < count); frame++)
+    {
+        unsigned long long start = Timer_GetMicroseconds();
+
+        int result;
+        if( (kind == KIND_ANALOG) && (stack_frames > 1) )
+            result = Stack_Capture(stack_frames,stack_mode,NULL,
+                                   trigger,reg1,exposure,reg4,reg5,dithering,analog_mode);
+        else if(kind == KIND_ANALOG)
+            result = TakePictureAnalogAndTransfer(trigger,reg1,exposure,reg4,reg5,dithering,analog_mode);
+        else
+            result = TakePictureAndTransfer(trigger,reg1,exposure,reg4,reg5,dithering,
+                                            kind == KIND_THUMBNAIL);
+        if(result != 0)
+        {
+            fprintf(stderr,"Capture %d failed\n",frame);
+            ret = 3;
+            break;
+        }
+
+        Capture_PublishFrame(ring,ring_kind[kind],trigger,reg1,exposure,reg4,reg5);
+
+        FILE * f = out_stdout;
+        if(f == NULL)
+        {
+            char filename[1024];
+            snprintf(filename,sizeof(filename),output,frame);
+            f = fopen(filename,"wb");
+            if(f == NULL)
+            {
+                fprintf(stderr,"Can't open %s\n",filename);
+                ret = 4;
+                break;
+            }
+        }
+
+        result = WriteFrame(f,kind,raw);
+
+        if(f != out_stdout)
+            fclose(f);
+
+        if(result != 0)
+        {
+            fprintf(stderr,"Can't write frame %d\n",frame);
+            ret = 4;
+            break;
+        }
+
+        if(verbose)
+            fprintf(stderr,"Frame %d: %llu ms\n",frame,(Timer_GetMicroseconds()-start)/1000);
+
+        if(quit_requested)
+            break;
+
+        unsigned long long elapsed_ms = (Timer_GetMicroseconds()-start)/1000;
+        if(elapsed_ms < interval)
+            Timer_SleepMs(interval - elapsed_ms);
+    }
+
+    FrameRing_Close(ring);
+
+    SerialDestroy();
+
+    return ret;
+}
+
+//-------------------------------------------------------------------------------------
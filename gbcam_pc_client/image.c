@@ -0,0 +1,86 @@
+
+#include <stdio.h>
+
+#include "image.h"
+
+//-------------------------------------------------------------------------
+
+void Image_TilesToGray(const unsigned char * tiles, int tiles_per_row, int tw, int th,
+                       unsigned char * out, int out_stride)
+{
+    const unsigned char gb_pal_colors[4] = { 255, 168, 80, 0 };
+
+    int y, x;
+    for(y = 0; y < th*8; y++) for(x = 0; x < tw*8; x++)
+    {
+        int tile = (y>>3)*tiles_per_row + (x>>3);
+        const unsigned char * line = &tiles[tile*16 + ((y&7) << 1)];
+
+        int x_ = 7-(x&7);
+
+        int color = ( (line[0] >> x_) & 1 ) | ( ( (line[1] >> x_) << 1) & 2);
+
+        out[y*out_stride + x] = gb_pal_colors[color];
+    }
+}
+
+//-------------------------------------------------------------------------
+
+//3x5 font, one byte per row (bits 2-0 = left to right)
+static const unsigned char hex_font[16][5] = {
+    { 7, 5, 5, 5, 7 }, { 2, 6, 2, 2, 7 }, { 7, 1, 7, 4, 7 }, { 7, 1, 7, 1, 7 },
+    { 5, 5, 7, 1, 1 }, { 7, 4, 7, 1, 7 }, { 7, 4, 7, 5, 7 }, { 7, 1, 1, 1, 1 },
+    { 7, 5, 7, 5, 7 }, { 7, 5, 7, 1, 7 }, { 7, 5, 7, 5, 5 }, { 6, 5, 6, 5, 6 },
+    { 7, 4, 4, 4, 7 }, { 6, 5, 5, 5, 6 }, { 7, 4, 7, 4, 7 }, { 7, 4, 7, 4, 4 }
+};
+
+int Image_DrawHex(unsigned char * out, int out_stride, int x, int y, const char * text,
+                  unsigned char color)
+{
+    for( ; *text; text++, x += 4)
+    {
+        int digit;
+        if( (*text >= '0') && (*text <= '9') ) digit = *text - '0';
+        else if( (*text >= 'A') && (*text <= 'F') ) digit = *text - 'A' + 10;
+        else if( (*text >= 'a') && (*text <= 'f') ) digit = *text - 'a' + 10;
+        else continue; // Blank
+
+        int i, j;
+        for(j = 0; j < 5; j++) for(i = 0; i < 3; i++)
+        {
+            if(hex_font[digit][j] & (4 >> i))
+                out[(y+j)*out_stride + x + i] = color;
+        }
+    }
+
+    return x;
+}
+
+//-------------------------------------------------------------------------
+
+int Image_WritePGM8(FILE * f, const unsigned char * pixels, int w, int h)
+{
+    fprintf(f,"P5\n%d %d\n255\n",w,h);
+
+    if(fwrite(pixels,1,w*h,f) != (size_t)(w*h))
+        return -1;
+
+    return fflush(f) ? -1 : 0;
+}
+
+int Image_WritePGM16(FILE * f, const unsigned short * pixels, int w, int h, int maxval)
+{
+    fprintf(f,"P5\n%d %d\n%d\n",w,h,maxval);
+
+    int i;
+    for(i = 0; i < w*h; i++)
+    {
+        if(maxval > 255)
+            fputc(pixels[i] >> 8,f);
+        fputc(pixels[i] & 0xFF,f);
+    }
+
+    return (ferror(f) || fflush(f)) ? -1 : 0;
+}
+
+//-------------------------------------------------------------------------
@@ -0,0 +1,23 @@
+
+#ifndef __IMAGE__
+#define __IMAGE__
+
+#include <stdio.h>
+
+//Converts tw*th tiles to 8 bit grayscale pixels using the colors of the GB. tiles points
+//to the first tile to convert, tiles_per_row is the width of the whole tile map (16 for
+//a picture, 4 for a thumbnail) and out_stride is the width of the output buffer.
+void Image_TilesToGray(const unsigned char * tiles, int tiles_per_row, int tw, int th,
+                       unsigned char * out, int out_stride);
+
+//Draws hexadecimal digits with a 3x5 font (4 pixels per character). Other characters are
+//left blank. Returns the x coordinate after the text.
+int Image_DrawHex(unsigned char * out, int out_stride, int x, int y, const char * text,
+                  unsigned char color);
+
+//Binary PGM files. If maxval is greater than 255 every pixel is written as 2 bytes (big
+//endian), as required by the format. They return 0 on success.
+int Image_WritePGM8(FILE * f, const unsigned char * pixels, int w, int h);
+int Image_WritePGM16(FILE * f, const unsigned short * pixels, int w, int h, int maxval);
+
+#endif // __IMAGE__
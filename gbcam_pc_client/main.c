@@ -6,13 +6,15 @@
 #include <SDL2/SDL.h>
 
 #include "serial.h"
+#include "serial_replay.h"
 #include "debug.h"
-
-//-------------------------------------------------------------------------------------
-
-typedef unsigned int u32;
-typedef unsigned short u16;
-typedef unsigned char u8;
+#include "timing.h"
+#include "capture.h"
+#include "stack.h"
+#include "bracket.h"
+#include "calib.h"
+#include "sram.h"
+#include "timer.h"
 
 //-------------------------------------------------------------------------------------
 
@@ -37,17 +39,34 @@ int takepicture = 0, takeanalog = 0;
 int readpicture = 0;
 int dither_on = 1;
 int debugpicture = 0;
+int readregion = 0;
+int calibratetiming = 0;
+int analog_mode = 0; // CAPTURE_10BIT and/or CAPTURE_EXTRA
+int stackpicture = 0;
+int stack_frames = 8;
+int stack_mode = STACK_MODE_MEAN;
+int requantize_on = 0; // Show the last analog capture quantized with the current thresholds
+int requantize_pending = 0;
+int analog_valid = 0;
+int showanalog = 0;
+int dumpsram = 0;
+int preview_on = 0; // Live preview with a reduced readout
+int bracketpicture = 0, bracketanalog = 0;
+int bracket_frames = 5;
+int preview_line_step = 2;
+int calibrateflat = 0; // Build the dark and flat maps of analog captures
+
+//Every capture is published here for other programs
+FrameRing * frame_ring = NULL;
+
+//Region of interest (in tiles)
+int roi_x = 6, roi_y = 5, roi_w = 4, roi_h = 4;
 
 //-------------------------------------------------------------------------------------
 
-#define GBCAM_W (128)
-#define GBCAM_H (112)
-
 #define SCREEN_W (GBCAM_W*3 + 256)
 #define SCREEN_H (GBCAM_H*3)
 
-#define BIT(n) (1<<(n))
-
 static unsigned char SCREEN_BUFFER[SCREEN_W*SCREEN_H*3];
 static unsigned char GBCAM_BUFFER[GBCAM_W*GBCAM_H*3];
 static unsigned char HISTOGRAM_BUFFER[256*(SCREEN_H/2)*3];
@@ -84,7 +103,7 @@ int WindowCreate(void)
 
         if(mRenderer == NULL)
         {
-            Debug_Log("Renderer could not be created! SDL Error: %s\n", SDL_GetError());
+            Debug_Error("Renderer could not be created! SDL Error: %s\n", SDL_GetError());
             SDL_DestroyWindow(mWindow);
             mWindow = NULL;
         }
@@ -96,7 +115,7 @@ int WindowCreate(void)
                                          SCREEN_W,SCREEN_H);
             if(mTexture == NULL)
             {
-                Debug_Log("Couldn't create texture! SDL Error: %s\n", SDL_GetError());
+                Debug_Error("Couldn't create texture! SDL Error: %s\n", SDL_GetError());
                 SDL_DestroyWindow(mWindow); // this message shows even if everything is correct... weird...
                 SDL_GL_DeleteContext(mGLContext);
                 mWindow = NULL;
@@ -109,7 +128,7 @@ int WindowCreate(void)
     }
     else
     {
-        Debug_Log("Window could not be created! SDL Error: %s\n", SDL_GetError());
+        Debug_Error("Window could not be created! SDL Error: %s\n", SDL_GetError());
     }
 
     return -1;
@@ -197,78 +216,173 @@ void WindowRender(void)
 
 //-------------------------------------------------------------------------------------
 
-unsigned char c1 = 0x40, c2 = 0x80, c3 = 0xC0;
+//Set when the window has to be drawn again
+static int redraw = 1;
+
+//Event pushed by the thread of the serial port when data is received
+static Uint32 serial_event_type;
+static SDL_atomic_t serial_event_pending;
 
-static int HandleEvents(void)
+static void SerialDataReceived(void)
 {
-    SDL_Event e;
+    //Don't fill the event queue if the main thread is busy
+    if(SDL_AtomicCAS(&serial_event_pending,0,1))
+    {
+        SDL_Event e;
+        memset(&e,0,sizeof(e));
+        e.type = serial_event_type;
+        SDL_PushEvent(&e);
+    }
+}
 
-    while(SDL_PollEvent(&e))
+static int HandleEvent(SDL_Event * e)
+{
+    if(e->type == SDL_QUIT)
     {
-        if(e.type == SDL_QUIT)
-        {
-            return 1;
-        }
-        else if(e.type == SDL_KEYDOWN)
+        return 1;
+    }
+    else if(e->type == SDL_KEYDOWN)
+    {
+        redraw = 1;
+
+        switch(e->key.keysym.sym)
         {
-            switch(e.key.keysym.sym)
-            {
-                case SDLK_KP_7: c1++; break;
-                case SDLK_KP_4: c1--; break;
-                case SDLK_KP_8: c2++; break;
-                case SDLK_KP_5: c2--; break;
-                case SDLK_KP_9: c3++; break;
-                case SDLK_KP_6: c3--; break;
+            case SDLK_KP_7: c1++; requantize_pending = 1; break;
+            case SDLK_KP_4: c1--; requantize_pending = 1; break;
+            case SDLK_KP_8: c2++; requantize_pending = 1; break;
+            case SDLK_KP_5: c2--; requantize_pending = 1; break;
+            case SDLK_KP_9: c3++; requantize_pending = 1; break;
+            case SDLK_KP_6: c3--; requantize_pending = 1; break;
+
+            case SDLK_ESCAPE: return 1;
+
+            case SDLK_r:
+                reg1 = 0xE8;
+                reg4 = 0x24;
+                reg5 = 0xBF;
+                exptime = 0x1500;
+                break;
+            case SDLK_f:
+                reg1 = 0xE8;
+                reg4 = 0x24;
+                reg5 = 0xBF;
+                exptime = 0x0040;
+                break;
 
-                case SDLK_ESCAPE: return 1;
+            case SDLK_z: dither_on = !dither_on; requantize_pending = 1; break;
 
-                case SDLK_r:
-                    reg1 = 0xE8;
-                    reg4 = 0x24;
-                    reg5 = 0xBF;
-                    exptime = 0x1500;
-                    break;
-                case SDLK_f:
-                    reg1 = 0xE8;
-                    reg4 = 0x24;
-                    reg5 = 0xBF;
-                    exptime = 0x0040;
-                    break;
+            case SDLK_q:
+                requantize_on = !requantize_on;
+                requantize_pending = requantize_on;
+                showanalog = !requantize_on;
+                break;
+
+            case SDLK_UP: exptime +=0x10; break;
+            case SDLK_DOWN: exptime -=0x10; break;
+            case SDLK_RIGHT: exptime +=0x100; break;
+            case SDLK_LEFT: exptime -=0x100; break;
+
+            case SDLK_RETURN: takepicture = 1; break;
+
+            case SDLK_BACKSPACE: takeanalog = 1; break;
+
+            case SDLK_SPACE: readpicture = 1; break;
+
+            case SDLK_p: debugpicture = 1; break;
 
-                case SDLK_z: dither_on = !dither_on; break;
+            case SDLK_i: readregion = 1; break;
 
-                case SDLK_UP: exptime +=0x10; break;
-                case SDLK_DOWN: exptime -=0x10; break;
-                case SDLK_RIGHT: exptime +=0x100; break;
-                case SDLK_LEFT: exptime -=0x100; break;
+            case SDLK_c: calibratetiming = 1; break;
 
-                case SDLK_RETURN: takepicture = 1; break;
+            case SDLK_a: analog_mode ^= CAPTURE_10BIT; break;
+            case SDLK_e: analog_mode ^= CAPTURE_EXTRA; break;
 
-                case SDLK_BACKSPACE: takeanalog = 1; break;
+            case SDLK_s: stackpicture = 1; break;
+            case SDLK_m: stack_mode = (stack_mode + 1) % STACK_NUM_MODES; break;
+            case SDLK_KP_PLUS: if(stack_frames < STACK_MAX_FRAMES) stack_frames++; break;
+            case SDLK_KP_MINUS: if(stack_frames > 2) stack_frames--; break;
 
-                case SDLK_SPACE: readpicture = 1; break;
+            case SDLK_d: dumpsram = 1; break;
 
-                case SDLK_p: debugpicture = 1; break;
+            case SDLK_h: bracketpicture = 1; break;
+            case SDLK_j: bracketanalog = 1; break;
 
-                default: break;
+            case SDLK_u: capture_crc = !capture_crc; break;
+
+            case SDLK_k: calibrateflat = 1; break;
+            case SDLK_g: calib_enabled = !calib_enabled; break;
+
+            case SDLK_v: preview_on = !preview_on; break;
+            case SDLK_l: preview_line_step = (preview_line_step >= 8) ? 2 : preview_line_step*2; break;
+
+            default: break;
+        }
+    }
+    else if(e->type == SDL_MOUSEBUTTONDOWN)
+    {
+        redraw = 1;
+
+        if(e->button.button == 1)
+        {
+            int ix = (e->button.x - GBCAM_W*3) / 32;
+            int iy = e->button.y / 32;
+            if( (ix < 8) && (iy < 4) )
+            {
+                if(iy == 0) { trig_value ^= BIT(7-ix); trig_value &= 0x07; }
+                else if(iy == 1) reg1 ^= BIT(7-ix);
+                else if(iy == 2) reg4 ^= BIT(7-ix);
+                else if(iy == 3) reg5 ^= BIT(7-ix);
             }
         }
-        else if(e.type == SDL_MOUSEBUTTONDOWN)
+        else if(e->button.button == 3) // Center region of interest in the clicked tile
         {
-            if(e.button.button == 1)
+            int tx = e->button.x / (8*3);
+            int ty = e->button.y / (8*3);
+            if( (tx < 16) && (ty < 14) )
             {
-                int ix = (e.button.x - GBCAM_W*3) / 32;
-                int iy = e.button.y / 32;
-                if( (ix < 8) && (iy < 4) )
-                {
-                    if(iy == 0) { trig_value ^= BIT(7-ix); trig_value &= 0x07; }
-                    else if(iy == 1) reg1 ^= BIT(7-ix);
-                    else if(iy == 2) reg4 ^= BIT(7-ix);
-                    else if(iy == 3) reg5 ^= BIT(7-ix);
-                }
+                roi_x = tx - roi_w/2;
+                roi_y = ty - roi_h/2;
+                if(roi_x < 0) roi_x = 0;
+                if(roi_y < 0) roi_y = 0;
+                if(roi_x > 16 - roi_w) roi_x = 16 - roi_w;
+                if(roi_y > 14 - roi_h) roi_y = 14 - roi_h;
             }
         }
     }
+    else if(e->type == SDL_WINDOWEVENT)
+    {
+        redraw = 1;
+    }
+    else if(e->type == serial_event_type)
+    {
+        //Only used to wake up the thread, the data is read by the code waiting for it
+        SDL_AtomicSet(&serial_event_pending,0);
+    }
+
+    return 0;
+}
+
+//Sleeps until there is at least one event (or the timeout expires, if it isn't -1) and
+//handles all pending events. Returns 1 if the program has to exit.
+static int HandleEvents(int timeout_ms)
+{
+    SDL_Event e;
+
+    if(timeout_ms < 0)
+    {
+        if(!SDL_WaitEvent(&e))
+            return 0;
+    }
+    else
+    {
+        if(!SDL_WaitEventTimeout(&e,timeout_ms))
+            return 0;
+    }
+
+    do {
+        if(HandleEvent(&e))
+            return 1;
+    } while(SDL_PollEvent(&e));
 
     return 0;
 }
@@ -280,11 +394,13 @@ static int Init(void)
     //Initialize SDL
     if( SDL_Init(SDL_INIT_EVERYTHING) != 0 )
     {
-        Debug_Log( "SDL could not initialize! SDL Error: %s\n", SDL_GetError() );
+        Debug_Error( "SDL could not initialize! SDL Error: %s\n", SDL_GetError() );
         return 1;
     }
     atexit(SDL_Quit);
 
+    serial_event_type = SDL_RegisterEvents(1);
+
     if(WindowCreate() != 0)
         return 1;
     atexit(WindowClose);
@@ -294,13 +410,10 @@ static int Init(void)
 
 //-------------------------------------------------------------------------------------
 
-unsigned char picturedata[16*14*8*8]; // max( 16*8*14*8, 16*14*16 ) sensor pixels , tile bytes
-
-void ConvertTilesToBitmap(void)
+//Only modifies the part of the bitmap covered by the specified rectangle of tiles. The
+//histogram only shows the pixels inside the rectangle.
+void ConvertTilesToBitmapRegion(int tx, int ty, int tw, int th)
 {
-    //Convert to bitmap
-    memset(GBCAM_BUFFER,0,sizeof(GBCAM_BUFFER));
-
     memset(HISTOGRAM_BUFFER,0,sizeof(HISTOGRAM_BUFFER));
 
     const int gb_pal_colors[4] = { 255, 168, 80, 0 };
@@ -309,7 +422,7 @@ void ConvertTilesToBitmap(void)
     memset(histogram,0,sizeof(histogram));
 
     int y, x;
-    for(y = 0; y < 14*8; y++) for(x = 0; x < 16*8; x ++)
+    for(y = ty*8; y < (ty+th)*8; y++) for(x = tx*8; x < (tx+tw)*8; x ++)
     {
         int basetileaddr = ( ((y>>3)*16+(x>>3)) * 16 );
         int baselineaddr = basetileaddr + ((y&7) << 1);
@@ -345,453 +458,176 @@ void ConvertTilesToBitmap(void)
     }
 }
 
-void ConvertAnalogToBitmap(void)
+void ConvertTilesToBitmap(void)
 {
+    //Convert to bitmap
     memset(GBCAM_BUFFER,0,sizeof(GBCAM_BUFFER));
 
-    memset(HISTOGRAM_BUFFER,0,sizeof(HISTOGRAM_BUFFER));
+    ConvertTilesToBitmapRegion(0,0,16,14);
+}
 
-    int histogram[256];
-    memset(histogram,0,sizeof(histogram));
+//Used for the live preview, when only one of every line_step lines of picturedata is
+//valid. The missing lines are interpolated between the closest lines that have been read.
+void ConvertPreviewToBitmap(int line_step)
+{
+    const int gb_pal_colors[4] = { 255, 168, 80, 0 };
+
+    memset(HISTOGRAM_BUFFER,0,sizeof(HISTOGRAM_BUFFER));
 
     int y, x;
-    for(y = 0; y < 14*8; y++) for(x = 0; x < 16*8; x ++)
+    for(y = 0; y < GBCAM_H; y++)
     {
-        int index = y*16*8 + x;
+        int y0 = y - (y % line_step);
+        int y1 = y0 + line_step;
+        if(y1 >= GBCAM_H) y1 = y0;
+        int w1 = y - y0; // Weight of y1
 
-        unsigned char color = picturedata[index];
+        for(x = 0; x < GBCAM_W; x++)
+        {
+            int x_ = 7-(x&7);
 
-        int bufindex = (y*GBCAM_W+x)*3;
-        GBCAM_BUFFER[bufindex+0] = color;
-        GBCAM_BUFFER[bufindex+1] = color;
-        GBCAM_BUFFER[bufindex+2] = color;
+            const unsigned char * l0 = &picturedata[((y0>>3)*16+(x>>3))*16 + ((y0&7)<<1)];
+            const unsigned char * l1 = &picturedata[((y1>>3)*16+(x>>3))*16 + ((y1&7)<<1)];
 
-        histogram[color] ++;
-    }
+            int c0 = ((l0[0] >> x_) & 1) | (((l0[1] >> x_) << 1) & 2);
+            int c1_ = ((l1[0] >> x_) & 1) | (((l1[1] >> x_) << 1) & 2);
 
-    int c;
-    for(c = 0; c < 256; c++)
-    {
-        int start_coord = (SCREEN_H/2) - histogram[c];
-        if(start_coord < 0) start_coord = 0;
+            int color = (gb_pal_colors[c0]*(line_step-w1) + gb_pal_colors[c1_]*w1) / line_step;
 
-        int j;
-        for(j = start_coord; j < (SCREEN_H/2); j++)
-        {
-            HISTOGRAM_BUFFER[(j*256+c)*3+0] = 0xFF;
-            HISTOGRAM_BUFFER[(j*256+c)*3+1] = 0xFF;
-            HISTOGRAM_BUFFER[(j*256+c)*3+2] = 0xFF;
+            int bufindex = (y*GBCAM_W+x)*3;
+            GBCAM_BUFFER[bufindex+0] = color;
+            GBCAM_BUFFER[bufindex+1] = color;
+            GBCAM_BUFFER[bufindex+2] = color;
         }
     }
 }
 
-//-------------------------------------------------------------------------------------
-
-static inline unsigned int asciihextoint(char c)
-{
-  if((c >= '0') && (c <= '9')) return c - '0';
-  if((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
-  return 0;
-}
-
-int readByte(unsigned int addr)
+void ConvertAnalogToBitmap(void)
 {
-    char str[50];
+    memset(GBCAM_BUFFER,0,sizeof(GBCAM_BUFFER));
 
-    char data[2];
+    memset(HISTOGRAM_BUFFER,0,sizeof(HISTOGRAM_BUFFER));
 
-    sprintf(str,"R%04X.",addr&0xFFFF);
-    if(SerialWriteData(str,6) == 0)
-    {
-        Debug_Log("SerialWriteData() error in readByte()");
-        return -1;
-    }
+    int histogram[1<<10];
+    memset(histogram,0,sizeof(histogram));
 
-    while(SerialGetInQueue() < 2)
-    {
-        if(HandleEvents()) exit(0);
-        SDL_Delay(1);
-    }
+    int shift = analog_bits - 8;
 
-    if(SerialReadData(data,2) != 2)
+    int y, x;
+    for(y = 0; y < analog_lines; y++) for(x = 0; x < GBCAM_SENSOR_W; x ++)
     {
-        Debug_Log("SerialReadData() error in readByte()");
-        return -1;
-    }
+        int value = analogdata[y*GBCAM_SENSOR_W + x];
 
-    return (asciihextoint(data[0])<<4)|asciihextoint(data[1]);
-}
+        histogram[value] ++;
 
-void writeByte(unsigned int addr, unsigned int value)
-{
-    char str[50];
-    sprintf(str,"W%04X%02X.",addr&0xFFFF,value&0xFF);
-    SerialWriteData(str,8);
-    return;
-}
-
-#define ramEnable() writeByte(0x0000,0x0A)
-
-#define ramDisable() writeByte(0x0000,0x00)
-
-void setRegisterMode(void)
-{
-    SerialWriteData("Z.",2);
-    return;
-}
-
-void setRamModeBank0(void)
-{
-    SerialWriteData("X.",2);
-    return;
-}
-
-//-------------------------------------------------------------------------------------
-
-void readPicture(void)
-{
-    SDL_SetWindowTitle(mWindow,"Reading picture...");
-
-    if(SerialWriteData("P.",2)==0)
-    {
-        Debug_Log("SerialWriteData <P.> error.");
-        return;
-    }
-
-    int i;
-    for(i = 0; i < 16*14*16; i++)
-    {
-        while(SerialGetInQueue() < 1)
-        {
-            if(HandleEvents()) exit(0);
-            SDL_Delay(1);
-        }
+        //Show the same lines as the controller
+        int y_ = y - (analog_lines - GBCAM_H);
+        if(y_ < 0)
+            continue;
 
-        unsigned char data;
-        if(SerialReadData((char*)&data,1) != 1)
-        {
-            Debug_Log("SerialReadData() error in readPicture()");
-            return;
-        }
+        unsigned char color = value >> shift;
 
-        picturedata[i] = data;
+        int bufindex = (y_*GBCAM_W+x)*3;
+        GBCAM_BUFFER[bufindex+0] = color;
+        GBCAM_BUFFER[bufindex+1] = color;
+        GBCAM_BUFFER[bufindex+2] = color;
     }
 
-    return;
-}
-
-void readThumbnail(void) // 2 rows of tiles
-{
-    SDL_SetWindowTitle(mWindow,"Reading thumbnail...");
-
-    if(SerialWriteData("T.",2)==0)
+    int c;
+    for(c = 0; c < 256; c++)
     {
-        Debug_Log("SerialWriteData <P.> error.");
-        return;
-    }
+        //Every column shows all the values that are converted to the same 8 bit color
+        int count = 0;
+        int i;
+        for(i = 0; i < (1<<shift); i++)
+            count += histogram[(c<<shift)+i];
 
-    int i;
-    for(i = 0; i < 16*2*16; i++)
-    {
-        while(SerialGetInQueue() < 1)
-        {
-            if(HandleEvents()) exit(0);
-            SDL_Delay(1);
-        }
+        int start_coord = (SCREEN_H/2) - count;
+        if(start_coord < 0) start_coord = 0;
 
-        unsigned char data;
-        if(SerialReadData((char*)&data,1) != 1)
+        int j;
+        for(j = start_coord; j < (SCREEN_H/2); j++)
         {
-            Debug_Log("SerialReadData() error in readThumbnail()");
-            return;
+            HISTOGRAM_BUFFER[(j*256+c)*3+0] = 0xFF;
+            HISTOGRAM_BUFFER[(j*256+c)*3+1] = 0xFF;
+            HISTOGRAM_BUFFER[(j*256+c)*3+2] = 0xFF;
         }
-
-        picturedata[i] = data;
-    }
-
-    return;
-}
-
-unsigned int waitPictureReady(void)
-{
-    setRegisterMode();
-
-    SerialWriteData("F.",2);
-
-    while(SerialGetInQueue() < 8)
-    {
-        if(HandleEvents()) exit(0);
-        SDL_Delay(1);
-    }
-
-    char str[9];
-    if(SerialReadData(str,8) != 8)
-    {
-        Debug_Log("SerialReadData() error in waitPictureReady()");
-        return 0;
     }
-    str[8] = '\0';
-
-    unsigned int value;
-    sscanf(str,"%u",&value);
-
-    return value;
 }
 
 //-------------------------------------------------------------------------------------
 
-void UpdateMatrixRegisters(int dithering)
+//Only changes the title if the text is different
+static void WindowSetTitle(const char * text)
 {
-    //const unsigned char matrix[] = // high light
-    //{
-    //    0x89, 0x92, 0xA2, 0x8F, 0x9E, 0xC6, 0x8A, 0x95, 0xAB, 0x91, 0xA1, 0xCF,
-    //    0x8D, 0x9A, 0xBA, 0x8B, 0x96, 0xAE, 0x8F, 0x9D, 0xC3, 0x8C, 0x99, 0xB7,
-    //    0x8A, 0x94, 0xA8, 0x90, 0xA0, 0xCC, 0x89, 0x93, 0xA5, 0x90, 0x9F, 0xC9,
-    //    0x8E, 0x9C, 0xC0, 0x8C, 0x98, 0xB4, 0x8E, 0x9B, 0xBD, 0x8B, 0x97, 0xB1
-    //};
-
-    const unsigned char matrix[48] = // low light
-    {
-        0x8C, 0x98, 0xAC, 0x95, 0xA7, 0xDB, 0x8E, 0x9B, 0xB7, 0x97, 0xAA, 0xE7,
-        0x92, 0xA2, 0xCB, 0x8F, 0x9D, 0xBB, 0x94, 0xA5, 0xD7, 0x91, 0xA0, 0xC7,
-        0x8D, 0x9A, 0xB3, 0x96, 0xA9, 0xE3, 0x8C, 0x99, 0xAF, 0x95, 0xA8, 0xDF,
-        0x93, 0xA4, 0xD3, 0x90, 0x9F, 0xC3, 0x92, 0xA3, 0xCF, 0x8F, 0x9E, 0xBF
-    };
+    static char current[256];
 
-    int i;
-    for(i = 0; i < 48; i++)
+    if(strncmp(current,text,sizeof(current)-1))
     {
-        if(dithering)
-        {
-            writeByte(0xA006+i,matrix[i]);
-        }
-        else
-        {
-            switch(i%3)
-            {
-                case 0: writeByte(0xA006+i,c1); break;
-                case 1: writeByte(0xA006+i,c2); break;
-                case 2: writeByte(0xA006+i,c3); break;
-            }
-            //writeByte(0xA006+i,matrix[i%3]);
-        }
+        strncpy(current,text,sizeof(current)-1);
+        SDL_SetWindowTitle(mWindow,text);
     }
 }
 
-void TakePictureAndTransfer(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
-                            int dithering, int thumbnail)
+void Capture_SetStatus(const char * text)
 {
-    SDL_SetWindowTitle(mWindow,"Taking picture...");
-
-    ramEnable();
-
-    setRegisterMode();
-
-    writeByte(0xA000,0x00);
-
-    writeByte(0xA001,unk1);
-
-    writeByte(0xA002,(exposure_time>>8)&0xFF);
-    writeByte(0xA003,exposure_time&0xFF);
-
-    writeByte(0xA004,unk2);
-
-    writeByte(0xA005,unk3);
-
-    UpdateMatrixRegisters(dithering);
-
-    setRamModeBank0();
-
-    char str[50];
-    if(thumbnail)
-        sprintf(str,"T%02X.",trigger&0xFF);
-    else
-        sprintf(str,"P%02X.",trigger&0xFF);
-
-    if(SerialWriteData(str,4) == 0)
-    {
-        Debug_Log("SerialWriteData() error in TakePictureAndTransfer()");
-        return;
-    }
-
-    while(SerialGetInQueue() < 1)
-    {
-        if(HandleEvents()) exit(0);
-        SDL_Delay(1);
-    }
-
-    SDL_SetWindowTitle(mWindow,"Reading picture...");
-
-    int size = 16 * (thumbnail ? 2 : 14) * 16;
-    int i;
-    for(i = 0; i < size; i++)
-    {
-        while(SerialGetInQueue() < 1)
-        {
-            if(HandleEvents()) exit(0);
-            SDL_Delay(1);
-        }
-
-        unsigned char data;
-        if(SerialReadData((char*)&data,1) != 1)
-        {
-            Debug_Log("SerialReadData() error in TakePictureAndTransfer()");
-            return;
-        }
-
-        picturedata[i] = data;
-    }
-
-    ramDisable();
-
-    ConvertTilesToBitmap();
+    WindowSetTitle(text);
 }
 
-void TakePictureAnalogAndTransfer(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
-                            int dithering)
+int Capture_Idle(void)
 {
-    SDL_SetWindowTitle(mWindow,"Taking picture...");
-
-    ramEnable();
-
-    setRegisterMode();
-
-    writeByte(0xA000,0x00);
-
-    writeByte(0xA001,unk1);
-
-    writeByte(0xA002,(exposure_time>>8)&0xFF);
-    writeByte(0xA003,exposure_time&0xFF);
-
-    writeByte(0xA004,unk2);
-
-    writeByte(0xA005,unk3);
-
-    UpdateMatrixRegisters(dithering);
-
-    char str[50];
-    sprintf(str,"A%02X.",trigger&0xFF);
-
-    if(SerialWriteData(str,4) == 0)
-    {
-        Debug_Log("SerialWriteData() error in TakePictureAnalogAndTransfer()");
-        return;
-    }
-
-    while(SerialGetInQueue() < 1)
+    //There is no thread in a replay, the data is released when it is due while waiting
+    //for it. The window is only checked between waits.
+    if(SerialReplayIsActive())
     {
-        if(HandleEvents()) exit(0);
-        SDL_Delay(1);
+        if(HandleEvents(0))
+            return 1;
+        SerialWaitData(10);
+        return 0;
     }
 
-    SDL_SetWindowTitle(mWindow,"Reading picture...");
-
-    int size = 16*8 * 14*8;
-    int i;
-    for(i = 0; i < size; i++)
-    {
-        while(SerialGetInQueue() < 1)
-        {
-            if(HandleEvents()) exit(0);
-            SDL_Delay(1);
-        }
-
-        unsigned char data;
-        if(SerialReadData((char*)&data,1) != 1)
-        {
-            Debug_Log("SerialReadData() error in TakePictureAnalogAndTransfer()");
-            return;
-        }
-
-        picturedata[i] = data;
-
-        ConvertAnalogToBitmap();
-    }
+    //The thread of the serial port wakes up this one when data is received
+    return HandleEvents(100);
 }
 
-void TakePicture(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
-                 int dithering)
-{
-    SDL_SetWindowTitle(mWindow,"Taking picture...");
-
-    ramEnable();
-    setRegisterMode();
-
-    writeByte(0xA000,0x00);
-
-    writeByte(0xA001,unk1);
-
-    writeByte(0xA002,(exposure_time>>8)&0xFF);
-    writeByte(0xA003,exposure_time&0xFF);
-
-    writeByte(0xA004,unk2);
-
-    writeByte(0xA005,unk3);
-
-    UpdateMatrixRegisters(dithering);
-
-    writeByte(0xA000,trigger);
+//-------------------------------------------------------------------------------------
 
-    unsigned int clks = 0;
-    while(1)
-    {
-        clks += waitPictureReady();
-        int a = readByte(0xA000);
-        if((a & 1) == 0) break;
-        //sprintf(text,"%d - %u",a,clks);
-        //SDL_SetWindowTitle(mWindow,text);
-    }
+//Shows the partial result of the stack
+static void StackFrameReceived(int frame, int frames)
+{
+    char str[100];
+    sprintf(str,"Stacking: %d/%d (%s)",frame+1,frames,Stack_GetModeName(stack_mode));
+    WindowSetTitle(str);
 
-    ramDisable();
+    ConvertAnalogToBitmap();
+    WindowRender();
 }
 
-void TakePictureDebug(u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3)
+//Shows the merged image after every frame of the bracket
+static void ShowBracket(void)
 {
-    SDL_SetWindowTitle(mWindow,"Taking picture...");
-
-    ramEnable();
-    setRegisterMode();
-
-    writeByte(0xA000,0x00);
-
-    writeByte(0xA001,unk1);
+    static unsigned char tonemapped[GBCAM_W*GBCAM_H];
+    Bracket_ToneMap(tonemapped);
 
-    writeByte(0xA002,(exposure_time>>8)&0xFF);
-    writeByte(0xA003,exposure_time&0xFF);
-
-    writeByte(0xA004,unk2);
-
-    writeByte(0xA005,unk3);
-
-    writeByte(0xA000,trigger);
+    memset(HISTOGRAM_BUFFER,0,sizeof(HISTOGRAM_BUFFER));
 
-    if(SerialWriteData("C.",2) == 0)
+    int i;
+    for(i = 0; i < GBCAM_W*GBCAM_H; i++)
     {
-        Debug_Log("SerialWriteData() error in TakePictureDebug()");
-        return;
+        GBCAM_BUFFER[i*3+0] = tonemapped[i];
+        GBCAM_BUFFER[i*3+1] = tonemapped[i];
+        GBCAM_BUFFER[i*3+2] = tonemapped[i];
     }
-
-    ramDisable();
-}
-
-void TransferPicture(void)
-{
-    ramEnable();
-    setRamModeBank0();
-    readPicture();
-    ramDisable();
-
-    ConvertTilesToBitmap();
 }
 
-void TransferThumbnail(void)
+static void BracketFrameReceived(int frame, int frames)
 {
-    ramEnable();
-    setRamModeBank0();
-    readThumbnail();
-    ramDisable();
+    char str[100];
+    sprintf(str,"Bracketing: %d/%d",frame+1,frames);
+    WindowSetTitle(str);
 
-    ConvertTilesToBitmap();
+    ShowBracket();
+    WindowRender();
 }
 
 void ClearPicture(void)
@@ -804,25 +640,60 @@ void ClearPicture(void)
 
 //-------------------------------------------------------------------------------------
 
-#define FLOAT_MS_PER_FRAME ((float)1000.0/(float)30.0)
-
 int main(int argc, char * argv[])
 {
     if(Init() != 0)
         return 1;
 
-    SDL_SetWindowTitle(mWindow,"Init...");
+    Timing_Init();
+    Timing_Load("timing.txt");
+
+    if(Calib_Load("calib.bin") == 0)
+        calib_enabled = 1;
+
+    //Usage: GBCam_Reverse [port] [--record file] [--replay file [--fast]]
+    char * port = "COM4";
+    const char * record_file = NULL;
+    const char * replay_file = NULL;
+    int replay_realtime = 1;
+
+    int i;
+    for(i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i],"--record") && (i+1 < argc)) record_file = argv[++i];
+        else if(!strcmp(argv[i],"--replay") && (i+1 < argc)) replay_file = argv[++i];
+        else if(!strcmp(argv[i],"--fast")) replay_realtime = 0;
+        else port = argv[i];
+    }
+
+    WindowSetTitle("Init...");
 
     ClearPicture();
 
-    SerialCreate("COM4");
+    if(replay_file)
+    {
+        if(SerialReplayCreate(replay_file,replay_realtime) != 0)
+            return 2;
+    }
+    else
+    {
+        SerialSetDataCallback(SerialDataReceived);
+        SerialCreate(port);
+
+        if(record_file)
+            SerialRecordStart(record_file);
+    }
 
     if(SerialIsConnected())
 		Debug_Log("We're connected\n");
     else
         return 2;
 
-    SDL_SetWindowTitle(mWindow,"Inited!");
+    frame_ring = FrameRing_Create(FRAMERING_DEFAULT_NAME);
+    if(frame_ring == NULL)
+        Debug_Warn("Can't create the frame ring, captures won't be published");
+
+    WindowSetTitle("Inited!");
 
 /*
 int bank = 0;
@@ -923,60 +794,221 @@ return 123;
     */
     exptime = 0x1500;
 
-    float waitforticks = 0;
+    unsigned long long preview_time = 0;
+    float preview_fps = 0.0f;
+
     int exit = 0;
     while(!exit)
     {
-        //Handle events for all windows
-        exit = HandleEvents();
-
-        //-------------------
-
         //TakePictureAndTransfer(0x03,0xE4,0,0x07,0xBF,1,0); //Base
 
-        char str[100];
-        sprintf(str,"0x%02X - 0x%02X 0x%02X 0x%02X 0x%04X - Dither %d | %02X %02X %02X",
-                    trig_value, reg1,reg4,reg5,exptime&0xFFFF,dither_on,
-                    c1,c2,c3);
-        SDL_SetWindowTitle(mWindow,str);
+        if(preview_on && takepicture)
+        {
+            //Read the rest of the last preview. The registers are the same, so the picture
+            //doesn't have to be taken again.
+            preview_on = 0;
+            takepicture = 0;
+            if(TransferPicture() == 0)
+                Capture_PublishFrame(frame_ring,FRAMERING_KIND_PICTURE,
+                                     trig_value,reg1,exptime&0xFFFF,reg4,reg5);
+            ConvertTilesToBitmap();
+            redraw = 1;
+        }
+        else if(preview_on)
+        {
+            if(TakePicturePreview(trig_value,reg1,exptime&0xFFFF,reg4,reg5,dither_on,
+                                  preview_line_step) == 0)
+            {
+                unsigned long long now = Timer_GetMicroseconds();
+                if(preview_time)
+                    preview_fps = 1000000.0f / (float)(now - preview_time);
+                preview_time = now;
 
-        if(takepicture)
+                ConvertPreviewToBitmap(preview_line_step);
+                redraw = 1;
+            }
+            else
+            {
+                preview_on = 0;
+            }
+        }
+        else if(takepicture)
         {
             takepicture = 0;
             //ClearPicture();
-            TakePictureAndTransfer(trig_value,reg1,exptime&0xFFFF,reg4,reg5,dither_on,0);
+            if(TakePictureAndTransfer(trig_value,reg1,exptime&0xFFFF,reg4,reg5,dither_on,0) == 0)
+                Capture_PublishFrame(frame_ring,FRAMERING_KIND_PICTURE,
+                                     trig_value,reg1,exptime&0xFFFF,reg4,reg5);
+            ConvertTilesToBitmap();
+            redraw = 1;
         }
         else if(takeanalog)
         {
             takeanalog = 0;
             //ClearPicture();
-            TakePictureAnalogAndTransfer(trig_value,reg1,exptime&0xFFFF,reg4,reg5,dither_on);
+            if(TakePictureAnalogAndTransfer(trig_value,reg1,exptime&0xFFFF,reg4,reg5,dither_on,analog_mode) == 0)
+            {
+                analog_valid = 1;
+                Capture_PublishFrame(frame_ring,FRAMERING_KIND_ANALOG,
+                                     trig_value,reg1,exptime&0xFFFF,reg4,reg5);
+            }
+            ConvertAnalogToBitmap();
+            requantize_pending = 1;
+            redraw = 1;
+        }
+        else if(stackpicture)
+        {
+            stackpicture = 0;
+            if(Stack_Capture(stack_frames,stack_mode,StackFrameReceived,
+                             trig_value,reg1,exptime&0xFFFF,reg4,reg5,dither_on,analog_mode) == 0)
+            {
+                analog_valid = 1;
+                Capture_PublishFrame(frame_ring,FRAMERING_KIND_ANALOG,
+                                     trig_value,reg1,exptime&0xFFFF,reg4,reg5);
+            }
+            ConvertAnalogToBitmap();
+            requantize_pending = 1;
+            redraw = 1;
+        }
+        else if(bracketpicture || bracketanalog)
+        {
+            //Exposure ladder centered on the current exposure time, saved as hdr_*.pgm
+            int mode = bracketanalog ? (CAPTURE_ANALOG | analog_mode) : 0;
+            bracketpicture = 0;
+            bracketanalog = 0;
+
+            u16 exposures[BRACKET_MAX_FRAMES];
+            int frames = Bracket_MakeLadder(exptime&0xFFFF,bracket_frames,exposures);
+            if(Bracket_Capture(exposures,frames,BracketFrameReceived,
+                               trig_value,reg1,reg4,reg5,dither_on,mode) == 0)
+                Bracket_Save("hdr");
+            ShowBracket();
+            redraw = 1;
         }
         if(readpicture)
         {
             readpicture = 0;
             //ClearPicture();
             TransferPicture();
+            ConvertTilesToBitmap();
+            redraw = 1;
+        }
+        if(readregion)
+        {
+            readregion = 0;
+            TransferPictureRegion(roi_x,roi_y,roi_w,roi_h);
+            ConvertTilesToBitmapRegion(roi_x,roi_y,roi_w,roi_h);
+            redraw = 1;
+        }
+        if(calibratetiming)
+        {
+            calibratetiming = 0;
+            CalibrateTiming(trig_value,reg1,reg4,reg5,dither_on);
+            ConvertTilesToBitmap();
+            redraw = 1;
+        }
+        if(calibrateflat)
+        {
+            //Stacked dark captures and captures of a uniformly lit scene with the current
+            //registers, saved as calib.bin and used for the next analog captures
+            calibrateflat = 0;
+            if( (Calib_Capture(stack_frames,trig_value,reg1,exptime&0xFFFF,reg4,reg5,dither_on,
+                               analog_mode) == 0) && (Calib_Save("calib.bin") == 0) )
+            {
+                calib_enabled = 1;
+                Calib_Apply(analogdata); // Show the corrected flat capture
+                analog_valid = 1;
+            }
+            ConvertAnalogToBitmap();
+            requantize_pending = 1;
+            redraw = 1;
+        }
+        if(dumpsram)
+        {
+            //Save the whole SRAM and all the photos stored in it
+            dumpsram = 0;
+            static unsigned char sav[SRAM_SIZE];
+            if(Sram_Dump(sav) == 0)
+            {
+                int photos = -1;
+                if(Sram_Save("gbcam.sav",sav) == 0)
+                    photos = Sram_SaveGallery(sav,"gallery");
+
+                char str[100];
+                if(photos >= 0)
+                    sprintf(str,"SRAM saved: %d photos",photos);
+                else
+                    sprintf(str,"SRAM read, but files couldn't be written");
+                WindowSetTitle(str);
+                SDL_Delay(2000);
+            }
+            redraw = 1;
         }
         if(debugpicture)
         {
             debugpicture = 0;
             TakePictureDebug(trig_value,reg1,exptime&0xFFFF,reg4,reg5);
         }
+        if(requantize_pending)
+        {
+            //Quantize the cached analog capture on the PC instead of asking the cartridge
+            requantize_pending = 0;
+            if(requantize_on && analog_valid)
+            {
+                QuantizeAnalogToTiles(dither_on);
+                ConvertTilesToBitmap();
+                redraw = 1;
+            }
+        }
+        if(showanalog)
+        {
+            showanalog = 0;
+            if(analog_valid)
+            {
+                ConvertAnalogToBitmap();
+                redraw = 1;
+            }
+        }
 
         //-------------------
 
-        WindowRender();
+        char str[200];
+        int len = sprintf(str,"0x%02X - 0x%02X 0x%02X 0x%02X 0x%04X - Dither %d | %02X %02X %02X | %.0f ms | Stack %d %s%s",
+                    trig_value, reg1,reg4,reg5,exptime&0xFFFF,dither_on,
+                    c1,c2,c3,Timing_PredictCaptureMs(reg1,exptime&0xFFFF,16*14*16),
+                    stack_frames,Stack_GetModeName(stack_mode),
+                    (requantize_on && analog_valid) ? " | Requantized" : "");
+        if(capture_crc)
+            len += sprintf(&str[len]," | CRC");
+        if(calib_enabled && Calib_IsValid())
+            len += sprintf(&str[len]," | Flat");
+        if(preview_on)
+            sprintf(&str[len]," | Preview 1/%d %.1f fps",preview_line_step,preview_fps);
+        else
+            preview_time = 0;
+        WindowSetTitle(str);
+
+        if(redraw)
+        {
+            redraw = 0;
+            WindowRender();
+        }
 
-        while(waitforticks >= SDL_GetTicks()) SDL_Delay(1);
+        //-------------------
 
-        int ticksnow = SDL_GetTicks();
-        if(waitforticks < (ticksnow - FLOAT_MS_PER_FRAME)) // if lost a frame or more
-            waitforticks = ticksnow + FLOAT_MS_PER_FRAME;
-        else
-            waitforticks += FLOAT_MS_PER_FRAME;
+        //Keys pressed during a long capture set flags that the loop may have checked
+        //already, they have to be handled without waiting for another event.
+        int pending = takepicture || takeanalog || stackpicture || bracketpicture ||
+                      bracketanalog || readpicture || readregion || calibratetiming ||
+                      calibrateflat || dumpsram || debugpicture || requantize_pending ||
+                      showanalog;
+
+        //Sleep until the user does something. The preview only checks if there are events.
+        exit = HandleEvents((preview_on || pending) ? 0 : -1);
     }
 
+    FrameRing_Close(frame_ring);
+
     return 0;
 }
 
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include "serial.h"
+#include "serial_replay.h"
 #include "debug.h"
 
 //-------------------------------------------------------------------------
@@ -20,6 +21,87 @@ static COMSTAT status;
 //Keep track of last error
 static DWORD errors;
 
+//Used by SerialWriteData()
+static OVERLAPPED write_overlapped;
+
+//-------------------------------------------------------------------------
+
+//Received data. A thread reads the port with overlapped I/O and stores the data here, so
+//that the program can sleep until something is received instead of polling the port.
+
+#define SERIAL_RX_BUFFER_SIZE (64*1024) // Power of 2
+
+static unsigned char rx_buffer[SERIAL_RX_BUFFER_SIZE];
+static unsigned int rx_read, rx_write; // rx_write - rx_read = bytes in the buffer
+static CRITICAL_SECTION rx_lock;
+
+static HANDLE rx_event; // Set every time data is received
+static HANDLE rx_thread;
+static volatile LONG rx_thread_exit;
+
+static SerialDataCallback data_callback = NULL;
+
+static DWORD WINAPI SerialReaderThread(LPVOID arg)
+{
+    (void)arg;
+
+    OVERLAPPED overlapped = {0};
+    overlapped.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+    unsigned char buffer[1024];
+
+    while(!rx_thread_exit)
+    {
+        //Returns as soon as there is some data, or after the timeout of the port
+        DWORD bytesRead = 0;
+        if(!ReadFile(hSerial,buffer,sizeof(buffer),&bytesRead,&overlapped))
+        {
+            if( (GetLastError() != ERROR_IO_PENDING) ||
+                !GetOverlappedResult(hSerial,&overlapped,&bytesRead,TRUE) )
+            {
+                Debug_Error("SerialReaderThread(): ReadFile error %d",GetLastError());
+                break;
+            }
+        }
+
+        if(bytesRead == 0)
+            continue;
+
+        EnterCriticalSection(&rx_lock);
+
+        int stored = SERIAL_RX_BUFFER_SIZE - (rx_write - rx_read) >= bytesRead;
+        if(stored)
+        {
+            DWORD i;
+            for(i = 0; i < bytesRead; i++)
+                rx_buffer[(rx_write + i) & (SERIAL_RX_BUFFER_SIZE-1)] = buffer[i];
+            rx_write += bytesRead;
+        }
+
+        LeaveCriticalSection(&rx_lock);
+
+        //Recorded when it arrives so that the replay has the real timing
+        if(stored)
+            SerialRecordData(SERIAL_RECORD_RX,(const char *)buffer,bytesRead);
+        else
+            Debug_Error("SerialReaderThread(): Buffer full, %d bytes lost",bytesRead);
+
+        SetEvent(rx_event);
+
+        if(data_callback)
+            data_callback();
+    }
+
+    CloseHandle(overlapped.hEvent);
+
+    return 0;
+}
+
+void SerialSetDataCallback(SerialDataCallback callback)
+{
+    data_callback = callback;
+}
+
 //-------------------------------------------------------------------------
 
 void SerialCreate(char * portName)
@@ -33,7 +115,7 @@ void SerialCreate(char * portName)
             0,
             NULL,
             OPEN_EXISTING,
-            FILE_ATTRIBUTE_NORMAL,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
             NULL);
     //Check if the connection was successfull
     if(hSerial==INVALID_HANDLE_VALUE)
@@ -42,11 +124,11 @@ void SerialCreate(char * portName)
         if(GetLastError() == ERROR_FILE_NOT_FOUND)
 		{
             //Print Error if neccessary
-            Debug_Log("ERROR: Handle was not attached. Reason: %s not available.\n", portName);
+            Debug_Error("ERROR: Handle was not attached. Reason: %s not available.\n", portName);
         }
         else
         {
-            Debug_Log("ERROR!!!");
+            Debug_Error("ERROR!!!");
         }
     }
     else
@@ -58,7 +140,7 @@ void SerialCreate(char * portName)
         if(!GetCommState(hSerial, &dcbSerialParams))
         {
             //If impossible, show an error
-            Debug_Log("failed to get current serial parameters!");
+            Debug_Error("failed to get current serial parameters!");
         }
         else
         {
@@ -74,10 +156,27 @@ void SerialCreate(char * portName)
 			//Set the parameters and check for their proper application
 			if(!SetCommState(hSerial, &dcbSerialParams))
 			{
-				Debug_Log("ALERT: Could not set Serial Port parameters");
+				Debug_Error("ALERT: Could not set Serial Port parameters");
 			}
 			else
 			{
+				//ReadFile() returns as soon as any byte is received. If nothing is
+				//received it returns after 100 ms so that the thread can exit.
+				COMMTIMEOUTS timeouts = {0};
+				timeouts.ReadIntervalTimeout = MAXDWORD;
+				timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+				timeouts.ReadTotalTimeoutConstant = 100;
+				SetCommTimeouts(hSerial, &timeouts);
+
+				write_overlapped.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+				rx_read = 0;
+				rx_write = 0;
+				InitializeCriticalSection(&rx_lock);
+				rx_event = CreateEvent(NULL,FALSE,FALSE,NULL);
+				rx_thread_exit = 0;
+				rx_thread = CreateThread(NULL,0,SerialReaderThread,NULL,0,NULL);
+
 				//If everything went fine we're connected
 				connected = 1;
 				//We wait 2s as the arduino board will be reseting
@@ -89,11 +188,28 @@ void SerialCreate(char * portName)
 
 void SerialDestroy(void)
 {
+    SerialRecordStop();
+
+    if(SerialReplayIsActive())
+    {
+        SerialReplayDestroy();
+        return;
+    }
+
     //Check if we are connected before trying to disconnect
     if(connected)
     {
         //We're no longer connected
         connected = 0;
+
+        //The thread exits after the timeout of the current read at most
+        InterlockedExchange(&rx_thread_exit,1);
+        WaitForSingleObject(rx_thread,INFINITE);
+        CloseHandle(rx_thread);
+        CloseHandle(rx_event);
+        CloseHandle(write_overlapped.hEvent);
+        DeleteCriticalSection(&rx_lock);
+
         //Close the serial handler
         CloseHandle(hSerial);
     }
@@ -101,15 +217,24 @@ void SerialDestroy(void)
 
 int SerialGetInQueue(void)
 {
-    //Use the ClearCommError function to get status info on the Serial port
-    ClearCommError(hSerial, &errors, &status);
+    if(SerialReplayIsActive())
+        return SerialReplayGetInQueue();
+
+    if(!connected)
+        return 0;
+
+    EnterCriticalSection(&rx_lock);
+    int count = rx_write - rx_read;
+    LeaveCriticalSection(&rx_lock);
 
-    //Check if there is something to read
-    return status.cbInQue;
+    return count;
 }
 
 int SerialGetOutQueue(void)
 {
+    if(SerialReplayIsActive())
+        return 0;
+
     FlushFileBuffers(hSerial);
 
     //Use the ClearCommError function to get status info on the Serial port
@@ -121,67 +246,53 @@ int SerialGetOutQueue(void)
 
 int SerialReadData(char * buffer, unsigned int nbChar)
 {
-    //Number of bytes we'll have read
-    DWORD bytesRead;
-    //Number of bytes we'll really ask to read
-    //unsigned int toRead;
+    if(SerialReplayIsActive())
+        return SerialReplayReadData(buffer,nbChar);
 
-    //Use the ClearCommError function to get status info on the Serial port
-    ClearCommError(hSerial, &errors, &status);
+    if(!connected)
+        return -1;
+
+    //Check if there is enough data to read the required number of characters, if not
+    //we'll return an error.
+    int ret = -1;
 
-    //Check if there is something to read
-    if(status.cbInQue > 0)
+    EnterCriticalSection(&rx_lock);
+
+    if(rx_write - rx_read >= nbChar)
     {
-        //If there is we check if there is enough data to read the required number
-        //of characters, if not we'll return an error.
-        if(status.cbInQue >= nbChar)
-        {
-            if( ReadFile(hSerial, buffer, nbChar, &bytesRead, NULL) && (bytesRead == nbChar) )
-            {
-                return bytesRead;
-            }
-        }
+        unsigned int i;
+        for(i = 0; i < nbChar; i++)
+            buffer[i] = rx_buffer[(rx_read + i) & (SERIAL_RX_BUFFER_SIZE-1)];
+        rx_read += nbChar;
+        ret = nbChar;
     }
-#if 0
-    //Check if there is something to read
-    if(status.cbInQue > 0)
-    {
-        //If there is we check if there is enough data to read the required number
-        //of characters, if not we'll read only the available characters to prevent
-        //locking of the application.
-        if(status.cbInQue > nbChar)
-        {
-            toRead = nbChar;
-        }
-        else
-        {
-            //toRead = status.cbInQue;
-            return -1; // wait until there are enough bytes
-        }
 
-        //Try to read the require number of chars, and return the number of read bytes on success
-        if( ReadFile(hSerial, buffer, toRead, &bytesRead, NULL) && (bytesRead != 0) )
-        {
-            return bytesRead;
-        }
-    }
-#endif // 0
+    LeaveCriticalSection(&rx_lock);
 
     //If nothing has been read, or that an error was detected return -1
-    return -1;
+    return ret;
 }
 
 int SerialWriteData(char * buffer, unsigned int nbChar)
 {
     DWORD bytesSend;
 
+    if(SerialReplayIsActive())
+        return SerialReplayWriteData(buffer,nbChar);
+
+    //Recorded before writing it, the answer can be recorded by the reader thread as soon
+    //as it is sent
+    SerialRecordData(SERIAL_RECORD_TX,buffer,nbChar);
+
     //Try to write the buffer on the Serial port
-    if(!WriteFile(hSerial, (void *)buffer, nbChar, &bytesSend, 0))
+    if( !WriteFile(hSerial, (void *)buffer, nbChar, &bytesSend, &write_overlapped) &&
+        ( (GetLastError() != ERROR_IO_PENDING) ||
+          !GetOverlappedResult(hSerial, &write_overlapped, &bytesSend, TRUE) ) )
     {
         //In case it don't work get comm error and return false
         ClearCommError(hSerial, &errors, &status);
 
-        Debug_Log("SerialWriteData error %d",errors);
+        Debug_Error("SerialWriteData error %d",errors);
 
         return 0;
     }
@@ -193,8 +304,22 @@ int SerialWriteData(char * buffer, unsigned int nbChar)
     }
 }
 
+int SerialWaitData(unsigned int timeout_ms)
+{
+    if(SerialReplayIsActive())
+        return SerialReplayWaitData(timeout_ms);
+
+    if(!connected)
+        return 0;
+
+    return WaitForSingleObject(rx_event,timeout_ms) == WAIT_OBJECT_0;
+}
+
 int SerialIsConnected()
 {
+    if(SerialReplayIsActive())
+        return 1;
+
     //Simply return the connection status
     return connected;
 }
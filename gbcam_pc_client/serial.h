@@ -22,6 +22,15 @@ int SerialReadData(char * buffer, unsigned int nbChar);
 //return true on success.
 int SerialWriteData(char * buffer, unsigned int nbChar);
 
+//Blocks until more data is received or the timeout expires. Returns 1 if data has been
+//received since the last call, 0 on timeout.
+int SerialWaitData(unsigned int timeout_ms);
+
+//The callback is called from the thread that reads the port every time data is
+//received. It can be used to wake up the main thread.
+typedef void (*SerialDataCallback)(void);
+void SerialSetDataCallback(SerialDataCallback callback);
+
 //Check if we are actually connected
 int SerialIsConnected();
 
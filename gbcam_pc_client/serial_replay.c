@@ -0,0 +1,322 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serial_replay.h"
+#include "thread.h"
+#include "timer.h"
+#include "debug.h"
+
+//-------------------------------------------------------------------------
+
+//File format:
+//
+//    "GBCAMSER" (8 bytes)
+//    Records:
+//        u8  direction (SERIAL_RECORD_TX or SERIAL_RECORD_RX)
+//        u64 microseconds since the start of the recording (little endian)
+//        u32 size (little endian)
+//        data
+
+#define SERIAL_FILE_MAGIC "GBCAMSER"
+
+//-------------------------------------------------------------------------
+
+//The received data is recorded by the thread that reads the port
+static FILE * record_file = NULL;
+static unsigned long long record_start;
+static Mutex record_lock = NULL;
+
+static void WriteLE(FILE * f, unsigned long long value, int bytes)
+{
+    int i;
+    for(i = 0; i < bytes; i++)
+        fputc((value >> (i*8)) & 0xFF, f);
+}
+
+int SerialRecordStart(const char * filename)
+{
+    if(record_lock == NULL)
+    {
+        record_lock = Mutex_Create();
+        if(record_lock == NULL)
+            return -1;
+    }
+
+    FILE * f = fopen(filename,"wb");
+    if(f == NULL)
+    {
+        Debug_Error("SerialRecordStart(): Can't open %s",filename);
+        return -1;
+    }
+
+    fwrite(SERIAL_FILE_MAGIC,1,8,f);
+
+    Mutex_Lock(record_lock);
+    record_file = f;
+    record_start = Timer_GetMicroseconds();
+    Mutex_Unlock(record_lock);
+
+    atexit(SerialRecordStop);
+
+    return 0;
+}
+
+void SerialRecordStop(void)
+{
+    if(record_lock == NULL)
+        return;
+
+    Mutex_Lock(record_lock);
+
+    if(record_file)
+    {
+        fclose(record_file);
+        record_file = NULL;
+    }
+
+    Mutex_Unlock(record_lock);
+}
+
+void SerialRecordData(int direction, const char * buffer, unsigned int nbChar)
+{
+    if(record_lock == NULL)
+        return;
+
+    Mutex_Lock(record_lock);
+
+    if(record_file)
+    {
+        fputc(direction,record_file);
+        WriteLE(record_file,Timer_GetMicroseconds() - record_start,8);
+        WriteLE(record_file,nbChar,4);
+        fwrite(buffer,1,nbChar,record_file);
+    }
+
+    Mutex_Unlock(record_lock);
+}
+
+//-------------------------------------------------------------------------
+
+typedef struct {
+    int direction;
+    unsigned long long time;
+    unsigned int size;
+    const unsigned char * data;
+} replay_record;
+
+static unsigned char * replay_file_data = NULL;
+static replay_record * replay_records = NULL;
+static int replay_num_records;
+static int replay_next; // Next record not handled yet
+static int replay_realtime;
+static int replay_active = 0;
+static int replay_diverged;
+
+//Received data that is available to be read
+static unsigned char * replay_rx_buffer = NULL;
+static unsigned int replay_rx_read, replay_rx_write;
+
+//Time of the last sent record in the recorded session and in the replay
+static unsigned long long replay_barrier_recorded, replay_barrier_now;
+
+static unsigned long long replay_start;
+
+static unsigned long long ReadLE(const unsigned char * data, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+    for(i = 0; i < bytes; i++)
+        value |= ((unsigned long long)data[i]) << (i*8);
+    return value;
+}
+
+int SerialReplayCreate(const char * filename, int realtime)
+{
+    FILE * f = fopen(filename,"rb");
+    if(f == NULL)
+    {
+        Debug_Error("SerialReplayCreate(): Can't open %s",filename);
+        return -1;
+    }
+
+    fseek(f,0,SEEK_END);
+    long size = ftell(f);
+    fseek(f,0,SEEK_SET);
+
+    replay_file_data = malloc(size > 0 ? size : 1);
+    replay_rx_buffer = malloc(size > 0 ? size : 1);
+    //Every record is at least 13 bytes long
+    replay_records = malloc(sizeof(replay_record) * (size / 13 + 1));
+    if( (replay_file_data == NULL) || (replay_rx_buffer == NULL) || (replay_records == NULL) ||
+        (fread(replay_file_data,1,size,f) != (size_t)size) ||
+        (size < 8) || memcmp(replay_file_data,SERIAL_FILE_MAGIC,8) )
+    {
+        Debug_Error("SerialReplayCreate(): Invalid file %s",filename);
+        fclose(f);
+        SerialReplayDestroy();
+        return -1;
+    }
+    fclose(f);
+
+    replay_num_records = 0;
+    long offset = 8;
+    while(offset + 13 <= size)
+    {
+        replay_record * r = &replay_records[replay_num_records];
+        r->direction = replay_file_data[offset];
+        r->time = ReadLE(&replay_file_data[offset+1],8);
+        r->size = ReadLE(&replay_file_data[offset+9],4);
+        r->data = &replay_file_data[offset+13];
+
+        if(offset + 13 + (long)r->size > size)
+        {
+            Debug_Warn("SerialReplayCreate(): Truncated record %d",replay_num_records);
+            break;
+        }
+
+        offset += 13 + r->size;
+        replay_num_records++;
+    }
+
+    replay_next = 0;
+    replay_realtime = realtime;
+    replay_rx_read = 0;
+    replay_rx_write = 0;
+    replay_barrier_recorded = 0;
+    replay_barrier_now = Timer_GetMicroseconds();
+    replay_start = replay_barrier_now;
+    replay_diverged = 0;
+    replay_active = 1;
+
+    Debug_Log("Replaying %s: %d records",filename,replay_num_records);
+
+    return 0;
+}
+
+void SerialReplayDestroy(void)
+{
+    replay_active = 0;
+    free(replay_file_data);
+    free(replay_records);
+    free(replay_rx_buffer);
+    replay_file_data = NULL;
+    replay_records = NULL;
+    replay_rx_buffer = NULL;
+}
+
+int SerialReplayIsActive(void)
+{
+    return replay_active;
+}
+
+//Makes the received data that comes before the next sent record available. In real
+//time mode it is only made available when its time has come.
+static void ReplayReleaseReceived(int force)
+{
+    while(replay_next < replay_num_records)
+    {
+        replay_record * r = &replay_records[replay_next];
+
+        if(r->direction != SERIAL_RECORD_RX)
+            break;
+
+        if(replay_realtime && !force)
+        {
+            unsigned long long delta = r->time - replay_barrier_recorded;
+            if(Timer_GetMicroseconds() < replay_barrier_now + delta)
+                break;
+        }
+
+        memcpy(&replay_rx_buffer[replay_rx_write],r->data,r->size);
+        replay_rx_write += r->size;
+        replay_next++;
+
+        if(replay_next == replay_num_records)
+        {
+            Debug_Log("Replay finished in %llu ms",(Timer_GetMicroseconds() - replay_start) / 1000);
+        }
+    }
+}
+
+int SerialReplayGetInQueue(void)
+{
+    ReplayReleaseReceived(0);
+
+    return replay_rx_write - replay_rx_read;
+}
+
+int SerialReplayWaitData(unsigned int timeout_ms)
+{
+    unsigned int received = replay_rx_write;
+
+    ReplayReleaseReceived(0);
+    if(replay_rx_write != received)
+        return 1;
+
+    //Sleep until the next received record is due. If the next record is sent data
+    //nothing can be received until the program sends it, so sleep until the timeout.
+    unsigned long long now = Timer_GetMicroseconds();
+    unsigned long long wakeup = now + timeout_ms * 1000ULL;
+
+    if( (replay_next < replay_num_records) &&
+        (replay_records[replay_next].direction == SERIAL_RECORD_RX) )
+    {
+        unsigned long long due = replay_barrier_now +
+                                 (replay_records[replay_next].time - replay_barrier_recorded);
+        if(due < wakeup)
+            wakeup = due;
+    }
+
+    if(wakeup > now)
+        Timer_SleepMs((wakeup - now + 999) / 1000);
+
+    ReplayReleaseReceived(0);
+    return replay_rx_write != received;
+}
+
+int SerialReplayReadData(char * buffer, unsigned int nbChar)
+{
+    ReplayReleaseReceived(0);
+
+    if(replay_rx_write - replay_rx_read < nbChar)
+        return -1;
+
+    memcpy(buffer,&replay_rx_buffer[replay_rx_read],nbChar);
+    replay_rx_read += nbChar;
+
+    return nbChar;
+}
+
+int SerialReplayWriteData(char * buffer, unsigned int nbChar)
+{
+    //In the recorded session this data was received before sending this
+    ReplayReleaseReceived(1);
+
+    if(replay_next == replay_num_records)
+        return 1;
+
+    replay_record * r = &replay_records[replay_next];
+
+    if( (r->size != nbChar) || memcmp(r->data,buffer,nbChar) )
+    {
+        if(!replay_diverged)
+            Debug_Warn("SerialReplayWriteData(): Sent data differs from the recorded session (record %d)",
+                      replay_next);
+        replay_diverged = 1;
+    }
+
+    replay_barrier_recorded = r->time;
+    replay_barrier_now = Timer_GetMicroseconds();
+    replay_next++;
+
+    if(replay_next == replay_num_records)
+    {
+        Debug_Log("Replay finished in %llu ms",(replay_barrier_now - replay_start) / 1000);
+    }
+
+    return 1;
+}
+
+//-------------------------------------------------------------------------
@@ -0,0 +1,31 @@
+#ifndef __SERIAL_REPLAY__
+#define __SERIAL_REPLAY__
+
+//Record every byte sent and received through the serial port, with timestamps
+int SerialRecordStart(const char * filename); //Returns 0 on success
+void SerialRecordStop(void);
+
+//Use a recorded session instead of a serial port. If realtime is 1 the received data
+//is available with the same timing as in the recorded session, if it is 0 it is
+//available as soon as the data sent before it in the recorded session has been sent.
+int SerialReplayCreate(const char * filename, int realtime); //Returns 0 on success
+
+//-------------------------------------------------------------------------
+
+//Used by serial.c
+
+#define SERIAL_RECORD_TX ('T')
+#define SERIAL_RECORD_RX ('R')
+
+//Can be called from any thread. The received data is recorded when it is received, not
+//when it is read.
+void SerialRecordData(int direction, const char * buffer, unsigned int nbChar);
+
+int SerialReplayIsActive(void);
+int SerialReplayGetInQueue(void);
+int SerialReplayWaitData(unsigned int timeout_ms);
+int SerialReplayReadData(char * buffer, unsigned int nbChar);
+int SerialReplayWriteData(char * buffer, unsigned int nbChar);
+void SerialReplayDestroy(void);
+
+#endif // __SERIAL_REPLAY__
@@ -0,0 +1,293 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sram.h"
+#include "capture.h"
+#include "serial.h"
+#include "debug.h"
+#include "image.h"
+#include "thread.h"
+
+//-------------------------------------------------------------------------------------
+
+//Size of every block read. Two blocks per bank, so that the progress is updated often.
+#define SRAM_BLOCK_SIZE (0x1000)
+#define SRAM_NUM_BLOCKS (SRAM_SIZE/SRAM_BLOCK_SIZE)
+
+static int Sram_RequestBlock(int block)
+{
+    int bank = (block * SRAM_BLOCK_SIZE) / SRAM_BANK_SIZE;
+    int addr = 0xA000 + (block * SRAM_BLOCK_SIZE) % SRAM_BANK_SIZE;
+
+    char str[50];
+    sprintf(str,"B%02X%04X%04X.",bank,addr,SRAM_BLOCK_SIZE);
+    return SerialWriteData(str,12);
+}
+
+int Sram_Dump(unsigned char * sav)
+{
+    //The command of the next block is sent while the current one is being received. It
+    //is short, so it fits in the receive buffer of the server.
+    if(Sram_RequestBlock(0) == 0)
+    {
+        Debug_Error("SerialWriteData() error in Sram_Dump()");
+        return -1;
+    }
+
+    int retries = 0;
+    int block;
+    for(block = 0; block < SRAM_NUM_BLOCKS; block++)
+    {
+        if(block + 1 < SRAM_NUM_BLOCKS)
+        {
+            if(Sram_RequestBlock(block + 1) == 0)
+            {
+                Debug_Error("SerialWriteData() error in Sram_Dump()");
+                return -1;
+            }
+        }
+
+        char str[100];
+        sprintf(str,"Reading SRAM: bank %d, %d%%",(block * SRAM_BLOCK_SIZE) / SRAM_BANK_SIZE,
+                (block * 100) / SRAM_NUM_BLOCKS);
+        Capture_SetStatus(str);
+
+        unsigned char * dst = &sav[block * SRAM_BLOCK_SIZE];
+        int remaining = SRAM_BLOCK_SIZE;
+        while(remaining > 0)
+        {
+            if(Capture_WaitInQueue(1) != 0)
+            {
+                if( (retries == CAPTURE_RESUME_RETRIES) || (Capture_Resync() != 0) )
+                {
+                    Debug_Error("Timeout in Sram_Dump()");
+                    return -1;
+                }
+                retries++;
+
+                //A byte has been lost somewhere in the block, so the whole block is read
+                //again. The request of the next block has been discarded too.
+                Debug_Warn("Sram_Dump(): Reading block %d again",block);
+                if( (Sram_RequestBlock(block) == 0) ||
+                    ( (block + 1 < SRAM_NUM_BLOCKS) && (Sram_RequestBlock(block + 1) == 0) ) )
+                {
+                    Debug_Error("SerialWriteData() error in Sram_Dump()");
+                    return -1;
+                }
+                dst = &sav[block * SRAM_BLOCK_SIZE];
+                remaining = SRAM_BLOCK_SIZE;
+                continue;
+            }
+
+            //Read everything that has been received
+            int size = SerialGetInQueue();
+            if(size > remaining)
+                size = remaining;
+
+            if(SerialReadData((char*)dst,size) != size)
+            {
+                Debug_Error("SerialReadData() error in Sram_Dump()");
+                return -1;
+            }
+
+            dst += size;
+            remaining -= size;
+        }
+    }
+
+    ramDisable();
+
+    return 0;
+}
+
+int Sram_Save(const char * filename, const unsigned char * sav)
+{
+    FILE * f = fopen(filename,"wb");
+    if(f == NULL)
+    {
+        Debug_Error("Sram_Save(): Can't open %s",filename);
+        return -1;
+    }
+
+    int ret = (fwrite(sav,1,SRAM_SIZE,f) == SRAM_SIZE) ? 0 : -1;
+    if(fclose(f) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+int Sram_Load(const char * filename, unsigned char * sav)
+{
+    FILE * f = fopen(filename,"rb");
+    if(f == NULL)
+    {
+        Debug_Error("Sram_Load(): Can't open %s",filename);
+        return -1;
+    }
+
+    int ret = (fread(sav,1,SRAM_SIZE,f) == SRAM_SIZE) ? 0 : -1;
+    fclose(f);
+
+    if(ret != 0)
+        Debug_Error("Sram_Load(): %s is too small",filename);
+
+    return ret;
+}
+
+//-------------------------------------------------------------------------------------
+
+#define GALLERY_THREADS (4)
+
+#define SHEET_COLUMNS (6)
+#define SHEET_ROWS    (5)
+#define SHEET_BORDER  (8)
+#define SHEET_W (SHEET_COLUMNS*GBCAM_W + (SHEET_COLUMNS+1)*SHEET_BORDER)
+#define SHEET_H (SHEET_ROWS*GBCAM_H + (SHEET_ROWS+1)*SHEET_BORDER)
+
+#define THUMB_SIZE    (32)
+#define THUMB_COLUMNS (10)
+#define THUMB_ROWS    (3)
+#define THUMB_BORDER  (4)
+#define THUMBS_W (THUMB_COLUMNS*THUMB_SIZE + (THUMB_COLUMNS+1)*THUMB_BORDER)
+#define THUMBS_H (THUMB_ROWS*THUMB_SIZE + (THUMB_ROWS+1)*THUMB_BORDER)
+
+typedef struct {
+    const unsigned char * sav;
+    const char * prefix;
+    int first_slot; // Every thread decodes one of every GALLERY_THREADS slots
+    unsigned char * sheet;
+    unsigned char * thumbs;
+    int errors;
+} gallery_job;
+
+static int Sram_PhotoIsActive(const unsigned char * sav, int slot)
+{
+    return sav[SRAM_PHOTO_STATE + slot] != 0xFF;
+}
+
+static void Sram_GalleryThread(void * arg)
+{
+    gallery_job * job = arg;
+
+    int slot;
+    for(slot = job->first_slot; slot < SRAM_NUM_PHOTOS; slot += GALLERY_THREADS)
+    {
+        int active = Sram_PhotoIsActive(job->sav,slot);
+
+        //Every slot has its own area of the sheets, there is no need to synchronize
+        int sx = SHEET_BORDER + (slot % SHEET_COLUMNS) * (GBCAM_W + SHEET_BORDER);
+        int sy = SHEET_BORDER + (slot / SHEET_COLUMNS) * (GBCAM_H + SHEET_BORDER);
+        unsigned char * photo = &job->sheet[sy*SHEET_W + sx];
+        Image_TilesToGray(&job->sav[SRAM_PHOTO(slot)],16,16,14,photo,SHEET_W);
+
+        int tx = THUMB_BORDER + (slot % THUMB_COLUMNS) * (THUMB_SIZE + THUMB_BORDER);
+        int ty = THUMB_BORDER + (slot / THUMB_COLUMNS) * (THUMB_SIZE + THUMB_BORDER);
+        Image_TilesToGray(&job->sav[SRAM_THUMBNAIL(slot)],4,4,4,&job->thumbs[ty*THUMBS_W + tx],
+                          THUMBS_W);
+
+        unsigned char pixels[GBCAM_W*GBCAM_H];
+        int y;
+        for(y = 0; y < GBCAM_H; y++)
+            memcpy(&pixels[y*GBCAM_W],&photo[y*SHEET_W],GBCAM_W);
+
+        char filename[1024];
+        snprintf(filename,sizeof(filename),"%s_%02d%s.pgm",job->prefix,slot+1,
+                 active ? "" : "_deleted");
+        FILE * f = fopen(filename,"wb");
+        if( (f == NULL) || (Image_WritePGM8(f,pixels,GBCAM_W,GBCAM_H) != 0) )
+            job->errors++;
+        if(f)
+            fclose(f);
+
+        if(!active)
+        {
+            int x;
+            for(y = 0; y < GBCAM_H; y++) for(x = 0; x < GBCAM_W; x++)
+                photo[y*SHEET_W + x] = 0x40 + photo[y*SHEET_W + x] / 4;
+        }
+    }
+}
+
+static int Sram_WriteImage(const char * prefix, const char * name, const unsigned char * pixels,
+                           int w, int h)
+{
+    char filename[1024];
+    snprintf(filename,sizeof(filename),"%s_%s.pgm",prefix,name);
+
+    FILE * f = fopen(filename,"wb");
+    if(f == NULL)
+    {
+        Debug_Error("Sram_SaveGallery(): Can't open %s",filename);
+        return -1;
+    }
+
+    int ret = Image_WritePGM8(f,pixels,w,h);
+    fclose(f);
+    return ret;
+}
+
+int Sram_SaveGallery(const unsigned char * sav, const char * prefix)
+{
+    unsigned char * sheet = malloc(SHEET_W*SHEET_H);
+    unsigned char * thumbs = malloc(THUMBS_W*THUMBS_H);
+    if( (sheet == NULL) || (thumbs == NULL) )
+    {
+        free(sheet);
+        free(thumbs);
+        return -1;
+    }
+
+    memset(sheet,0x20,SHEET_W*SHEET_H);
+    memset(thumbs,0x20,THUMBS_W*THUMBS_H);
+
+    gallery_job jobs[GALLERY_THREADS];
+    Thread threads[GALLERY_THREADS];
+
+    int i;
+    for(i = 0; i < GALLERY_THREADS; i++)
+    {
+        jobs[i].sav = sav;
+        jobs[i].prefix = prefix;
+        jobs[i].first_slot = i;
+        jobs[i].sheet = sheet;
+        jobs[i].thumbs = thumbs;
+        jobs[i].errors = 0;
+
+        threads[i] = Thread_Create(Sram_GalleryThread,&jobs[i]);
+        if(threads[i] == NULL) // Do it in this thread
+            Sram_GalleryThread(&jobs[i]);
+    }
+
+    int errors = 0;
+    for(i = 0; i < GALLERY_THREADS; i++)
+    {
+        Thread_Join(threads[i]);
+        errors += jobs[i].errors;
+    }
+
+    unsigned char last[GBCAM_W*GBCAM_H];
+    Image_TilesToGray(&sav[SRAM_LAST_PICTURE],16,16,14,last,GBCAM_W);
+
+    if(Sram_WriteImage(prefix,"sheet",sheet,SHEET_W,SHEET_H) != 0) errors++;
+    if(Sram_WriteImage(prefix,"thumbs",thumbs,THUMBS_W,THUMBS_H) != 0) errors++;
+    if(Sram_WriteImage(prefix,"last",last,GBCAM_W,GBCAM_H) != 0) errors++;
+
+    free(sheet);
+    free(thumbs);
+
+    if(errors)
+    {
+        Debug_Error("Sram_SaveGallery(): %d files couldn't be written",errors);
+        return -1;
+    }
+
+    int active = 0;
+    for(i = 0; i < SRAM_NUM_PHOTOS; i++)
+        active += Sram_PhotoIsActive(sav,i);
+
+    return active;
+}
+
+//-------------------------------------------------------------------------------------
@@ -0,0 +1,36 @@
+
+#ifndef __SRAM__
+#define __SRAM__
+
+//Dump of the SRAM of the cartridge and decoding of the saved photos
+
+#define SRAM_NUM_BANKS  (16)
+#define SRAM_BANK_SIZE  (0x2000)
+#define SRAM_SIZE       (SRAM_NUM_BANKS*SRAM_BANK_SIZE)
+
+#define SRAM_NUM_PHOTOS (30)
+
+//Layout of the save data
+#define SRAM_LAST_PICTURE (0x0100) // Last picture seen by the camera (16x14 tiles)
+#define SRAM_PHOTO_STATE  (0x11B2) // 1 byte per slot, 0xFF = deleted
+#define SRAM_PHOTO(n)     (0x2000 + (n)*0x1000) // 16x14 tiles
+#define SRAM_THUMBNAIL(n) (SRAM_PHOTO(n) + 0xE00) // 4x4 tiles
+
+//Reads all banks with block reads. sav must have SRAM_SIZE bytes. Returns 0 on success.
+int Sram_Dump(unsigned char * sav);
+
+//Returns 0 on success
+int Sram_Save(const char * filename, const unsigned char * sav);
+int Sram_Load(const char * filename, unsigned char * sav);
+
+//Decodes all photos and thumbnails with several threads and writes them as PGM files:
+//
+//    prefix_sheet.pgm   All photos (deleted ones are dimmed)
+//    prefix_thumbs.pgm  All thumbnails
+//    prefix_last.pgm    Last picture seen by the camera
+//    prefix_NN.pgm      Every photo (NN = 01-30), "_deleted" is added to deleted ones
+//
+//Returns the number of photos that aren't deleted, or -1 on error.
+int Sram_SaveGallery(const unsigned char * sav, const char * prefix);
+
+#endif // __SRAM__
@@ -0,0 +1,234 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "stack.h"
+#include "capture.h"
+#include "debug.h"
+
+//-------------------------------------------------------------------------------------
+
+#define STACK_MAX_PIXELS (GBCAM_SENSOR_W*GBCAM_SENSOR_H)
+
+static u16 stack_frames[STACK_MAX_FRAMES][STACK_MAX_PIXELS];
+static u32 stack_sum[STACK_MAX_PIXELS];
+static u32 stack_sum_sq[STACK_MAX_PIXELS]; // 64 frames of 10 bit values fit in 32 bits
+static int stack_count = 0;
+static int stack_pixels = 0;
+
+void Stack_Reset(int pixels)
+{
+    if(pixels > STACK_MAX_PIXELS)
+        pixels = STACK_MAX_PIXELS;
+
+    stack_pixels = pixels;
+    stack_count = 0;
+    memset(stack_sum,0,sizeof(stack_sum));
+    memset(stack_sum_sq,0,sizeof(stack_sum_sq));
+}
+
+int Stack_GetCount(void)
+{
+    return stack_count;
+}
+
+int Stack_AddFrame(const unsigned short * frame)
+{
+    if(stack_count == STACK_MAX_FRAMES)
+        return -1;
+
+    memcpy(stack_frames[stack_count],frame,stack_pixels*sizeof(u16));
+    stack_count++;
+
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for( ; i + 8 <= stack_pixels; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&frame[i]);
+        __m128i lo = _mm_unpacklo_epi16(v,zero); // 4 x 32 bit
+        __m128i hi = _mm_unpackhi_epi16(v,zero);
+
+        __m128i s0 = _mm_loadu_si128((const __m128i *)&stack_sum[i]);
+        __m128i s1 = _mm_loadu_si128((const __m128i *)&stack_sum[i+4]);
+        _mm_storeu_si128((__m128i *)&stack_sum[i],_mm_add_epi32(s0,lo));
+        _mm_storeu_si128((__m128i *)&stack_sum[i+4],_mm_add_epi32(s1,hi));
+
+        //The values are 10 bit at most, the upper half of every 32 bit lane is 0, so
+        //madd only multiplies the value by itself.
+        __m128i q0 = _mm_loadu_si128((const __m128i *)&stack_sum_sq[i]);
+        __m128i q1 = _mm_loadu_si128((const __m128i *)&stack_sum_sq[i+4]);
+        _mm_storeu_si128((__m128i *)&stack_sum_sq[i],_mm_add_epi32(q0,_mm_madd_epi16(lo,lo)));
+        _mm_storeu_si128((__m128i *)&stack_sum_sq[i+4],_mm_add_epi32(q1,_mm_madd_epi16(hi,hi)));
+    }
+#endif
+
+    for( ; i < stack_pixels; i++)
+    {
+        stack_sum[i] += frame[i];
+        stack_sum_sq[i] += (u32)frame[i] * frame[i];
+    }
+
+    return stack_count;
+}
+
+//-------------------------------------------------------------------------------------
+
+static void Stack_ResolveMean(unsigned short * out)
+{
+    u32 half = stack_count / 2;
+
+    int i;
+    for(i = 0; i < stack_pixels; i++)
+        out[i] = (stack_sum[i] + half) / stack_count;
+}
+
+//Sorts the values of a pixel in all frames. Insertion sort, there are few values.
+static void Stack_SortPixel(int i, u16 * values)
+{
+    int n;
+    for(n = 0; n < stack_count; n++)
+    {
+        u16 v = stack_frames[n][i];
+        int j = n;
+        while( (j > 0) && (values[j-1] > v) )
+        {
+            values[j] = values[j-1];
+            j--;
+        }
+        values[j] = v;
+    }
+}
+
+static u16 Stack_Median(const u16 * sorted)
+{
+    if(stack_count & 1)
+        return sorted[stack_count/2];
+    else
+        return (sorted[stack_count/2-1] + sorted[stack_count/2] + 1) / 2;
+}
+
+static void Stack_ResolveMedian(unsigned short * out)
+{
+    int i;
+    for(i = 0; i < stack_pixels; i++)
+    {
+        u16 values[STACK_MAX_FRAMES];
+        Stack_SortPixel(i,values);
+        out[i] = Stack_Median(values);
+    }
+}
+
+//The values are clipped around the median. With few frames an outlier can't be further
+//than a few standard deviations from the mean, because it moves the mean itself.
+static void Stack_ResolveClip(unsigned short * out)
+{
+    int i;
+    for(i = 0; i < stack_pixels; i++)
+    {
+        u16 values[STACK_MAX_FRAMES];
+        Stack_SortPixel(i,values);
+        double median = Stack_Median(values);
+
+        double mean = (double)stack_sum[i] / stack_count;
+        double variance = (double)stack_sum_sq[i] / stack_count - mean * mean;
+        double limit = STACK_CLIP_SIGMA * sqrt(variance > 0 ? variance : 0);
+
+        u32 sum = 0;
+        int count = 0;
+        int n;
+        for(n = 0; n < stack_count; n++)
+        {
+            if(fabs(values[n] - median) <= limit)
+            {
+                sum += values[n];
+                count++;
+            }
+        }
+
+        if(count == 0)
+            out[i] = (u16)median;
+        else
+            out[i] = (sum + count/2) / count;
+    }
+}
+
+void Stack_Resolve(int mode, unsigned short * out)
+{
+    if(stack_count == 0)
+        return;
+
+    switch(mode)
+    {
+        case STACK_MODE_MEDIAN: Stack_ResolveMedian(out); break;
+        case STACK_MODE_CLIP: Stack_ResolveClip(out); break;
+        case STACK_MODE_MEAN:
+        default: Stack_ResolveMean(out); break;
+    }
+}
+
+const char * Stack_GetModeName(int mode)
+{
+    switch(mode)
+    {
+        case STACK_MODE_MEAN: return "mean";
+        case STACK_MODE_MEDIAN: return "median";
+        case STACK_MODE_CLIP: return "clip";
+        default: return "?";
+    }
+}
+
+//-------------------------------------------------------------------------------------
+
+int Stack_Capture(int frames, int stack_mode, StackFrameCallback callback,
+                  u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                  int dithering, int mode)
+{
+    if(frames < 1)
+        frames = 1;
+    if(frames > STACK_MAX_FRAMES)
+        frames = STACK_MAX_FRAMES;
+
+    if(SendPictureAnalog(trigger,unk1,exposure_time,unk2,unk3,dithering,mode) != 0)
+        return -1;
+
+    int i;
+    for(i = 0; i < frames; i++)
+    {
+        if(ReceivePictureAnalog(mode) != 0)
+            return -1;
+
+        if(i == 0)
+            Stack_Reset(GBCAM_SENSOR_W*analog_lines);
+
+        Stack_AddFrame(analogdata);
+
+        //The server is idle now, start the next exposure before doing anything else
+        if(i + 1 < frames)
+        {
+            if(SendPictureAnalog(trigger,unk1,exposure_time,unk2,unk3,dithering,mode) != 0)
+                return -1;
+        }
+
+        if(callback)
+        {
+            Stack_Resolve(stack_mode,analogdata);
+            callback(i,frames);
+        }
+    }
+
+    if(callback == NULL)
+        Stack_Resolve(stack_mode,analogdata);
+
+    Debug_Info("Stacked %d frames (%s)",frames,Stack_GetModeName(stack_mode));
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
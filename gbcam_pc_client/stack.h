@@ -0,0 +1,42 @@
+
+#ifndef __STACK__
+#define __STACK__
+
+#include "capture.h"
+
+//Stacking of analog captures to reduce the noise of the ADC. Every frame is added to 32 bit
+//accumulators (sum and sum of squares) and kept for the modes that need every value.
+
+#define STACK_MAX_FRAMES (64)
+
+#define STACK_MODE_MEAN   (0)
+#define STACK_MODE_MEDIAN (1)
+#define STACK_MODE_CLIP   (2) // Mean of the values closer than STACK_CLIP_SIGMA to the median
+#define STACK_NUM_MODES   (3)
+
+#define STACK_CLIP_SIGMA (2.0)
+
+//Clears the stack. All frames must have the specified number of pixels.
+void Stack_Reset(int pixels);
+
+//Returns the number of frames in the stack, or -1 if it is full
+int Stack_AddFrame(const unsigned short * frame);
+
+int Stack_GetCount(void);
+
+//Combines the frames in the stack. The values of the result have the same range as the
+//values of the frames.
+void Stack_Resolve(int mode, unsigned short * out);
+
+const char * Stack_GetModeName(int mode);
+
+//Takes the specified number of analog captures and stacks them. Every capture is requested
+//before stacking the previous one, so the stacking is done while the server is busy. If
+//the callback isn't NULL the partial result is resolved after every frame and the
+//callback is called. The final result is left in analogdata. Returns 0 on success.
+typedef void (*StackFrameCallback)(int frame, int frames);
+int Stack_Capture(int frames, int stack_mode, StackFrameCallback callback,
+                  u8 trigger, u8 unk1, u16 exposure_time, u8 unk2, u8 unk3,
+                  int dithering, int mode);
+
+#endif // __STACK__
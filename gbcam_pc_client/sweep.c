@@ -0,0 +1,381 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sweep.h"
+#include "serial.h"
+#include "debug.h"
+#include "image.h"
+#include "thread.h"
+#include "timing.h"
+
+//-------------------------------------------------------------------------------------
+
+//Values written by the game
+static const u16 game_reg1[] = { 0x00, 0x0A, 0x20, 0x24, 0x28, 0xE4, 0xE8 };
+static const u16 game_reg4[] = {
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x23, 0x24, 0x25, 0x26, 0x27
+};
+static const u16 game_reg5[] = { 0x3F, 0x80, 0xA0, 0xB0, 0xB8, 0xBC, 0xBE, 0xBF };
+
+void Sweep_SetAxisValue(SweepAxis * axis, u16 value)
+{
+    axis->count = 1;
+    axis->values[0] = value;
+}
+
+static int Sweep_AddValue(SweepAxis * axis, unsigned long value, unsigned long max)
+{
+    if( (axis->count == SWEEP_MAX_VALUES) || (value > max) )
+        return -1;
+
+    axis->values[axis->count++] = value;
+    return 0;
+}
+
+int Sweep_ParseAxis(SweepAxis * axis, int which, const char * text)
+{
+    unsigned long max = (which == SWEEP_AXIS_EXPOSURE) ? 0xFFFF : 0xFF;
+
+    axis->count = 0;
+
+    if(!strcmp(text,"game"))
+    {
+        const u16 * values;
+        int count;
+        if(which == SWEEP_AXIS_REG1) { values = game_reg1; count = sizeof(game_reg1)/sizeof(u16); }
+        else if(which == SWEEP_AXIS_REG4) { values = game_reg4; count = sizeof(game_reg4)/sizeof(u16); }
+        else if(which == SWEEP_AXIS_REG5) { values = game_reg5; count = sizeof(game_reg5)/sizeof(u16); }
+        else return -1;
+
+        memcpy(axis->values,values,count*sizeof(u16));
+        axis->count = count;
+        return 0;
+    }
+
+    const char * p = text;
+    while(*p)
+    {
+        char * end;
+        unsigned long first = strtoul(p,&end,16);
+        if(end == p)
+            return -1;
+        p = end;
+
+        if(*p == '-')
+        {
+            unsigned long last = strtoul(p+1,&end,16);
+            if(end == p+1)
+                return -1;
+            p = end;
+
+            unsigned long step = 1;
+            if(*p == ':')
+            {
+                step = strtoul(p+1,&end,16);
+                if( (end == p+1) || (step == 0) )
+                    return -1;
+                p = end;
+            }
+
+            unsigned long value;
+            for(value = first; value <= last; value += step)
+            {
+                if(Sweep_AddValue(axis,value,max) != 0)
+                    return -1;
+            }
+        }
+        else
+        {
+            if(Sweep_AddValue(axis,first,max) != 0)
+                return -1;
+        }
+
+        if(*p == ',')
+            p++;
+        else if(*p)
+            return -1;
+    }
+
+    return (axis->count > 0) ? 0 : -1;
+}
+
+int Sweep_GetPoints(const SweepAxis axes[SWEEP_NUM_AXES])
+{
+    int points = 1;
+    int i;
+    for(i = 0; i < SWEEP_NUM_AXES; i++)
+    {
+        if(axes[i].count < 1)
+            return -1;
+        points *= axes[i].count;
+        if(points > SWEEP_MAX_POINTS)
+            return -1;
+    }
+    return points;
+}
+
+//-------------------------------------------------------------------------------------
+
+//Index of the value of every axis of the point k of the sweep. The order is a reflected
+//mixed radix Gray code: an axis goes backwards when the index of the axes that change
+//less often is odd, so every step only changes one register to the next value.
+static void Sweep_GetPoint(const SweepAxis axes[SWEEP_NUM_AXES], int k, int index[SWEEP_NUM_AXES])
+{
+    int i;
+    for(i = 0; i < SWEEP_NUM_AXES; i++)
+    {
+        int count = axes[i].count;
+        int digit = k % count;
+        k /= count;
+        index[i] = (k & 1) ? (count - 1 - digit) : digit;
+    }
+}
+
+//Grid position of a point. The columns are the first axis with more than one value.
+static int Sweep_GetColumnAxis(const SweepAxis axes[SWEEP_NUM_AXES])
+{
+    int i;
+    for(i = 0; i < SWEEP_NUM_AXES; i++)
+        if(axes[i].count > 1)
+            return i;
+    return 0;
+}
+
+static int Sweep_GetRasterIndex(const SweepAxis axes[SWEEP_NUM_AXES], const int index[SWEEP_NUM_AXES])
+{
+    int raster = 0;
+    int i;
+    for(i = SWEEP_NUM_AXES - 1; i >= 0; i--)
+        raster = raster * axes[i].count + index[i];
+    return raster;
+}
+
+//-------------------------------------------------------------------------------------
+
+#define SWEEP_LABEL_H (7)
+#define SWEEP_BORDER  (2)
+#define SWEEP_CELL_W  (GBCAM_W + SWEEP_BORDER)
+#define SWEEP_CELL_H  (GBCAM_H + SWEEP_LABEL_H + SWEEP_BORDER)
+
+typedef struct {
+    u8 tiles[16*14*16];
+    u8 reg1, reg4, reg5;
+    u16 exposure;
+    int raster; // Index in the grid
+    int columns;
+
+    const char * prefix;
+    unsigned char * grid;
+    int grid_w;
+    FILE * csv;
+
+    int errors;
+} sweep_job;
+
+//Decodes a picture and saves it. Only one job runs at a time, so the CSV file can be
+//written without locks.
+static void Sweep_SaveThread(void * arg)
+{
+    sweep_job * job = arg;
+
+    int column = job->raster % job->columns;
+    int row = job->raster / job->columns;
+
+    unsigned char * cell = &job->grid[(SWEEP_BORDER + row*SWEEP_CELL_H) * job->grid_w +
+                                      SWEEP_BORDER + column*SWEEP_CELL_W];
+
+    char label[30];
+    sprintf(label,"%02X %02X %02X %04X",job->reg1,job->reg4,job->reg5,job->exposure);
+    Image_DrawHex(cell,job->grid_w,1,1,label,0xFF);
+
+    unsigned char * picture = &cell[SWEEP_LABEL_H * job->grid_w];
+    Image_TilesToGray(job->tiles,16,16,14,picture,job->grid_w);
+
+    char filename[1024];
+    snprintf(filename,sizeof(filename),"%s_%04d.pgm",job->prefix,job->raster);
+
+    unsigned char pixels[GBCAM_W*GBCAM_H];
+    int y;
+    for(y = 0; y < GBCAM_H; y++)
+        memcpy(&pixels[y*GBCAM_W],&picture[y*job->grid_w],GBCAM_W);
+
+    FILE * f = fopen(filename,"wb");
+    if( (f == NULL) || (Image_WritePGM8(f,pixels,GBCAM_W,GBCAM_H) != 0) )
+        job->errors++;
+    if(f)
+        fclose(f);
+
+    fprintf(job->csv,"%d,%d,%d,%02X,%02X,%02X,%04X,%s\n",job->raster,column,row,
+            job->reg1,job->reg4,job->reg5,job->exposure,filename);
+}
+
+static int Sweep_Send(const SweepAxis axes[SWEEP_NUM_AXES], int k, u8 trigger, const u8 * matrix)
+{
+    int index[SWEEP_NUM_AXES];
+    Sweep_GetPoint(axes,k,index);
+
+    if(SendCaptureCommandMatrix(0,trigger,axes[SWEEP_AXIS_REG1].values[index[SWEEP_AXIS_REG1]],
+                                axes[SWEEP_AXIS_EXPOSURE].values[index[SWEEP_AXIS_EXPOSURE]],
+                                axes[SWEEP_AXIS_REG4].values[index[SWEEP_AXIS_REG4]],
+                                axes[SWEEP_AXIS_REG5].values[index[SWEEP_AXIS_REG5]],
+                                matrix) == 0)
+    {
+        Debug_Error("SerialWriteData() error in Sweep_Run()");
+        return -1;
+    }
+
+    return 0;
+}
+
+int Sweep_Run(const SweepAxis axes[SWEEP_NUM_AXES], u8 trigger, int dithering,
+              const char * prefix)
+{
+    int points = Sweep_GetPoints(axes);
+    if(points < 0)
+    {
+        Debug_Error("Sweep_Run(): More than %d captures",SWEEP_MAX_POINTS);
+        return -1;
+    }
+
+    int columns = axes[Sweep_GetColumnAxis(axes)].count;
+    int rows = points / columns;
+
+    int grid_w = columns * SWEEP_CELL_W + SWEEP_BORDER;
+    int grid_h = rows * SWEEP_CELL_H + SWEEP_BORDER;
+
+    unsigned char * grid = malloc(grid_w * grid_h);
+    sweep_job * jobs = malloc(2 * sizeof(sweep_job)); // The one being saved and the next one
+    if( (grid == NULL) || (jobs == NULL) )
+    {
+        free(grid);
+        free(jobs);
+        return -1;
+    }
+    memset(grid,0x40,grid_w * grid_h);
+
+    char filename[1024];
+    snprintf(filename,sizeof(filename),"%s.csv",prefix);
+    FILE * csv = fopen(filename,"w");
+    if(csv == NULL)
+    {
+        Debug_Error("Sweep_Run(): Can't open %s",filename);
+        free(grid);
+        free(jobs);
+        return -1;
+    }
+    fprintf(csv,"index,column,row,reg1,reg4,reg5,exposure,file\n");
+
+    double predicted_ms = 0;
+    int k;
+    for(k = 0; k < points; k++)
+    {
+        int index[SWEEP_NUM_AXES];
+        Sweep_GetPoint(axes,k,index);
+        predicted_ms += Timing_PredictCaptureMs(axes[SWEEP_AXIS_REG1].values[index[SWEEP_AXIS_REG1]],
+                                                axes[SWEEP_AXIS_EXPOSURE].values[index[SWEEP_AXIS_EXPOSURE]],
+                                                16*14*16);
+    }
+    Debug_Info("Sweep: %d captures (%dx%d), predicted time %.1f s",points,columns,rows,
+               predicted_ms / 1000.0);
+
+    u8 matrix[48];
+    GetMatrixRegisters(matrix,dithering);
+
+    int ret = 0;
+    int errors = 0;
+    Thread saving = NULL;
+    sweep_job * saving_job = NULL;
+
+    if(Sweep_Send(axes,0,trigger,matrix) != 0)
+        ret = -1;
+
+    for(k = 0; (k < points) && (ret == 0); k++)
+    {
+        int index[SWEEP_NUM_AXES];
+        Sweep_GetPoint(axes,k,index);
+
+        char str[100];
+        sprintf(str,"Sweep %d/%d",k+1,points);
+        Capture_SetStatus(str);
+
+        //When the server starts sending data it has already read the previous command,
+        //the next one is kept in its receive buffer until this capture ends.
+        if(Capture_WaitCapture(1) != 0)
+        {
+            Debug_Error("Timeout waiting for sweep point %d",k+1);
+            Capture_Resync();
+            ret = -1;
+            break;
+        }
+        if( (k + 1 < points) && (Sweep_Send(axes,k+1,trigger,NULL) != 0) )
+        {
+            ret = -1;
+            break;
+        }
+
+        if(ReceivePicture(0) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        //Wait for the previous picture to be saved before saving this one
+        Thread_Join(saving);
+        if(saving_job)
+            errors += saving_job->errors;
+
+        sweep_job * job = &jobs[k & 1];
+        memcpy(job->tiles,picturedata,sizeof(job->tiles));
+        job->reg1 = axes[SWEEP_AXIS_REG1].values[index[SWEEP_AXIS_REG1]];
+        job->reg4 = axes[SWEEP_AXIS_REG4].values[index[SWEEP_AXIS_REG4]];
+        job->reg5 = axes[SWEEP_AXIS_REG5].values[index[SWEEP_AXIS_REG5]];
+        job->exposure = axes[SWEEP_AXIS_EXPOSURE].values[index[SWEEP_AXIS_EXPOSURE]];
+        job->raster = Sweep_GetRasterIndex(axes,index);
+        job->columns = columns;
+        job->prefix = prefix;
+        job->grid = grid;
+        job->grid_w = grid_w;
+        job->csv = csv;
+        job->errors = 0;
+
+        saving_job = job;
+        saving = Thread_Create(Sweep_SaveThread,job);
+        if(saving == NULL)
+            Sweep_SaveThread(job);
+    }
+
+    Thread_Join(saving);
+    if(saving_job)
+        errors += saving_job->errors;
+
+    ramDisable();
+
+    if(fclose(csv) != 0)
+        errors++;
+
+    if(ret == 0)
+    {
+        snprintf(filename,sizeof(filename),"%s_grid.pgm",prefix);
+        FILE * f = fopen(filename,"wb");
+        if( (f == NULL) || (Image_WritePGM8(f,grid,grid_w,grid_h) != 0) )
+            errors++;
+        if(f)
+            fclose(f);
+    }
+
+    free(grid);
+    free(jobs);
+
+    if(errors)
+    {
+        Debug_Error("Sweep_Run(): %d files couldn't be written",errors);
+        ret = -1;
+    }
+
+    return (ret == 0) ? points : -1;
+}
+
+//-------------------------------------------------------------------------------------
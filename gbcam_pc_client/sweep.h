@@ -0,0 +1,55 @@
+
+#ifndef __SWEEP__
+#define __SWEEP__
+
+#include "capture.h"
+
+//Captures every combination of a set of values of A001, A004, A005 and the exposure time.
+//
+//The captures are ordered so that only one register changes between two consecutive
+//captures, and the matrix is only sent with the first one (the server keeps it). Every
+//capture is requested as soon as the server starts sending the previous one, and every
+//picture is decoded and saved by another thread while the next one is being captured.
+//
+//Results:
+//
+//    prefix_grid.pgm   All pictures labeled with the register values. The columns are the
+//                      values of the first swept register (exposure, A005, A004, A001).
+//    prefix.csv        Index, position in the grid and register values of every picture
+//    prefix_NNNN.pgm   Every picture (NNNN = index)
+
+#define SWEEP_MAX_VALUES (256)
+#define SWEEP_MAX_POINTS (4096)
+
+//Axes from the one that changes more often to the one that changes less often
+#define SWEEP_AXIS_EXPOSURE (0)
+#define SWEEP_AXIS_REG5     (1)
+#define SWEEP_AXIS_REG4     (2)
+#define SWEEP_AXIS_REG1     (3)
+#define SWEEP_NUM_AXES      (4)
+
+typedef struct {
+    int count;
+    u16 values[SWEEP_MAX_VALUES];
+} SweepAxis;
+
+void Sweep_SetAxisValue(SweepAxis * axis, u16 value); //Only one value
+
+//Values are hexadecimal:
+//
+//    "E4,E8,28"     List of values
+//    "00-FF"        Range
+//    "0100-2000:80" Range with a step
+//    "game"         Values used by the game (registers only)
+//
+//Returns 0 on success
+int Sweep_ParseAxis(SweepAxis * axis, int which, const char * text);
+
+//Number of captures of a sweep, or -1 if it has more than SWEEP_MAX_POINTS
+int Sweep_GetPoints(const SweepAxis axes[SWEEP_NUM_AXES]);
+
+//Returns the number of pictures taken, or -1 on error
+int Sweep_Run(const SweepAxis axes[SWEEP_NUM_AXES], u8 trigger, int dithering,
+              const char * prefix);
+
+#endif // __SWEEP__
@@ -0,0 +1,134 @@
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "thread.h"
+
+//-------------------------------------------------------------------------
+
+struct thread_info {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    ThreadFunction function;
+    void * arg;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadEntry(LPVOID arg)
+#else
+static void * ThreadEntry(void * arg)
+#endif
+{
+    struct thread_info * info = arg;
+    info->function(info->arg);
+    return 0;
+}
+
+Thread Thread_Create(ThreadFunction function, void * arg)
+{
+    struct thread_info * info = malloc(sizeof(struct thread_info));
+    if(info == NULL)
+        return NULL;
+
+    info->function = function;
+    info->arg = arg;
+
+#ifdef _WIN32
+    info->handle = CreateThread(NULL,0,ThreadEntry,info,0,NULL);
+    if(info->handle == NULL)
+#else
+    if(pthread_create(&info->handle,NULL,ThreadEntry,info) != 0)
+#endif
+    {
+        free(info);
+        return NULL;
+    }
+
+    return info;
+}
+
+void Thread_Join(Thread thread)
+{
+    if(thread == NULL)
+        return;
+
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle,INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle,NULL);
+#endif
+
+    free(thread);
+}
+
+//-------------------------------------------------------------------------
+
+struct mutex_info {
+#ifdef _WIN32
+    CRITICAL_SECTION cs;
+#else
+    pthread_mutex_t mutex;
+#endif
+};
+
+Mutex Mutex_Create(void)
+{
+    struct mutex_info * info = malloc(sizeof(struct mutex_info));
+    if(info == NULL)
+        return NULL;
+
+#ifdef _WIN32
+    InitializeCriticalSection(&info->cs);
+#else
+    if(pthread_mutex_init(&info->mutex,NULL) != 0)
+    {
+        free(info);
+        return NULL;
+    }
+#endif
+
+    return info;
+}
+
+void Mutex_Destroy(Mutex mutex)
+{
+    if(mutex == NULL)
+        return;
+
+#ifdef _WIN32
+    DeleteCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_destroy(&mutex->mutex);
+#endif
+
+    free(mutex);
+}
+
+void Mutex_Lock(Mutex mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+void Mutex_Unlock(Mutex mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
+
+//-------------------------------------------------------------------------
@@ -0,0 +1,21 @@
+
+#ifndef __THREAD__
+#define __THREAD__
+
+//Minimal wrapper of the threads of the OS
+
+typedef struct thread_info * Thread;
+
+typedef void (*ThreadFunction)(void * arg);
+
+Thread Thread_Create(ThreadFunction function, void * arg); //Returns NULL on error
+void Thread_Join(Thread thread); //Waits until the thread ends and frees it
+
+typedef struct mutex_info * Mutex;
+
+Mutex Mutex_Create(void); //Returns NULL on error
+void Mutex_Destroy(Mutex mutex);
+void Mutex_Lock(Mutex mutex);
+void Mutex_Unlock(Mutex mutex);
+
+#endif // __THREAD__
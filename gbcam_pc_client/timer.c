@@ -0,0 +1,53 @@
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "timer.h"
+
+//-------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+unsigned long long Timer_GetMicroseconds(void)
+{
+    static LARGE_INTEGER frequency;
+    if(frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    unsigned long long f = frequency.QuadPart;
+    unsigned long long c = counter.QuadPart;
+
+    return (c / f) * 1000000ULL + ((c % f) * 1000000ULL) / f;
+}
+
+void Timer_SleepMs(unsigned int ms)
+{
+    Sleep(ms);
+}
+
+#else
+
+unsigned long long Timer_GetMicroseconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return (unsigned long long)t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+void Timer_SleepMs(unsigned int ms)
+{
+    struct timespec t;
+    t.tv_sec = ms / 1000;
+    t.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&t,NULL);
+}
+
+#endif
+
+//-------------------------------------------------------------------------
@@ -0,0 +1,10 @@
+#ifndef __TIMER__
+#define __TIMER__
+
+//Monotonic time in microseconds since an unspecified point
+unsigned long long Timer_GetMicroseconds(void);
+
+//Sleeps the calling thread for at least the specified number of milliseconds
+void Timer_SleepMs(unsigned int ms);
+
+#endif // __TIMER__
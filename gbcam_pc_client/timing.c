@@ -0,0 +1,308 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "timing.h"
+#include "debug.h"
+
+//-------------------------------------------------------------------------
+
+#define BIT(n) (1<<(n))
+
+#define MAX_CLOCK_SAMPLES   (256)
+#define MAX_READOUT_SAMPLES (64)
+
+static TimingModel model;
+
+static struct {
+    unsigned char n_bit;
+    unsigned short exposure;
+    unsigned int clocks;
+} clock_samples[MAX_CLOCK_SAMPLES];
+static int num_clock_samples;
+
+static struct {
+    unsigned int bytes;
+    double ms;
+} readout_samples[MAX_READOUT_SAMPLES];
+static int num_readout_samples;
+
+//-------------------------------------------------------------------------
+
+void Timing_Init(void)
+{
+    model.base_clocks = 32446;
+    model.n_extra_clocks = 512;
+    model.exposure_clocks = 16;
+    model.phi_hz = 16000000.0 / 15.0; // Clock loop of the server: 15 cycles at 16 MHz
+    model.readout_overhead_ms = 0;
+    model.link_bytes_per_s = 115200.0 / 10.0; // 8N1
+
+    Timing_ClearSamples();
+}
+
+TimingModel * Timing_GetModel(void)
+{
+    return &model;
+}
+
+//-------------------------------------------------------------------------
+
+void Timing_ClearSamples(void)
+{
+    num_clock_samples = 0;
+    num_readout_samples = 0;
+}
+
+void Timing_AddClockSample(unsigned char reg1, unsigned short exposure, unsigned int clocks)
+{
+    if(num_clock_samples == MAX_CLOCK_SAMPLES)
+        return;
+
+    clock_samples[num_clock_samples].n_bit = (reg1 & BIT(7)) ? 1 : 0;
+    clock_samples[num_clock_samples].exposure = exposure;
+    clock_samples[num_clock_samples].clocks = clocks;
+    num_clock_samples++;
+}
+
+void Timing_AddReadoutSample(unsigned int bytes, double ms)
+{
+    if(num_readout_samples == MAX_READOUT_SAMPLES)
+        return;
+
+    readout_samples[num_readout_samples].bytes = bytes;
+    readout_samples[num_readout_samples].ms = ms;
+    num_readout_samples++;
+}
+
+//-------------------------------------------------------------------------
+
+//Solves A x = b (n x n) by Gaussian elimination with partial pivoting. Returns -1 if singular.
+static int SolveLinearSystem(double * A, double * b, double * x, int n)
+{
+    int i, j, k;
+    for(k = 0; k < n; k++)
+    {
+        int pivot = k;
+        for(i = k+1; i < n; i++)
+            if(fabs(A[i*n+k]) > fabs(A[pivot*n+k])) pivot = i;
+
+        if(fabs(A[pivot*n+k]) < 1e-12)
+            return -1;
+
+        if(pivot != k)
+        {
+            for(j = 0; j < n; j++)
+            {
+                double t = A[k*n+j]; A[k*n+j] = A[pivot*n+j]; A[pivot*n+j] = t;
+            }
+            double t = b[k]; b[k] = b[pivot]; b[pivot] = t;
+        }
+
+        for(i = k+1; i < n; i++)
+        {
+            double f = A[i*n+k] / A[k*n+k];
+            for(j = k; j < n; j++)
+                A[i*n+j] -= f * A[k*n+j];
+            b[i] -= f * b[k];
+        }
+    }
+
+    for(i = n-1; i >= 0; i--)
+    {
+        double sum = b[i];
+        for(j = i+1; j < n; j++)
+            sum -= A[i*n+j] * x[j];
+        x[i] = sum / A[i*n+i];
+    }
+
+    return 0;
+}
+
+//Least squares fit of: clocks = base + n_extra * (N ? 0 : 1) + exposure_step * exposure
+int Timing_FitClocks(void)
+{
+    int has_n[2] = { 0, 0 };
+    int i;
+    for(i = 0; i < num_clock_samples; i++)
+        has_n[clock_samples[i].n_bit] = 1;
+
+    //If all samples use the same N bit the extra clocks can't be measured, keep the old value
+    int fit_n = has_n[0] && has_n[1];
+    int n = fit_n ? 3 : 2;
+
+    if(num_clock_samples < n)
+        return -1;
+
+    double A[3*3], b[3], x[3];
+    memset(A,0,sizeof(A));
+    memset(b,0,sizeof(b));
+
+    for(i = 0; i < num_clock_samples; i++)
+    {
+        double clocks = clock_samples[i].clocks;
+        double f[3];
+        f[0] = 1.0;
+        f[1] = clock_samples[i].exposure;
+        f[2] = clock_samples[i].n_bit ? 0.0 : 1.0;
+
+        if(!fit_n)
+            clocks -= f[2] * model.n_extra_clocks;
+
+        int j, k;
+        for(j = 0; j < n; j++)
+        {
+            for(k = 0; k < n; k++)
+                A[j*n+k] += f[j] * f[k];
+            b[j] += f[j] * clocks;
+        }
+    }
+
+    if(SolveLinearSystem(A,b,x,n) != 0)
+        return -1;
+
+    model.base_clocks = x[0];
+    model.exposure_clocks = x[1];
+    if(fit_n)
+        model.n_extra_clocks = x[2];
+
+    return 0;
+}
+
+//Least squares fit of: ms = overhead + bytes / link_bytes_per_s
+int Timing_FitReadout(void)
+{
+    if(num_readout_samples < 2)
+        return -1;
+
+    double A[2*2], b[2], x[2];
+    memset(A,0,sizeof(A));
+    memset(b,0,sizeof(b));
+
+    int i;
+    for(i = 0; i < num_readout_samples; i++)
+    {
+        double f[2] = { 1.0, readout_samples[i].bytes };
+        A[0] += f[0]*f[0]; A[1] += f[0]*f[1];
+        A[2] += f[1]*f[0]; A[3] += f[1]*f[1];
+        b[0] += f[0]*readout_samples[i].ms;
+        b[1] += f[1]*readout_samples[i].ms;
+    }
+
+    if(SolveLinearSystem(A,b,x,2) != 0)
+        return -1;
+
+    if(x[1] <= 0.0)
+        return -1;
+
+    model.readout_overhead_ms = (x[0] > 0.0) ? x[0] : 0.0;
+    model.link_bytes_per_s = 1000.0 / x[1];
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+
+unsigned int Timing_PredictClocks(unsigned char reg1, unsigned short exposure)
+{
+    double clocks = model.base_clocks + model.exposure_clocks * exposure;
+    if((reg1 & BIT(7)) == 0)
+        clocks += model.n_extra_clocks;
+
+    return (clocks > 0.0) ? (unsigned int)(clocks + 0.5) : 0;
+}
+
+double Timing_PredictExposureMs(unsigned char reg1, unsigned short exposure)
+{
+    return (Timing_PredictClocks(reg1,exposure) * 1000.0) / model.phi_hz;
+}
+
+double Timing_PredictReadoutMs(unsigned int bytes)
+{
+    return model.readout_overhead_ms + (bytes * 1000.0) / model.link_bytes_per_s;
+}
+
+double Timing_PredictCaptureMs(unsigned char reg1, unsigned short exposure, unsigned int bytes)
+{
+    return Timing_PredictExposureMs(reg1,exposure) + Timing_PredictReadoutMs(bytes);
+}
+
+//-------------------------------------------------------------------------
+
+void Timing_Report(void)
+{
+    Debug_Log("Timing model: clocks = %.1f + %.1f * (N ? 0 : 1) + %.3f * exposure",
+              model.base_clocks,model.n_extra_clocks,model.exposure_clocks);
+    Debug_Log("Timing model: PHI = %.0f Hz, readout = %.2f ms + %.1f bytes/s",
+              model.phi_hz,model.readout_overhead_ms,model.link_bytes_per_s);
+
+    double max_error = 0.0;
+    int i;
+    for(i = 0; i < num_clock_samples; i++)
+    {
+        unsigned int predicted = Timing_PredictClocks(clock_samples[i].n_bit ? BIT(7) : 0,
+                                                      clock_samples[i].exposure);
+        double error = (double)predicted - (double)clock_samples[i].clocks;
+        if(fabs(error) > max_error) max_error = fabs(error);
+
+        Debug_Log("  N=%d exposure=0x%04X: measured %u, predicted %u (%+.0f)",
+                  clock_samples[i].n_bit,clock_samples[i].exposure,
+                  clock_samples[i].clocks,predicted,error);
+    }
+    for(i = 0; i < num_readout_samples; i++)
+    {
+        Debug_Log("  %u bytes: measured %.1f ms, predicted %.1f ms",
+                  readout_samples[i].bytes,readout_samples[i].ms,
+                  Timing_PredictReadoutMs(readout_samples[i].bytes));
+    }
+
+    if(num_clock_samples > 0)
+        Debug_Log("Timing model: max clock error %.0f", max_error);
+}
+
+//-------------------------------------------------------------------------
+
+int Timing_Save(const char * filename)
+{
+    FILE * f = fopen(filename,"w");
+    if(f == NULL)
+    {
+        Debug_Error("Timing_Save(): Can't open %s",filename);
+        return -1;
+    }
+
+    fprintf(f,"base_clocks %f\n",model.base_clocks);
+    fprintf(f,"n_extra_clocks %f\n",model.n_extra_clocks);
+    fprintf(f,"exposure_clocks %f\n",model.exposure_clocks);
+    fprintf(f,"phi_hz %f\n",model.phi_hz);
+    fprintf(f,"readout_overhead_ms %f\n",model.readout_overhead_ms);
+    fprintf(f,"link_bytes_per_s %f\n",model.link_bytes_per_s);
+
+    fclose(f);
+    return 0;
+}
+
+int Timing_Load(const char * filename)
+{
+    FILE * f = fopen(filename,"r");
+    if(f == NULL)
+        return -1;
+
+    char name[64];
+    double value;
+    while(fscanf(f,"%63s %lf",name,&value) == 2)
+    {
+        if(!strcmp(name,"base_clocks")) model.base_clocks = value;
+        else if(!strcmp(name,"n_extra_clocks")) model.n_extra_clocks = value;
+        else if(!strcmp(name,"exposure_clocks")) model.exposure_clocks = value;
+        else if(!strcmp(name,"phi_hz")) model.phi_hz = value;
+        else if(!strcmp(name,"readout_overhead_ms")) model.readout_overhead_ms = value;
+        else if(!strcmp(name,"link_bytes_per_s")) model.link_bytes_per_s = value;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+//-------------------------------------------------------------------------
@@ -0,0 +1,46 @@
+
+#ifndef __TIMING__
+#define __TIMING__
+
+//Timing model of a capture:
+//
+//    clocks = base + (N ? 0 : n_extra) + exposure_step * exposure
+//    time = clocks / phi_hz + readout_overhead + bytes / link_bytes_per_s
+//
+//The default values are the ones of the documentation. They can be refined by
+//adding measured samples and fitting the model again.
+
+typedef struct {
+    double base_clocks;         // PHI clocks when N = 1 and exposure = 0
+    double n_extra_clocks;      // Extra PHI clocks when N = 0
+    double exposure_clocks;     // PHI clocks per exposure step
+    double phi_hz;              // Frequency of PHI generated by the server during a capture
+    double readout_overhead_ms; // Time from the end of the capture to the first byte
+    double link_bytes_per_s;    // Throughput of the link during a readout
+} TimingModel;
+
+void Timing_Init(void); //Sets the default model and clears all samples
+
+TimingModel * Timing_GetModel(void);
+
+//Clock samples: clocks measured by the server until A000 bit 0 is cleared.
+void Timing_ClearSamples(void);
+void Timing_AddClockSample(unsigned char reg1, unsigned short exposure, unsigned int clocks);
+int Timing_FitClocks(void); //Returns 0 on success, -1 if the samples aren't enough
+
+//Readout samples: time to receive a number of bytes from the server.
+void Timing_AddReadoutSample(unsigned int bytes, double ms);
+int Timing_FitReadout(void); //Returns 0 on success, -1 if the samples aren't enough
+
+//Predictions from the register values
+unsigned int Timing_PredictClocks(unsigned char reg1, unsigned short exposure);
+double Timing_PredictExposureMs(unsigned char reg1, unsigned short exposure);
+double Timing_PredictReadoutMs(unsigned int bytes);
+double Timing_PredictCaptureMs(unsigned char reg1, unsigned short exposure, unsigned int bytes);
+
+void Timing_Report(void); //Writes the model and the error of the samples to the log
+
+int Timing_Save(const char * filename); //Returns 0 on success
+int Timing_Load(const char * filename); //Returns 0 on success
+
+#endif // __TIMING__
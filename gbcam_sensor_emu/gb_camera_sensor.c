@@ -0,0 +1,496 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb_camera_sensor.h"
+
+//-------------------------------------------------------------------------------------
+
+#define BIT(n) (1<<(n))
+
+#define GBCAM_SENSOR_W (GB_CAMERA_SENSOR_W)
+#define GBCAM_SENSOR_H (GB_CAMERA_SENSOR_H)
+#define GBCAM_SENSOR_EXTRA_LINES (GBCAM_SENSOR_H-GBCAM_H)
+
+#define GBCAM_W (128)
+#define GBCAM_H (112)
+
+typedef unsigned int u32;
+typedef unsigned char u8;
+
+#define GB_CAMERA_SENSOR_MATRIX_REG (6) // A006-A035 only affect the controller
+
+// Buffers are stored by rows ([y][x]), unlike the ones of the sample code.
+struct gb_camera_sensor {
+    u8 reg[GB_CAMERA_SENSOR_NUM_REGS];
+
+    // State of the capture in progress (or the last one). The registers and the frame are
+    // latched when it starts, the picture is processed when the tiles are requested.
+    u8 capture_reg[GB_CAMERA_SENSOR_NUM_REGS];
+    u8 capture_frame[GBCAM_SENSOR_H][GBCAM_SENSOR_W];
+    unsigned long long busy_until; // Cycle when the capture finishes
+    int busy; // A000 bit 0
+    int tiles_pending; // Finished, but not processed or taken yet
+
+    gb_camera_sensor_callback callback;
+    void * callback_data;
+
+    int retina_output_buf[GBCAM_SENSOR_H][GBCAM_SENSOR_W]; // Image processed by sensor chip
+    int temp_buf[GBCAM_SENSOR_H][GBCAM_SENSOR_W];
+
+    // Input frame and sensor registers (A000-A005) of retina_output_buf, and matrix of
+    // the tiles. If they don't change the stages aren't repeated.
+    int retina_valid;
+    u8 retina_reg[GB_CAMERA_SENSOR_MATRIX_REG];
+    u8 retina_frame[GBCAM_SENSOR_H][GBCAM_SENSOR_W];
+    int tiles_valid;
+    u8 tiles_matrix[GB_CAMERA_SENSOR_NUM_REGS-GB_CAMERA_SENSOR_MATRIX_REG];
+
+    u8 tiles[GB_CAMERA_SENSOR_TILES_SIZE];
+    u32 clocks;
+};
+
+//-------------------------------------------------------------------------------------
+
+size_t GB_CameraSensorContextSize(void)
+{
+    return sizeof(gb_camera_sensor);
+}
+
+gb_camera_sensor * GB_CameraSensorInit(void * memory, size_t size)
+{
+    if( (memory == NULL) || (size < sizeof(gb_camera_sensor)) ||
+        ((uintptr_t)memory % _Alignof(gb_camera_sensor)) )
+        return NULL;
+
+    gb_camera_sensor * sensor = memory;
+    memset(sensor,0,sizeof(gb_camera_sensor));
+    return sensor;
+}
+
+gb_camera_sensor * GB_CameraSensorCreate(void)
+{
+    void * memory = malloc(sizeof(gb_camera_sensor));
+    if(memory == NULL)
+        return NULL;
+
+    return GB_CameraSensorInit(memory,sizeof(gb_camera_sensor));
+}
+
+void GB_CameraSensorDestroy(gb_camera_sensor * sensor)
+{
+    free(sensor);
+}
+
+void GB_CameraSensorSetRegister(gb_camera_sensor * sensor, unsigned int reg, unsigned char value)
+{
+    if(reg < GB_CAMERA_SENSOR_NUM_REGS)
+        sensor->reg[reg] = value;
+}
+
+unsigned char GB_CameraSensorGetRegister(const gb_camera_sensor * sensor, unsigned int reg)
+{
+    if(reg < GB_CAMERA_SENSOR_NUM_REGS)
+        return sensor->reg[reg];
+    return 0;
+}
+
+void GB_CameraSensorSetRegisters(gb_camera_sensor * sensor,
+                                 const unsigned char regs[GB_CAMERA_SENSOR_NUM_REGS])
+{
+    memcpy(sensor->reg,regs,GB_CAMERA_SENSOR_NUM_REGS);
+}
+
+const unsigned char * GB_CameraSensorGetTiles(const gb_camera_sensor * sensor)
+{
+    return sensor->tiles;
+}
+
+unsigned int GB_CameraSensorGetClocks(const gb_camera_sensor * sensor)
+{
+    return sensor->clocks;
+}
+
+//-------------------------------------------------------------------------------------
+
+static inline int gb_clamp_int(int min, int value, int max)
+{
+    if(value < min) return min;
+    if(value > max) return max;
+    return value;
+}
+
+static inline int gb_min_int(int a, int b) { return (a < b) ? a : b; }
+
+static inline int gb_max_int(int a, int b) { return (a > b) ? a : b; }
+
+//-------------------------------------------------------------------------------------
+
+static inline u32 gb_cam_matrix_process(const gb_camera_sensor * s, u32 value, u32 x, u32 y)
+{
+    x = x & 3;
+    y = y & 3;
+
+    int base = 6 + (y*4 + x) * 3;
+
+    u32 r0 = s->capture_reg[base+0];
+    u32 r1 = s->capture_reg[base+1];
+    u32 r2 = s->capture_reg[base+2];
+
+    if(value < r0) return 0x00;
+    else if(value < r1) return 0x40;
+    else if(value < r2) return 0x80;
+    return 0xC0;
+}
+
+// Edge processing. See doc/sample_code.c for the description of the modes, this is the
+// same code with the buffers of the context.
+
+#define GB_CAM_KERNEL_H BIT(0)
+#define GB_CAM_KERNEL_V BIT(1)
+
+typedef void (*gb_cam_edge_fn)(gb_camera_sensor * s, int alpha4);
+typedef void (*gb_cam_1d_fn)(gb_camera_sensor * s);
+
+// retina_output_buf -> temp_buf. alpha4 = edge ratio * 4
+static inline __attribute__((always_inline))
+void gb_cam_edge_kernel(gb_camera_sensor * s, int kernel, int extraction,
+                        int min_value, int max_value, int alpha4)
+{
+    int i, j;
+    for(j = 0; j < GBCAM_SENSOR_H; j++) for(i = 0; i < GBCAM_SENSOR_W; i++)
+    {
+        int px = s->retina_output_buf[j][i];
+
+        int edge = 0;
+        if(kernel & GB_CAM_KERNEL_H)
+        {
+            int mw = s->retina_output_buf[j][gb_max_int(0,i-1)];
+            int me = s->retina_output_buf[j][gb_min_int(i+1,GBCAM_SENSOR_W-1)];
+            edge += 2*px - mw - me;
+        }
+        if(kernel & GB_CAM_KERNEL_V)
+        {
+            int mn = s->retina_output_buf[gb_max_int(0,j-1)][i];
+            int ms = s->retina_output_buf[gb_min_int(j+1,GBCAM_SENSOR_H-1)][i];
+            edge += 2*px - mn - ms;
+        }
+
+        // Same rounding as px + edge * alpha converted to int
+        int value = extraction ? (edge * alpha4) / 4 : (4 * px + edge * alpha4) / 4;
+
+        s->temp_buf[j][i] = gb_clamp_int(min_value,value,max_value);
+    }
+}
+
+static void gb_cam_edge_copy(gb_camera_sensor * s, int alpha4)
+{
+    memcpy(s->temp_buf,s->retina_output_buf,sizeof(s->temp_buf));
+}
+
+static void gb_cam_edge_zero(gb_camera_sensor * s, int alpha4)
+{
+    memset(s->temp_buf,0,sizeof(s->temp_buf));
+}
+
+#define GB_CAM_DEFINE_EDGE_KERNEL(name, kernel, extraction, min_value, max_value) \
+    static void name(gb_camera_sensor * s, int alpha4) \
+    { \
+        gb_cam_edge_kernel(s,kernel,extraction,min_value,max_value,alpha4); \
+    }
+
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_enh_1d, GB_CAM_KERNEL_H, 0, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_ext_1d, GB_CAM_KERNEL_H, 1, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_enh_1d, GB_CAM_KERNEL_V, 0, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_ext_1d, GB_CAM_KERNEL_V, 1, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_enh_1d, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 0, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_ext_1d, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 1, 0, 255)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_enh, GB_CAM_KERNEL_H, 0, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_h_ext, GB_CAM_KERNEL_H, 1, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_enh, GB_CAM_KERNEL_V, 0, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_v_ext, GB_CAM_KERNEL_V, 1, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_enh, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 0, -128, 127)
+GB_CAM_DEFINE_EDGE_KERNEL(gb_cam_edge_2d_ext, GB_CAM_KERNEL_H|GB_CAM_KERNEL_V, 1, -128, 127)
+
+static const struct {
+    gb_cam_edge_fn edge; // retina_output_buf -> temp_buf
+    int filter_1d; // temp_buf -> retina_output_buf (else, it is copied)
+} gb_cam_filter_modes[16] = {
+    // N = 0
+    { gb_cam_edge_copy,      1 }, // 0x0
+    { gb_cam_edge_zero,      1 }, // 0x1
+    { gb_cam_edge_h_enh_1d,  1 }, // 0x2
+    { gb_cam_edge_h_ext_1d,  1 }, // 0x3
+    { gb_cam_edge_v_enh_1d,  1 }, // 0x4
+    { gb_cam_edge_v_ext_1d,  1 }, // 0x5
+    { gb_cam_edge_2d_enh_1d, 1 }, // 0x6
+    { gb_cam_edge_2d_ext_1d, 1 }, // 0x7
+    // N = 1
+    { gb_cam_edge_copy,      0 }, // 0x8
+    { gb_cam_edge_zero,      0 }, // 0x9
+    { gb_cam_edge_h_enh,     0 }, // 0xA
+    { gb_cam_edge_h_ext,     0 }, // 0xB
+    { gb_cam_edge_v_enh,     0 }, // 0xC
+    { gb_cam_edge_v_ext,     0 }, // 0xD
+    { gb_cam_edge_2d_enh,    0 }, // 0xE
+    { gb_cam_edge_2d_ext,    0 }, // 0xF
+};
+
+// 1-D filtering: the lines selected in P are added, the ones in M are subtracted.
+// temp_buf -> retina_output_buf
+static inline __attribute__((always_inline))
+void gb_cam_1d_kernel(gb_camera_sensor * s, u32 P_bits, u32 M_bits)
+{
+    int i, j;
+    for(j = 0; j < GBCAM_SENSOR_H; j++) for(i = 0; i < GBCAM_SENSOR_W; i++)
+    {
+        int ms = s->temp_buf[gb_min_int(j+1,GBCAM_SENSOR_H-1)][i];
+        int px = s->temp_buf[j][i];
+
+        int value = 0;
+        if(P_bits&BIT(0)) value += px;
+        if(P_bits&BIT(1)) value += ms;
+        if(M_bits&BIT(0)) value -= px;
+        if(M_bits&BIT(1)) value -= ms;
+        s->retina_output_buf[j][i] = gb_clamp_int(-128,value,127);
+    }
+}
+
+#define GB_CAM_DEFINE_1D_KERNEL(name, P_bits, M_bits) \
+    static void name(gb_camera_sensor * s) \
+    { \
+        gb_cam_1d_kernel(s,P_bits,M_bits); \
+    }
+
+GB_CAM_DEFINE_1D_KERNEL(gb_cam_1d_p0_m1, 0x00, 0x01)
+GB_CAM_DEFINE_1D_KERNEL(gb_cam_1d_p1_m0, 0x01, 0x00)
+GB_CAM_DEFINE_1D_KERNEL(gb_cam_1d_p1_m2, 0x01, 0x02)
+
+// P and M registers of the sensor depending on bits 1 and 2 of register 0.
+static const gb_cam_1d_fn gb_cam_1d_kernels[4] = {
+    gb_cam_1d_p0_m1, // P = 0x00, M = 0x01
+    gb_cam_1d_p1_m0, // P = 0x01, M = 0x00
+    gb_cam_1d_p1_m2, // P = 0x01, M = 0x02
+    gb_cam_1d_p1_m2  // P = 0x01, M = 0x02
+};
+
+//-------------------------------------------------------------------------------------
+
+static u32 gb_cam_capture_clocks(const u8 * reg)
+{
+    u32 N_bit = (reg[1] & BIT(7)) >> 7;
+    u32 EXPOSURE_bits = reg[3] | (reg[2]<<8);
+
+    return 4 * ( 32446 + ( N_bit ? 0 : 512 ) + 16 * EXPOSURE_bits );
+}
+
+// frame -> retina_output_buf with the latched registers
+static void gb_cam_sensor_stage(gb_camera_sensor * s, const unsigned char * frame, int stride)
+{
+    int i, j;
+
+    //------------------------------------------------
+
+    // Get configuration
+    // -----------------
+
+    // Register 0
+    gb_cam_1d_fn filter_1d = gb_cam_1d_kernels[(s->capture_reg[0]>>1)&3];
+
+    // Register 1
+    u32 N_bit = (s->capture_reg[1] & BIT(7)) >> 7;
+    u32 VH_bits = (s->capture_reg[1] & (BIT(6)|BIT(5))) >> 5;
+
+    // Registers 2 and 3
+    u32 EXPOSURE_bits = s->capture_reg[3] | (s->capture_reg[2]<<8);
+
+    // Register 4
+    static const int edge_ratio_lut[8] = { 2, 3, 4, 5, 8, 12, 16, 20 }; // 0.50, 0.75, ... 5.00 (x4)
+
+    int EDGE_alpha4 = edge_ratio_lut[(s->capture_reg[4] & 0x70)>>4];
+
+    u32 E3_bit = (s->capture_reg[4] & BIT(7)) >> 7;
+    u32 I_bit = (s->capture_reg[4] & BIT(3)) >> 3;
+
+    //------------------------------------------------
+
+    // Sensor handling
+    // ---------------
+
+    // Color correction, exposure time, inversion and conversion to signed values
+    for(j = 0; j < GBCAM_SENSOR_H; j++)
+    {
+        const unsigned char * src = &frame[j*stride];
+
+        for(i = 0; i < GBCAM_SENSOR_W; i++)
+        {
+            int value = src[i];
+            value = ( (value * EXPOSURE_bits ) / 0x0300 ); // 0x0300 could be other values
+            value = 128 + (((value-128) * 1)/8); // "adapt" to "3.1"/5.0 V
+            value = gb_clamp_int(0,value,255);
+
+            if(I_bit) // Invert image
+                value = 255-value;
+
+            s->retina_output_buf[j][i] = value-128;
+        }
+    }
+
+    u32 filtering_mode = (N_bit<<3) | (VH_bits<<1) | E3_bit;
+
+    gb_cam_filter_modes[filtering_mode].edge(s,EDGE_alpha4);
+
+    if(gb_cam_filter_modes[filtering_mode].filter_1d)
+        filter_1d(s);
+    else
+        memcpy(s->retina_output_buf,s->temp_buf,sizeof(s->retina_output_buf));
+}
+
+// retina_output_buf -> tiles with the latched matrix
+static void gb_cam_controller_stage(gb_camera_sensor * s)
+{
+    int i, j;
+
+    // Convert to Game Boy colors using the controller matrix and then to tiles. The
+    // values are converted back to unsigned before applying the matrix.
+    memset(s->tiles,0,sizeof(s->tiles));
+    for(j = 0; j < GBCAM_H; j++) for(i = 0; i < GBCAM_W; i++)
+    {
+        int value = s->retina_output_buf[j+(GBCAM_SENSOR_EXTRA_LINES/2)][i] + 128;
+
+        u8 outcolor = 3 - (gb_cam_matrix_process(s,value,i,j) >> 6);
+
+        u8 * tile_base = &s->tiles[((j>>3)*16 + (i>>3))*16 + (j&7)*2];
+
+        if(outcolor & 1) tile_base[0] |= 1<<(7-(7&i));
+        if(outcolor & 2) tile_base[1] |= 1<<(7-(7&i));
+    }
+}
+
+static int gb_cam_retina_is_cached(const gb_camera_sensor * s, const unsigned char * frame,
+                                   int stride)
+{
+    int j;
+
+    if(!s->retina_valid)
+        return 0;
+
+    // Bit 0 of A000 is the trigger, it doesn't affect the picture
+    if( ((s->retina_reg[0] ^ s->capture_reg[0]) & (BIT(2)|BIT(1))) ||
+        memcmp(&s->retina_reg[1],&s->capture_reg[1],GB_CAMERA_SENSOR_MATRIX_REG-1) )
+        return 0;
+
+    for(j = 0; j < GBCAM_SENSOR_H; j++)
+    {
+        if(memcmp(s->retina_frame[j],&frame[j*stride],GBCAM_SENSOR_W))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Processes a frame with the latched registers. The result is left in the tiles buffer.
+// Only the stages whose inputs have changed since the last capture are run, so changing
+// only the matrix registers just quantizes the image again.
+static void gb_cam_process(gb_camera_sensor * s, const unsigned char * frame, int stride)
+{
+    int j;
+
+    if(!gb_cam_retina_is_cached(s,frame,stride))
+    {
+        gb_cam_sensor_stage(s,frame,stride);
+
+        memcpy(s->retina_reg,s->capture_reg,GB_CAMERA_SENSOR_MATRIX_REG);
+        for(j = 0; j < GBCAM_SENSOR_H; j++)
+            memcpy(s->retina_frame[j],&frame[j*stride],GBCAM_SENSOR_W);
+        s->retina_valid = 1;
+        s->tiles_valid = 0;
+    }
+
+    if( s->tiles_valid &&
+        (memcmp(s->tiles_matrix,&s->capture_reg[GB_CAMERA_SENSOR_MATRIX_REG],
+                sizeof(s->tiles_matrix)) == 0) )
+        return;
+
+    gb_cam_controller_stage(s);
+
+    memcpy(s->tiles_matrix,&s->capture_reg[GB_CAMERA_SENSOR_MATRIX_REG],sizeof(s->tiles_matrix));
+    s->tiles_valid = 1;
+}
+
+//-------------------------------------------------------------------------------------
+
+void GB_CameraSensorSubmitFrame(gb_camera_sensor * s, const unsigned char * frame, int stride)
+{
+    memcpy(s->capture_reg,s->reg,sizeof(s->capture_reg));
+    s->clocks = gb_cam_capture_clocks(s->capture_reg);
+    s->busy = 0;
+    s->tiles_pending = 0;
+
+    gb_cam_process(s,frame,stride);
+}
+
+//-------------------------------------------------------------------------------------
+
+void GB_CameraSensorSetCallback(gb_camera_sensor * s, gb_camera_sensor_callback callback,
+                                void * userdata)
+{
+    s->callback = callback;
+    s->callback_data = userdata;
+}
+
+void GB_CameraSensorStartCapture(gb_camera_sensor * s, const unsigned char * frame, int stride,
+                                 unsigned long long cycle)
+{
+    int j;
+
+    memcpy(s->capture_reg,s->reg,sizeof(s->capture_reg));
+    for(j = 0; j < GBCAM_SENSOR_H; j++)
+        memcpy(s->capture_frame[j],&frame[j*stride],GBCAM_SENSOR_W);
+
+    // A capture that was never read is simply dropped
+    s->clocks = gb_cam_capture_clocks(s->capture_reg);
+    s->busy_until = cycle + s->clocks;
+    s->busy = 1;
+    s->tiles_pending = 0;
+}
+
+unsigned long long GB_CameraSensorGetNextEvent(const gb_camera_sensor * s)
+{
+    return s->busy ? s->busy_until : GB_CAMERA_SENSOR_NO_EVENT;
+}
+
+void GB_CameraSensorRunUntil(gb_camera_sensor * s, unsigned long long cycle)
+{
+    if( (!s->busy) || (cycle < s->busy_until) )
+        return;
+
+    s->busy = 0;
+    s->tiles_pending = 1;
+
+    if(s->callback)
+        s->callback(s,s->callback_data);
+}
+
+unsigned char GB_CameraSensorReadStatus(gb_camera_sensor * s, unsigned long long cycle)
+{
+    GB_CameraSensorRunUntil(s,cycle);
+
+    return (s->reg[0] & (BIT(2)|BIT(1))) | (s->busy ? BIT(0) : 0);
+}
+
+const unsigned char * GB_CameraSensorTakeTiles(gb_camera_sensor * s, unsigned long long cycle)
+{
+    GB_CameraSensorRunUntil(s,cycle);
+
+    if(!s->tiles_pending)
+        return NULL;
+
+    gb_cam_process(s,&s->capture_frame[0][0],GBCAM_SENSOR_W);
+    s->tiles_pending = 0;
+
+    return s->tiles;
+}
+
+//-------------------------------------------------------------------------------------
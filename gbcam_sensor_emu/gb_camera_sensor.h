@@ -0,0 +1,105 @@
+
+#ifndef __GB_CAMERA_SENSOR__
+#define __GB_CAMERA_SENSOR__
+
+#include <stddef.h>
+
+//-------------------------------------------------------------------------------------
+
+// Emulation of the M64282FP sensor and the matrix of the Game Boy Camera controller.
+//
+// It is the same code as doc/sample_code.c, but all the state is kept in a context
+// instead of globals, so any number of cameras can be emulated in the same process.
+// Different contexts can be used from different threads at the same time. A context
+// must not be used by more than one thread at a time.
+
+#define GB_CAMERA_SENSOR_W (128)
+#define GB_CAMERA_SENSOR_H (112+8) // The controller skips 4 lines at the top and bottom
+
+#define GB_CAMERA_SENSOR_NUM_REGS (0x36) // A000-A035 of the cartridge
+
+#define GB_CAMERA_SENSOR_TILES_SIZE (16*14*16) // 16x14 tiles, 2 bpp
+
+typedef struct gb_camera_sensor gb_camera_sensor;
+
+//-------------------------------------------------------------------------------------
+
+// The context can be allocated by the library or placed in memory owned by the caller
+// (an arena, a static buffer...). The memory must be aligned like the memory returned by
+// malloc(). GB_CameraSensorInit() returns NULL if it is too small or misaligned. All
+// registers start at 0.
+
+size_t GB_CameraSensorContextSize(void);
+gb_camera_sensor * GB_CameraSensorInit(void * memory, size_t size);
+
+gb_camera_sensor * GB_CameraSensorCreate(void); // Returns NULL on error
+void GB_CameraSensorDestroy(gb_camera_sensor * sensor); // Only for GB_CameraSensorCreate()
+
+//-------------------------------------------------------------------------------------
+
+// Registers A000-A035 as written by the Game Boy. Invalid indexes are ignored.
+void GB_CameraSensorSetRegister(gb_camera_sensor * sensor, unsigned int reg, unsigned char value);
+unsigned char GB_CameraSensorGetRegister(const gb_camera_sensor * sensor, unsigned int reg);
+void GB_CameraSensorSetRegisters(gb_camera_sensor * sensor,
+                                 const unsigned char regs[GB_CAMERA_SENSOR_NUM_REGS]);
+
+// Takes a picture of a GB_CAMERA_SENSOR_W x GB_CAMERA_SENSOR_H luminance frame (values
+// 0-255, stride in bytes) with the current registers. The result can be read with the
+// functions below until the next frame is submitted.
+//
+// The output of the sensor is kept until the frame or A000-A005 change. If only the matrix
+// registers are different the image is just quantized again, and if nothing has changed
+// the previous tiles are reused. This applies to GB_CameraSensorTakeTiles() as well.
+void GB_CameraSensorSubmitFrame(gb_camera_sensor * sensor, const unsigned char * frame,
+                                int stride);
+
+// Tiles that the controller writes to SRAM (bank 0, offset 0x0100). After a capture started
+// with GB_CameraSensorStartCapture() they are only updated by GB_CameraSensorTakeTiles().
+const unsigned char * GB_CameraSensorGetTiles(const gb_camera_sensor * sensor);
+
+// CPU clocks that the capture takes in the Game Boy (A000 bit 0 is set until then).
+unsigned int GB_CameraSensorGetClocks(const gb_camera_sensor * sensor);
+
+//-------------------------------------------------------------------------------------
+
+// Event interface for emulators. Instead of counting down the clocks of the capture every
+// CPU cycle, the emulator tells the sensor the current cycle (any monotonic counter of
+// CPU clocks) when something happens, and can ask when the next event is due to schedule
+// it or to skip the time until then.
+//
+// The picture isn't processed when the capture finishes, but the first time the tiles are
+// taken. Captures that are never read don't cost anything.
+
+#define GB_CAMERA_SENSOR_NO_EVENT (~0ULL)
+
+// Called from GB_CameraSensorRunUntil() (or any function that takes a cycle) when the
+// capture finishes.
+typedef void (*gb_camera_sensor_callback)(gb_camera_sensor * sensor, void * userdata);
+
+void GB_CameraSensorSetCallback(gb_camera_sensor * sensor, gb_camera_sensor_callback callback,
+                                void * userdata);
+
+// To be called when A000 is written with bit 0 set. The registers and the frame are
+// latched, so they can be changed right after this.
+void GB_CameraSensorStartCapture(gb_camera_sensor * sensor, const unsigned char * frame,
+                                 int stride, unsigned long long cycle);
+
+// Cycle when the capture in progress finishes, or GB_CAMERA_SENSOR_NO_EVENT.
+unsigned long long GB_CameraSensorGetNextEvent(const gb_camera_sensor * sensor);
+
+// Handles the events that are due at the specified cycle.
+void GB_CameraSensorRunUntil(gb_camera_sensor * sensor, unsigned long long cycle);
+
+// Value read from A000: bits 1 and 2 as written, bit 0 set while the capture is running.
+unsigned char GB_CameraSensorReadStatus(gb_camera_sensor * sensor, unsigned long long cycle);
+
+// Returns the tiles of the last capture if it has finished and they haven't been taken
+// yet, NULL otherwise. The emulator should call this when the cartridge RAM is accessed
+// (or saved) and copy the result to bank 0, offset 0x0100. Note that RAM reads return 00h
+// while the capture is running.
+const unsigned char * GB_CameraSensorTakeTiles(gb_camera_sensor * sensor,
+                                               unsigned long long cycle);
+
+//-------------------------------------------------------------------------------------
+
+#endif // __GB_CAMERA_SENSOR__
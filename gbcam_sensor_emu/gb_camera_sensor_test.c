@@ -0,0 +1,310 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "gb_camera_sensor.h"
+
+//-------------------------------------------------------------------------------------
+
+// Compares the library against doc/sample_code.c with random registers and frames. Every
+// thread uses its own contexts, the reference uses globals so it is protected by a mutex.
+
+#define TEST_THREADS (4)
+#define TEST_STEPS (400)
+
+#define TEST_STRIDE (GB_CAMERA_SENSOR_W+3) // Not the width, to test the stride
+
+//-------------------------------------------------------------------------------------
+
+// Globals and helpers of the emulator used by the reference code
+
+typedef unsigned int u32;
+typedef unsigned char u8;
+
+u8 CAM_REG[0x36];
+u8 SRAM[16][0x2000];
+u32 CAM_CLOCKS_LEFT;
+
+static inline int gb_clamp_int(int min, int value, int max)
+{
+    if(value < min) return min;
+    if(value > max) return max;
+    return value;
+}
+
+static inline int gb_min_int(int a, int b) { return (a < b) ? a : b; }
+
+static inline int gb_max_int(int a, int b) { return (a > b) ? a : b; }
+
+static const unsigned char * ref_frame;
+
+#include "../doc/sample_code.c"
+
+// Frame source of the reference. Its buffers are column-major.
+int GB_CameraSourceGetFrame(int out[GB_CAMERA_SOURCE_W][GB_CAMERA_SOURCE_H])
+{
+    int i, j;
+    for(i = 0; i < GB_CAMERA_SOURCE_W; i++) for(j = 0; j < GB_CAMERA_SOURCE_H; j++)
+        out[i][j] = ref_frame[j*TEST_STRIDE+i];
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+static CRITICAL_SECTION ref_mutex;
+#define Ref_Lock() EnterCriticalSection(&ref_mutex)
+#define Ref_Unlock() LeaveCriticalSection(&ref_mutex)
+#else
+static pthread_mutex_t ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define Ref_Lock() pthread_mutex_lock(&ref_mutex)
+#define Ref_Unlock() pthread_mutex_unlock(&ref_mutex)
+#endif
+
+static void Ref_TakePicture(const unsigned char * regs, const unsigned char * frame,
+                            unsigned char * tiles, unsigned int * clocks)
+{
+    Ref_Lock();
+
+    memcpy(CAM_REG,regs,sizeof(CAM_REG));
+    ref_frame = frame;
+    GB_CameraTakePicture();
+    memcpy(tiles,&(SRAM[0][0x0100]),GB_CAMERA_SENSOR_TILES_SIZE);
+    *clocks = CAM_CLOCKS_LEFT;
+
+    Ref_Unlock();
+}
+
+//-------------------------------------------------------------------------------------
+
+typedef struct {
+    int index;
+    unsigned int seed;
+    int errors;
+    int callbacks;
+} test_thread;
+
+static unsigned int Test_Random(test_thread * t) // xorshift, rand() isn't thread safe
+{
+    t->seed ^= t->seed << 13;
+    t->seed ^= t->seed >> 17;
+    t->seed ^= t->seed << 5;
+    return t->seed;
+}
+
+static void Test_Error(test_thread * t, int step, const char * msg)
+{
+    if(t->errors < 10)
+        printf("Thread %d, step %d: %s\n",t->index,step,msg);
+    t->errors++;
+}
+
+static void Test_Callback(gb_camera_sensor * sensor, void * userdata)
+{
+    test_thread * t = userdata;
+    t->callbacks++;
+}
+
+//-------------------------------------------------------------------------------------
+
+enum {
+    CHANGE_ALL,
+    CHANGE_MATRIX, // A006-A035 only, the output of the sensor is reused
+    CHANGE_SENSOR, // One bit of A000-A005
+    CHANGE_FRAME, // Some pixels of the same frame buffer
+    CHANGE_NONE,
+
+    CHANGE_NUM
+};
+
+static void Test_Change(test_thread * t, int change, unsigned char * regs, unsigned char * frame)
+{
+    int i;
+
+    switch(change)
+    {
+        case CHANGE_ALL:
+            for(i = 0; i < GB_CAMERA_SENSOR_NUM_REGS; i++)
+                regs[i] = Test_Random(t);
+            regs[2] &= 0x3F; // Keep the exposure times (and the test) short
+            for(i = 0; i < TEST_STRIDE*GB_CAMERA_SENSOR_H; i++)
+                frame[i] = Test_Random(t);
+            break;
+        case CHANGE_MATRIX:
+            for(i = 6; i < GB_CAMERA_SENSOR_NUM_REGS; i++)
+                regs[i] = Test_Random(t);
+            break;
+        case CHANGE_SENSOR:
+            regs[Test_Random(t) % 6] ^= 1 << (Test_Random(t) % 8);
+            regs[2] &= 0x3F;
+            break;
+        case CHANGE_FRAME:
+            for(i = 0; i < 16; i++)
+            {
+                int x = Test_Random(t) % GB_CAMERA_SENSOR_W;
+                int y = Test_Random(t) % GB_CAMERA_SENSOR_H;
+                frame[y*TEST_STRIDE+x] = Test_Random(t);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void Test_Thread(test_thread * t)
+{
+    unsigned char regs[GB_CAMERA_SENSOR_NUM_REGS];
+    unsigned char * frame = malloc(TEST_STRIDE*GB_CAMERA_SENSOR_H);
+    unsigned char tiles[GB_CAMERA_SENSOR_TILES_SIZE];
+    unsigned int clocks;
+
+    // One context allocated by the library and one in memory owned by the caller
+    gb_camera_sensor * sensor = GB_CameraSensorCreate();
+    size_t size = GB_CameraSensorContextSize();
+    void * memory = malloc(size);
+    gb_camera_sensor * emu = GB_CameraSensorInit(memory,size);
+
+    if( (frame == NULL) || (sensor == NULL) || (emu == NULL) )
+    {
+        Test_Error(t,0,"Can't create the contexts");
+        goto end;
+    }
+
+    GB_CameraSensorSetCallback(emu,Test_Callback,t);
+
+    unsigned long long cycle = 0;
+    int step;
+    for(step = 0; step < TEST_STEPS; step++)
+    {
+        int change = (step == 0) ? CHANGE_ALL : (Test_Random(t) % CHANGE_NUM);
+        Test_Change(t,change,regs,frame);
+
+        Ref_TakePicture(regs,frame,tiles,&clocks);
+
+        // Synchronous interface
+
+        GB_CameraSensorSetRegisters(sensor,regs);
+        GB_CameraSensorSubmitFrame(sensor,frame,TEST_STRIDE);
+
+        if(memcmp(GB_CameraSensorGetTiles(sensor),tiles,sizeof(tiles)))
+            Test_Error(t,step,"SubmitFrame: Different tiles");
+        if(GB_CameraSensorGetClocks(sensor) != clocks)
+            Test_Error(t,step,"SubmitFrame: Different clocks");
+
+        // Event interface. The registers and the frame are changed while the capture is
+        // running, the latched ones must be used.
+
+        GB_CameraSensorSetRegisters(emu,regs);
+        GB_CameraSensorStartCapture(emu,frame,TEST_STRIDE,cycle);
+
+        unsigned char saved_reg = regs[1];
+        unsigned char saved_pixel = frame[0];
+        GB_CameraSensorSetRegister(emu,1,saved_reg ^ 0x80);
+        frame[0] = ~saved_pixel;
+
+        int callbacks = t->callbacks;
+        unsigned long long event = GB_CameraSensorGetNextEvent(emu);
+
+        if(event != cycle + clocks)
+            Test_Error(t,step,"Event: Wrong end of the capture");
+        if(!(GB_CameraSensorReadStatus(emu,event - 1) & 1))
+            Test_Error(t,step,"Event: Not busy before the end of the capture");
+        if(GB_CameraSensorTakeTiles(emu,event - 1) != NULL)
+            Test_Error(t,step,"Event: Tiles available before the end of the capture");
+
+        GB_CameraSensorRunUntil(emu,event - 1);
+        if(t->callbacks != callbacks)
+            Test_Error(t,step,"Event: Callback before the end of the capture");
+        GB_CameraSensorRunUntil(emu,event);
+        if(t->callbacks != callbacks + 1)
+            Test_Error(t,step,"Event: No callback at the end of the capture");
+
+        if(GB_CameraSensorReadStatus(emu,event) & 1)
+            Test_Error(t,step,"Event: Busy after the end of the capture");
+        if(GB_CameraSensorGetNextEvent(emu) != GB_CAMERA_SENSOR_NO_EVENT)
+            Test_Error(t,step,"Event: Event after the end of the capture");
+
+        const unsigned char * taken = GB_CameraSensorTakeTiles(emu,event + 1);
+        if( (taken == NULL) || memcmp(taken,tiles,sizeof(tiles)) )
+            Test_Error(t,step,"Event: Different tiles");
+        if(GB_CameraSensorTakeTiles(emu,event + 2) != NULL)
+            Test_Error(t,step,"Event: Tiles taken twice");
+
+        frame[0] = saved_pixel;
+        GB_CameraSensorSetRegister(emu,1,saved_reg);
+
+        cycle = event + (Test_Random(t) % 10000);
+    }
+
+end:
+    GB_CameraSensorDestroy(sensor);
+    free(memory);
+    free(frame);
+}
+
+//-------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+static DWORD WINAPI Test_ThreadEntry(LPVOID arg)
+#else
+static void * Test_ThreadEntry(void * arg)
+#endif
+{
+    Test_Thread(arg);
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    test_thread threads[TEST_THREADS];
+#ifdef _WIN32
+    HANDLE handles[TEST_THREADS];
+    InitializeCriticalSection(&ref_mutex);
+#else
+    pthread_t handles[TEST_THREADS];
+#endif
+
+    int i;
+    for(i = 0; i < TEST_THREADS; i++)
+    {
+        threads[i].index = i;
+        threads[i].seed = 0x12345678 + i * 0x9E3779B9;
+        threads[i].errors = 0;
+        threads[i].callbacks = 0;
+#ifdef _WIN32
+        handles[i] = CreateThread(NULL,0,Test_ThreadEntry,&threads[i],0,NULL);
+#else
+        pthread_create(&handles[i],NULL,Test_ThreadEntry,&threads[i]);
+#endif
+    }
+
+    int errors = 0;
+    for(i = 0; i < TEST_THREADS; i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(handles[i],INFINITE);
+        CloseHandle(handles[i]);
+#else
+        pthread_join(handles[i],NULL);
+#endif
+        errors += threads[i].errors;
+    }
+
+    if(errors)
+    {
+        printf("FAILED: %d errors\n",errors);
+        return 1;
+    }
+
+    printf("OK: %d threads, %d captures each\n",TEST_THREADS,TEST_STEPS);
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
@@ -0,0 +1,470 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//-------------------------------------------------------------------------------------
+
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+
+//-------------------------------------------------------------------------------------
+
+//Binary trace format of gbcam_arduino_due_helper. Every event is a 7 byte record:
+//
+//   byte 0:   TRACE_SYNC | event
+//   byte 1-3: XCK clocks since the previous event (little endian, saturated to 0xFFFFFF)
+//             The clocks of lost events are added to the next one, so the time is kept.
+//   byte 4-5: arguments. LOAD: register address, value. DROPPED: number of lost events
+//             (little endian). 0 otherwise.
+//   byte 6:   checksum, the sum of the 7 bytes is TRACE_CHECKSUM (modulo 256)
+
+#define TRACE_SYNC      (0xA0)
+#define TRACE_SYNC_MASK (0xF0)
+
+#define EVENT_RESET      (0)
+#define EVENT_START      (1)
+#define EVENT_READ_START (2)
+#define EVENT_READ_END   (3)
+#define EVENT_LOAD       (4)
+#define EVENT_DROPPED    (5)
+
+#define TRACE_RECORD_SIZE (7)
+#define TRACE_CHECKSUM (0xFF)
+
+//Sensor clock (half of PHI)
+#define XCK_HZ (524288.0)
+
+//-------------------------------------------------------------------------------------
+
+typedef struct {
+    int type;
+    u32 delta;      // clocks since the previous event
+    unsigned long long time; // clocks since the start of the trace
+    u32 arg0, arg1;
+} trace_event;
+
+static trace_event * events = NULL;
+static int num_events = 0;
+static int resyncs = 0; // number of times the decoder had to look for the next record
+
+//-------------------------------------------------------------------------------------
+
+static const char * EventName(int type)
+{
+    switch(type)
+    {
+        case EVENT_RESET: return "RESET";
+        case EVENT_START: return "START";
+        case EVENT_READ_START: return "READ START";
+        case EVENT_READ_END: return "READ END";
+        case EVENT_LOAD: return "LOAD REG";
+        case EVENT_DROPPED: return "DROPPED";
+        default: return "UNKNOWN";
+    }
+}
+
+//Checks the whole record, not only the tag, so that data bytes that look like a tag aren't
+//taken as the start of a record.
+static int IsValidRecord(const u8 * r)
+{
+    if((r[0] & TRACE_SYNC_MASK) != TRACE_SYNC)
+        return 0;
+
+    u8 sum = 0;
+    int i;
+    for(i = 0; i < TRACE_RECORD_SIZE; i++)
+        sum += r[i];
+    if(sum != TRACE_CHECKSUM)
+        return 0;
+
+    switch(r[0] & 0x0F)
+    {
+        case EVENT_RESET:
+        case EVENT_START:
+        case EVENT_READ_START:
+        case EVENT_READ_END:
+            return (r[4] == 0) && (r[5] == 0);
+        case EVENT_LOAD:
+            return r[4] < 8;
+        case EVENT_DROPPED:
+            return (r[1] | r[2] | r[3]) == 0 && (r[4] | r[5]) != 0;
+        default:
+            return 0;
+    }
+}
+
+//After a corrupted record, the next one is only trusted if the one after it is valid too
+static int IsSyncPoint(const u8 * data, int offset, int size)
+{
+    if(!IsValidRecord(&data[offset]))
+        return 0;
+    if(offset + 2 * TRACE_RECORD_SIZE > size)
+        return 1;
+    return IsValidRecord(&data[offset + TRACE_RECORD_SIZE]);
+}
+
+//Decodes a trace in memory. If a record is corrupted, bytes are skipped until a valid
+//record is found.
+int TraceDecode(const u8 * data, int size)
+{
+    free(events);
+    events = malloc(sizeof(trace_event) * (size / TRACE_RECORD_SIZE + 1));
+    if(events == NULL)
+        return -1;
+
+    num_events = 0;
+    resyncs = 0;
+
+    unsigned long long time = 0;
+
+    int offset = 0;
+    while(offset + TRACE_RECORD_SIZE <= size)
+    {
+        const u8 * r = &data[offset];
+
+        if(!IsValidRecord(r))
+        {
+            resyncs++;
+            offset++;
+            while( (offset + TRACE_RECORD_SIZE <= size) && !IsSyncPoint(data,offset,size) )
+                offset++;
+            continue;
+        }
+
+        trace_event * e = &events[num_events++];
+        e->type = r[0] & 0x0F;
+        e->delta = r[1] | (r[2] << 8) | (r[3] << 16);
+        if(e->type == EVENT_DROPPED)
+        {
+            e->arg0 = r[4] | (r[5] << 8);
+            e->arg1 = 0;
+        }
+        else
+        {
+            e->arg0 = r[4];
+            e->arg1 = r[5];
+        }
+
+        time += e->delta;
+        e->time = time;
+
+        offset += TRACE_RECORD_SIZE;
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+//Prints every event in the format used by the old text output of the helper, and a
+//summary of every capture: the sensor registers loaded before it and its timings.
+void TracePrint(FILE * f)
+{
+    int regs[8];
+    int regs_loaded = 0;
+    unsigned long long start_time = 0, read_start_time = 0;
+    int capture = 0;
+
+    int i;
+    for(i = 0; i < 8; i++) regs[i] = -1;
+
+    for(i = 0; i < num_events; i++)
+    {
+        trace_event * e = &events[i];
+
+        switch(e->type)
+        {
+            case EVENT_LOAD:
+                fprintf(f,"LOAD REG %u ([%X] = %X)\n",e->delta,e->arg0,e->arg1);
+                regs[e->arg0 & 7] = e->arg1;
+                regs_loaded++;
+                break;
+
+            case EVENT_DROPPED:
+                fprintf(f,"DROPPED %u EVENTS\n",e->arg0);
+                break;
+
+            case EVENT_START:
+            {
+                fprintf(f,"START %u\n",e->delta);
+
+                fprintf(f,"  Capture %d: %d registers loaded:",capture,regs_loaded);
+                int j;
+                for(j = 0; j < 8; j++)
+                {
+                    if(regs[j] >= 0) fprintf(f," [%d]=%02X",j,regs[j]);
+                    else fprintf(f," [%d]=--",j);
+                }
+                fprintf(f,"\n");
+
+                regs_loaded = 0;
+                start_time = e->time;
+                break;
+            }
+
+            case EVENT_READ_START:
+                fprintf(f,"READ START %u\n",e->delta);
+                read_start_time = e->time;
+                if(start_time != 0)
+                {
+                    fprintf(f,"  Capture %d: exposure %llu clocks (%.3f ms)\n",capture,
+                            e->time - start_time,((e->time - start_time)*1000.0)/XCK_HZ);
+                }
+                break;
+
+            case EVENT_READ_END:
+                fprintf(f,"READ END %u\n",e->delta);
+                if(read_start_time != 0)
+                {
+                    fprintf(f,"  Capture %d: read %llu clocks (%.3f ms)\n",capture,
+                            e->time - read_start_time,((e->time - read_start_time)*1000.0)/XCK_HZ);
+                    capture++;
+                }
+                start_time = 0;
+                read_start_time = 0;
+                break;
+
+            default:
+                fprintf(f,"%s %u\n",EventName(e->type),e->delta);
+                break;
+        }
+    }
+
+    if(resyncs)
+        fprintf(f,"WARNING: %d corrupted records skipped\n",resyncs);
+}
+
+//-------------------------------------------------------------------------------------
+
+static unsigned long long ClocksToNs(unsigned long long clocks)
+{
+    return (unsigned long long)((clocks * 1000000000.0) / XCK_HZ + 0.5);
+}
+
+static void VCDWriteBits(FILE * f, u32 value, int bits, char id)
+{
+    fprintf(f,"b");
+    int i;
+    for(i = bits-1; i >= 0; i--)
+        fputc((value & (1<<i)) ? '1' : '0', f);
+    fprintf(f," %c\n",id);
+}
+
+//RESET, START and LOAD are written as pulses of one clock. READ is high between the
+//READ START and READ END events.
+int TraceExportVCD(const char * filename)
+{
+    FILE * f = fopen(filename,"w");
+    if(f == NULL)
+    {
+        printf("Can't open %s\n",filename);
+        return -1;
+    }
+
+    fprintf(f,"$comment GB Camera sensor trace $end\n");
+    fprintf(f,"$timescale 1ns $end\n");
+    fprintf(f,"$scope module m64282fp $end\n");
+    fprintf(f,"$var wire 1 r RESET $end\n");
+    fprintf(f,"$var wire 1 s START $end\n");
+    fprintf(f,"$var wire 1 d READ $end\n");
+    fprintf(f,"$var wire 1 l LOAD $end\n");
+    fprintf(f,"$var wire 1 x DROPPED $end\n");
+    fprintf(f,"$var wire 3 a REG_ADDR $end\n");
+    fprintf(f,"$var wire 8 v REG_VALUE $end\n");
+    fprintf(f,"$upscope $end\n");
+    fprintf(f,"$enddefinitions $end\n");
+
+    fprintf(f,"#0\n$dumpvars\n1r\n0s\n0d\n0l\n0x\n");
+    VCDWriteBits(f,0,3,'a');
+    VCDWriteBits(f,0,8,'v');
+    fprintf(f,"$end\n");
+
+    int i;
+    for(i = 0; i < num_events; i++)
+    {
+        trace_event * e = &events[i];
+
+        unsigned long long t = ClocksToNs(e->time);
+        unsigned long long t_end = ClocksToNs(e->time + 1);
+
+        //Pulses end before the next event if it happens in the same clock
+        if( (i + 1 < num_events) && (events[i+1].time == e->time) )
+            t_end = t + (t_end - t) / 2;
+
+        switch(e->type)
+        {
+            case EVENT_RESET:
+                fprintf(f,"#%llu\n0r\n#%llu\n1r\n",t,t_end);
+                break;
+            case EVENT_START:
+                fprintf(f,"#%llu\n1s\n#%llu\n0s\n",t,t_end);
+                break;
+            case EVENT_READ_START:
+                fprintf(f,"#%llu\n1d\n",t);
+                break;
+            case EVENT_READ_END:
+                fprintf(f,"#%llu\n0d\n",t);
+                break;
+            case EVENT_LOAD:
+                fprintf(f,"#%llu\n1l\n",t);
+                VCDWriteBits(f,e->arg0,3,'a');
+                VCDWriteBits(f,e->arg1,8,'v');
+                fprintf(f,"#%llu\n0l\n",t_end);
+                break;
+            case EVENT_DROPPED:
+                fprintf(f,"#%llu\n1x\n#%llu\n0x\n",t,t_end);
+                break;
+            default:
+                break;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+static u8 * synth_data = NULL;
+static int synth_size = 0;
+
+static void SynthEvent(int type, u32 delta, u32 arg0, u32 arg1)
+{
+    u8 * r = &synth_data[synth_size];
+    r[0] = TRACE_SYNC | type;
+    r[1] = delta & 0xFF;
+    r[2] = (delta >> 8) & 0xFF;
+    r[3] = (delta >> 16) & 0xFF;
+    r[4] = arg0;
+    r[5] = arg1;
+    r[6] = TRACE_CHECKSUM - (u8)(r[0] + r[1] + r[2] + r[3] + r[4] + r[5]);
+    synth_size += TRACE_RECORD_SIZE;
+}
+
+//Generates the trace of a number of captures with the timings of the documentation.
+int TraceSynthesize(const char * filename, int captures)
+{
+    const u8 regs[8] = { 0x80, 0xE8, 0x15, 0x00, 0x01, 0x00, 0x01, 0x24 };
+
+    synth_data = malloc(captures * 16 * TRACE_RECORD_SIZE);
+    if(synth_data == NULL)
+        return -1;
+    synth_size = 0;
+
+    int c;
+    for(c = 0; c < captures; c++)
+    {
+        u32 exposure = 0x0100 * (c + 1);
+        int n_bit = regs[1] >> 7;
+
+        SynthEvent(EVENT_RESET,c ? 3 : 0,0,0);
+
+        int i;
+        for(i = 0; i < 8; i++)
+            SynthEvent(EVENT_LOAD,i ? 11 : 10,i,(i == 2) ? exposure >> 8 : ((i == 3) ? exposure & 0xFF : regs[i]));
+
+        SynthEvent(EVENT_START,2,0,0);
+        SynthEvent(EVENT_READ_START,8 * exposure + 2,0,0);
+        SynthEvent(EVENT_READ_END,n_bit ? 16128 : 16384,0,0);
+
+        if(c == captures / 2) // Test corrupted data in the middle of the trace
+        {
+            synth_data[synth_size++] = 0x00;
+            SynthEvent(EVENT_DROPPED,0,2,0);
+        }
+    }
+
+    FILE * f = fopen(filename,"wb");
+    if(f == NULL)
+    {
+        printf("Can't open %s\n",filename);
+        free(synth_data);
+        return -1;
+    }
+    fwrite(synth_data,1,synth_size,f);
+    fclose(f);
+
+    free(synth_data);
+    synth_data = NULL;
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------
+
+static void Usage(void)
+{
+    printf("Usage: trace_decoder [-v file.vcd] trace.bin\n"
+           "       trace_decoder -g trace.bin [captures]\n"
+           "\n"
+           "  -v file.vcd  Export the trace as VCD\n"
+           "  -g           Generate a synthetic trace\n");
+}
+
+int main(int argc, char * argv[])
+{
+    const char * vcd_file = NULL;
+    const char * trace_file = NULL;
+    int generate = 0;
+    int captures = 4;
+
+    int i;
+    for(i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i],"-v") && (i + 1 < argc)) vcd_file = argv[++i];
+        else if(!strcmp(argv[i],"-g")) generate = 1;
+        else if(trace_file == NULL) trace_file = argv[i];
+        else captures = atoi(argv[i]);
+    }
+
+    if(trace_file == NULL)
+    {
+        Usage();
+        return 1;
+    }
+
+    if(generate)
+        return (TraceSynthesize(trace_file,captures) == 0) ? 0 : 2;
+
+    FILE * f = fopen(trace_file,"rb");
+    if(f == NULL)
+    {
+        printf("Can't open %s\n",trace_file);
+        return 2;
+    }
+    fseek(f,0,SEEK_END);
+    long size = ftell(f);
+    fseek(f,0,SEEK_SET);
+    u8 * data = malloc(size > 0 ? size : 1);
+    if( (data == NULL) || (fread(data,1,size,f) != (size_t)size) )
+    {
+        printf("Can't read %s\n",trace_file);
+        fclose(f);
+        free(data);
+        return 2;
+    }
+    fclose(f);
+
+    if(TraceDecode(data,size) != 0)
+    {
+        free(data);
+        return 2;
+    }
+    free(data);
+
+    TracePrint(stdout);
+
+    if(vcd_file)
+    {
+        if(TraceExportVCD(vcd_file) != 0)
+            return 2;
+    }
+
+    free(events);
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------